@@ -5,7 +5,13 @@ project(mpack C CXX ASM)
 add_library(${PROJECT_NAME} ${FILES})
 target_include_directories(${PROJECT_NAME} PUBLIC
 	${MPACK_PATH}/src
+	${CMAKE_CURRENT_LIST_DIR}/../configs/mpack
 )
 target_compile_definitions(${PROJECT_NAME} PUBLIC 
 	MPACK_EXTENSIONS=1
-)
\ No newline at end of file
+	MPACK_HAS_CONFIG=1
+)
+
+if (DITOO_STATIC_ALLOC)
+	target_link_libraries(${PROJECT_NAME} PUBLIC arena)
+endif()
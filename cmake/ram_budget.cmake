@@ -0,0 +1,69 @@
+# Writes <target>.ram.txt next to the ELF after every link: the statically
+# allocated RAM of each subsystem, taken from the linker map, and what is left
+# of every RAM region. See ram_budget_report.cmake for the report itself.
+
+set(DITOO_RAM_BUDGET_SCRIPT ${CMAKE_CURRENT_LIST_DIR}/ram_budget_report.cmake)
+
+# warn when less than this many bytes of main RAM are left
+set(DITOO_RAM_HEADROOM 16384 CACHE STRING "RAM headroom the budget report warns below")
+
+# Archive members only keep their file name in the map, so the sources of a
+# third-party tree are listed by name
+function(_ditoo_ram_owner CONTENT GROUP)
+    set(content ${${CONTENT}})
+    foreach(dir ${ARGN})
+        file(GLOB_RECURSE sources ${dir}/*.c ${dir}/*.S)
+        foreach(source ${sources})
+            get_filename_component(name ${source} NAME)
+            string(APPEND content "set(RAM_OWNER_${name} ${GROUP})\n")
+        endforeach()
+    endforeach()
+    set(${CONTENT} "${content}" PARENT_SCOPE)
+endfunction()
+
+# ditoo_ram_budget(<target> <library>...)
+#
+# Every library is reported as its own subsystem with the sources it builds
+# itself, sources it pulls in through interface libraries are grouped by the
+# tree they come from.
+function(ditoo_ram_budget TARGET)
+    set(groups_file ${CMAKE_CURRENT_BINARY_DIR}/${TARGET}_ram_groups.cmake)
+    set(content "")
+
+    foreach(library ${ARGN})
+        get_target_property(sources ${library} SOURCES)
+        foreach(source ${sources})
+            if (source MATCHES "\\.(c|S)$")
+                get_filename_component(name ${source} NAME)
+                string(APPEND content "set(RAM_MODULE_${library}_${name} TRUE)\n")
+            endif()
+        endforeach()
+    endforeach()
+
+    _ditoo_ram_owner(content btstack
+        ${PICO_SDK_PATH}/lib/btstack/src
+        ${PICO_SDK_PATH}/lib/btstack/3rd-party
+        ${PICO_SDK_PATH}/lib/btstack/platform/embedded
+    )
+    _ditoo_ram_owner(content cyw43 ${PICO_SDK_PATH}/lib/cyw43-driver/src)
+    _ditoo_ram_owner(content tinyusb ${PICO_SDK_PATH}/lib/tinyusb/src)
+    _ditoo_ram_owner(content freertos ${FREERTOS_KERNEL_PATH}/portable/ThirdParty/GCC/RP2040)
+    file(GLOB kernel ${FREERTOS_KERNEL_PATH}/*.c)
+    foreach(source ${kernel})
+        get_filename_component(name ${source} NAME)
+        string(APPEND content "set(RAM_OWNER_${name} freertos)\n")
+    endforeach()
+
+    string(APPEND content "set(RAM_GROUPS \"${ARGN};main;freertos;btstack;cyw43;tinyusb;pico-sdk;toolchain;padding\")\n")
+    file(WRITE ${groups_file} "${content}")
+
+    add_custom_command(TARGET ${TARGET} POST_BUILD
+        COMMAND ${CMAKE_COMMAND}
+            -DMAP=$<TARGET_FILE:${TARGET}>.map
+            -DGROUPS=${groups_file}
+            -DOUTPUT=$<TARGET_FILE_DIR:${TARGET}>/${TARGET}.ram.txt
+            -DHEADROOM=${DITOO_RAM_HEADROOM}
+            -P ${DITOO_RAM_BUDGET_SCRIPT}
+        VERBATIM
+    )
+endfunction()
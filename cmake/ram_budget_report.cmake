@@ -0,0 +1,213 @@
+# Sums the RAM input sections of a GNU ld map file per subsystem.
+#
+# cmake -DMAP=<elf.map> -DGROUPS=<groups.cmake> -DOUTPUT=<report> [-DHEADROOM=<bytes>] -P ram_budget_report.cmake
+#
+# GROUPS is written by ditoo_ram_budget(). Sections count as RAM when their
+# output section lies in a writable memory region, .bss, .uninitialized_data,
+# .heap and the stacks are reported as bss, everything else as data.
+
+include(${GROUPS})
+
+if (NOT HEADROOM)
+    set(HEADROOM 0)
+endif()
+
+foreach(group ${RAM_GROUPS})
+    set(data_${group} 0)
+    set(bss_${group} 0)
+endforeach()
+
+set(toolchain_libs "c|c_nano|g|g_nano|m|gcc|nosys|stdc\\+\\+|stdc\\+\\+_nano|supc\\+\\+|supc\\+\\+_nano")
+
+# returns the subsystem an object of the map belongs to
+function(classify OBJECT RESULT)
+    if (OBJECT MATCHES "lib([^/()]+)\\.a\\(([^)]+)\\)$")
+        set(library ${CMAKE_MATCH_1})
+        string(REGEX REPLACE "\\.(obj|o)$" "" name ${CMAKE_MATCH_2})
+
+        if (RAM_MODULE_${library}_${name})
+            set(group ${library})
+        elseif (RAM_OWNER_${name})
+            set(group ${RAM_OWNER_${name}})
+        elseif (library MATCHES "^(${toolchain_libs})$")
+            set(group toolchain)
+        else ()
+            set(group pico-sdk)
+        endif()
+    elseif (OBJECT MATCHES "FreeRTOS-Kernel")
+        set(group freertos)
+    elseif (OBJECT MATCHES "/btstack/")
+        set(group btstack)
+    elseif (OBJECT MATCHES "/cyw43-driver/")
+        set(group cyw43)
+    elseif (OBJECT MATCHES "/tinyusb/")
+        set(group tinyusb)
+    elseif (OBJECT MATCHES "\\.dir/src/[^/]+$")
+        set(group main)
+    elseif (OBJECT MATCHES "arm-none-eabi")
+        set(group toolchain)
+    else ()
+        set(group pico-sdk)
+    endif()
+
+    set(${RESULT} ${group} PARENT_SCOPE)
+endfunction()
+
+# right aligns TEXT in WIDTH columns, a negative WIDTH aligns it left
+function(pad TEXT WIDTH RESULT)
+    string(LENGTH "${TEXT}" length)
+    if (WIDTH LESS 0)
+        math(EXPR fill "-${WIDTH} - ${length}")
+    else ()
+        math(EXPR fill "${WIDTH} - ${length}")
+    endif()
+    set(spaces "")
+    if (fill GREATER 0)
+        string(REPEAT " " ${fill} spaces)
+    endif()
+    if (WIDTH LESS 0)
+        set(${RESULT} "${TEXT}${spaces}" PARENT_SCOPE)
+    else ()
+        set(${RESULT} "${spaces}${TEXT}" PARENT_SCOPE)
+    endif()
+endfunction()
+
+# memory regions, output and input section lines, symbols are skipped
+file(STRINGS ${MAP} lines REGEX "^([A-Z][A-Z0-9_]* +0x|\\.| \\.| COMMON| \\*fill\\*| +0x[0-9a-fA-F]+ +0x[0-9a-fA-F]+)")
+
+set(regions "")
+set(in_ram FALSE)
+set(section_pending FALSE)
+set(input "")
+
+foreach(line IN LISTS lines)
+    if (line MATCHES "^([A-Z][A-Z0-9_]*) +0x([0-9a-fA-F]+) +0x([0-9a-fA-F]+) +([a-z!]*w[a-z!]*)")
+        set(region ${CMAKE_MATCH_1})
+        math(EXPR region_start_${region} "0x${CMAKE_MATCH_2}")
+        math(EXPR region_size_${region} "0x${CMAKE_MATCH_3}")
+        math(EXPR region_end_${region} "${region_start_${region}} + ${region_size_${region}}")
+        set(region_used_${region} 0)
+        list(APPEND regions ${region})
+        continue()
+    endif()
+
+    set(place "")
+
+    if (line MATCHES "^(\\.[^ ]+)( +0x([0-9a-fA-F]+) +0x([0-9a-fA-F]+))?")
+        # output section, long names carry their address on the next line
+        set(section ${CMAKE_MATCH_1})
+        set(input "")
+        set(in_ram FALSE)
+        if (CMAKE_MATCH_2)
+            set(place ${CMAKE_MATCH_3} ${CMAKE_MATCH_4})
+        else ()
+            set(section_pending TRUE)
+        endif()
+    elseif (line MATCHES "^ (\\.[^ ]+|COMMON|\\*fill\\*)$")
+        set(input ${CMAKE_MATCH_1})
+        continue()
+    elseif (line MATCHES "^ ([^ ]*) +0x([0-9a-fA-F]+) +0x([0-9a-fA-F]+) *(.*)$")
+        if (section_pending)
+            set(section_pending FALSE)
+            set(place ${CMAKE_MATCH_2} ${CMAKE_MATCH_3})
+        else ()
+            set(name ${CMAKE_MATCH_1})
+            set(size ${CMAKE_MATCH_3})
+            set(object ${CMAKE_MATCH_4})
+            if (NOT name)
+                set(name ${input})
+            endif()
+            set(input "")
+
+            if (NOT in_ram OR size MATCHES "^0+$")
+                continue()
+            endif()
+
+            if (name STREQUAL "*fill*")
+                set(group padding)
+            elseif (object)
+                classify("${object}" group)
+            else ()
+                continue()
+            endif()
+
+            if (section MATCHES "^\\.(bss|tbss|uninitialized_data|heap|stack.*)$" OR name MATCHES "^(\\.bss|COMMON)")
+                math(EXPR bss_${group} "${bss_${group}} + 0x${size}")
+            else ()
+                math(EXPR data_${group} "${data_${group}} + 0x${size}")
+            endif()
+        endif()
+    endif()
+
+    if (place)
+        list(GET place 0 address)
+        list(GET place 1 size)
+        math(EXPR address "0x${address}")
+        foreach(region ${regions})
+            if (NOT address LESS region_start_${region} AND address LESS region_end_${region})
+                set(in_ram TRUE)
+                math(EXPR region_used_${region} "${region_used_${region}} + 0x${size}")
+                break()
+            endif()
+        endforeach()
+    endif()
+endforeach()
+
+# report
+pad("subsystem" -16 h0)
+pad("data" 10 h1)
+pad("bss" 10 h2)
+pad("total" 10 h3)
+set(report "${h0}${h1}${h2}${h3}\n")
+
+set(total_data 0)
+set(total_bss 0)
+foreach(group ${RAM_GROUPS})
+    math(EXPR total "${data_${group}} + ${bss_${group}}")
+    if (total EQUAL 0)
+        continue()
+    endif()
+    math(EXPR total_data "${total_data} + ${data_${group}}")
+    math(EXPR total_bss "${total_bss} + ${bss_${group}}")
+
+    pad("${group}" -16 c0)
+    pad("${data_${group}}" 10 c1)
+    pad("${bss_${group}}" 10 c2)
+    pad("${total}" 10 c3)
+    string(APPEND report "${c0}${c1}${c2}${c3}\n")
+endforeach()
+
+math(EXPR total "${total_data} + ${total_bss}")
+pad("total" -16 c0)
+pad("${total_data}" 10 c1)
+pad("${total_bss}" 10 c2)
+pad("${total}" 10 c3)
+string(APPEND report "${c0}${c1}${c2}${c3}\n\n")
+
+pad("region" -16 h0)
+pad("size" 10 h1)
+pad("used" 10 h2)
+pad("free" 10 h3)
+string(APPEND report "${h0}${h1}${h2}${h3}\n")
+
+set(warning "")
+foreach(region ${regions})
+    math(EXPR free "${region_size_${region}} - ${region_used_${region}}")
+    pad("${region}" -16 c0)
+    pad("${region_size_${region}}" 10 c1)
+    pad("${region_used_${region}}" 10 c2)
+    pad("${free}" 10 c3)
+    string(APPEND report "${c0}${c1}${c2}${c3}\n")
+
+    # what is left of main RAM is the heap for malloc and any growth
+    if (region STREQUAL "RAM" AND free LESS HEADROOM)
+        set(warning "only ${free} bytes of RAM left, the budget asks for ${HEADROOM}")
+    endif()
+endforeach()
+
+file(WRITE ${OUTPUT} "${report}")
+message("RAM budget (${OUTPUT}):\n${report}")
+
+if (warning)
+    message(WARNING "${warning}")
+endif()
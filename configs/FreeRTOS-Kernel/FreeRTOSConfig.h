@@ -46,8 +46,15 @@
 
 /* Scheduler Related */
 #define configUSE_PREEMPTION 1
+/* DITOO_TICKLESS_IDLE (off by default) stops the tick while every task waits,
+ * the idle hooks halt the cores either way, see src/power/include/power.h */
+#if DITOO_TICKLESS_IDLE
+#define configUSE_TICKLESS_IDLE 1
+#define configEXPECTED_IDLE_TIME_BEFORE_SLEEP 2
+#else
 #define configUSE_TICKLESS_IDLE 0
-#define configUSE_IDLE_HOOK 0
+#endif
+#define configUSE_IDLE_HOOK 1
 #define configUSE_TICK_HOOK 0
 #define configTICK_RATE_HZ ((TickType_t)1000)
 #define configMAX_PRIORITIES 32
@@ -73,10 +80,21 @@
 #define configSTACK_DEPTH_TYPE uint32_t
 #define configMESSAGE_BUFFER_LENGTH_TYPE size_t
 
-/* Memory allocation related definitions. */
+/* Memory allocation related definitions. DITOO_STATIC_ALLOC builds without a
+ * heap, the kernel provides the memory of its own tasks. */
+#if DITOO_STATIC_ALLOC
+#ifndef configSUPPORT_STATIC_ALLOCATION
+#define configSUPPORT_STATIC_ALLOCATION 1
+#endif
+#ifndef configKERNEL_PROVIDED_STATIC_MEMORY
+#define configKERNEL_PROVIDED_STATIC_MEMORY 1
+#endif
+#define configSUPPORT_DYNAMIC_ALLOCATION 0
+#else
 #define configSUPPORT_STATIC_ALLOCATION 0
 #define configSUPPORT_DYNAMIC_ALLOCATION 1
 #define configTOTAL_HEAP_SIZE (128 * 1024)
+#endif
 #define configAPPLICATION_ALLOCATED_HEAP 0
 
 /* Hook function related definitions. */
@@ -117,7 +135,10 @@
 #if configNUMBER_OF_CORES > 1
 #define configUSE_CORE_AFFINITY 1
 #endif
-#define configUSE_PASSIVE_IDLE_HOOK 0
+#define configUSE_PASSIVE_IDLE_HOOK 1
+/* a timeout taken on the other core does not cut short a tickless sleep the
+ * tick core is already in, tasks with timeouts stay on the tick core */
+#define configTIMER_SERVICE_TASK_CORE_AFFINITY (1 << configTICK_CORE)
 #endif
 
 /* RP2040 specific */
@@ -155,6 +176,14 @@ to exclude the API function. */
 #define configMAX_SYSCALL_INTERRUPT_PRIORITY 16
 #endif
 
+/* Time the tick core spends in tickless sleep */
+#if configUSE_TICKLESS_IDLE && !defined(__ASSEMBLER__)
+extern void power_sleep_begin(void);
+extern void power_sleep_end(void);
+#define configPRE_SLEEP_PROCESSING(x) power_sleep_begin()
+#define configPOST_SLEEP_PROCESSING(x) power_sleep_end()
+#endif
+
 /* A header file that defines trace macro can be included here. */
 
 #endif /* FREERTOS_CONFIG_H */
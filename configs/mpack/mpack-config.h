@@ -0,0 +1,11 @@
+#pragma once
+
+// The static allocation build gives mpack a fixed arena instead of malloc,
+// see src/arena/include/arena.h
+#if DITOO_STATIC_ALLOC
+#include "arena.h"
+
+#define MPACK_MALLOC arena_malloc
+#define MPACK_REALLOC arena_realloc
+#define MPACK_FREE arena_free
+#endif
@@ -0,0 +1,146 @@
+#include "ditoo/emulator.hpp"
+
+#include <algorithm>
+
+namespace ditoo {
+
+Emulator::Emulator(EmulatorConfig config, Clock::time_point now)
+    : config_(config), rx_free_(now), tx_free_(now), link_changed_(now) {
+    divoom_parser_init(&parser_, config_.escaped);
+}
+
+size_t Emulator::receive(const uint8_t* data, size_t size, Clock::time_point now) {
+    if (!connected(now)) {
+        stats_.bytes_dropped += size;
+        return size;
+    }
+
+    auto in_flight = [&] {
+        return std::count_if(pending_.begin(), pending_.end(), [&](const Pending& p) { return p.due > now; });
+    };
+
+    if (config_.credits && (uint32_t)in_flight() >= config_.credits) return 0;
+
+    // byte by byte so we can stop right behind the frame that used up the
+    // last credit
+    size_t taken = 0;
+    while (taken < size) {
+        arrival_ = transfer(rx_free_, now, 1);
+
+        uint32_t frames = parser_.frames;
+        divoom_parser_feed(&parser_, data + taken, 1, &Emulator::on_frame, this);
+        ++taken;
+
+        if (parser_.frames != frames && config_.credits && (uint32_t)in_flight() >= config_.credits) {
+            ++stats_.stalls;
+            break;
+        }
+    }
+
+    stats_.bytes_in += taken;
+    stats_.checksum_errors = parser_.checksum_errors;
+
+    return taken;
+}
+
+std::vector<uint8_t> Emulator::poll(Clock::time_point now) {
+    std::vector<uint8_t> out;
+
+    connected(now);
+
+    while (!pending_.empty() && pending_.front().due <= now) {
+        Pending& pending = pending_.front();
+        out.insert(out.end(), pending.frame.begin(), pending.frame.end());
+        if (!pending.frame.empty()) ++stats_.responses;
+        pending_.pop_front();
+    }
+
+    stats_.bytes_out += out.size();
+    return out;
+}
+
+Emulator::Clock::time_point Emulator::next_event() const {
+    Clock::time_point next = Clock::time_point::max();
+
+    if (!pending_.empty()) next = pending_.front().due;
+
+    if (connected_ && config_.disconnect_after.count())
+        next = std::min(next, link_changed_ + config_.disconnect_after);
+    else if (!connected_ && config_.reconnect_after.count())
+        next = std::min(next, link_changed_ + config_.reconnect_after);
+
+    return next;
+}
+
+bool Emulator::connected(Clock::time_point now) {
+    update_link(now);
+    return connected_;
+}
+
+void Emulator::set_response(uint8_t command, std::vector<uint8_t> payload) {
+    responses_[command] = std::move(payload);
+}
+
+void Emulator::set_silent(uint8_t command, bool silent) {
+    if (silent)
+        silent_.insert(command);
+    else
+        silent_.erase(command);
+}
+
+void Emulator::on_frame(const uint8_t* frame, uint16_t length, void* context) {
+    static_cast<Emulator*>(context)->handle_frame(frame, length);
+}
+
+void Emulator::handle_frame(const uint8_t* frame, uint16_t length) {
+    if (!length) return;
+
+    ++stats_.frames;
+
+    uint8_t command = frame[0];
+    Clock::time_point ready = arrival_ + config_.latency;
+
+    // silent commands still keep the device busy for the latency
+    if (silent_.count(command)) {
+        pending_.push_back({ready, {}});
+        return;
+    }
+
+    std::vector<uint8_t> payload = {command, DIVOOM_ACK};
+    auto canned = responses_.find(command);
+    if (canned != responses_.end()) payload.insert(payload.end(), canned->second.begin(), canned->second.end());
+
+    // worst case every byte but start and end is escaped
+    std::vector<uint8_t> encoded(2 * (payload.size() + 5) + 2);
+    size_t size = divoom_encode_frame(DIVOOM_RESPONSE, payload.data(), payload.size(), encoded.data(), encoded.size(), config_.escaped);
+    encoded.resize(size);
+
+    Clock::time_point due = transfer(tx_free_, ready, encoded.size());
+    pending_.push_back({due, std::move(encoded)});
+}
+
+// Books bytes on one direction of the link, returns when the last one is through
+Emulator::Clock::time_point Emulator::transfer(Clock::time_point& link, Clock::time_point start, size_t bytes) const {
+    link = std::max(link, start);
+    if (config_.bytes_per_second)
+        link += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((double)bytes / config_.bytes_per_second));
+    return link;
+}
+
+void Emulator::update_link(Clock::time_point now) {
+    if (connected_ && config_.disconnect_after.count() && now - link_changed_ >= config_.disconnect_after) {
+        // whatever the device was working on is lost with the channel
+        connected_ = false;
+        link_changed_ = now;
+        pending_.clear();
+        divoom_parser_reset(&parser_);
+        ++stats_.disconnects;
+    } else if (!connected_ && config_.reconnect_after.count() && now - link_changed_ >= config_.reconnect_after) {
+        connected_ = true;
+        link_changed_ = now;
+        rx_free_ = now;
+        tx_free_ = now;
+    }
+}
+
+}  // namespace ditoo
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "divoom.h"
+
+namespace ditoo {
+
+struct EmulatorConfig {
+    // time the device takes to act on a frame before it answers
+    std::chrono::microseconds latency{0};
+    // RFCOMM link rate in each direction, 0 for unlimited
+    uint32_t bytes_per_second = 0;
+    // frames the device takes before it stops reading until it answered one,
+    // 0 for unlimited
+    uint32_t credits = 0;
+    // drop the link after it was up this long and bring it back after it was
+    // down this long, 0 to never drop or never come back
+    std::chrono::milliseconds disconnect_after{0};
+    std::chrono::milliseconds reconnect_after{0};
+    // frames use the escaped Divoom framing
+    bool escaped = true;
+};
+
+struct EmulatorStats {
+    uint64_t frames = 0;
+    uint64_t responses = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    // bytes dropped while the link was down
+    uint64_t bytes_dropped = 0;
+    // times the device stopped reading for lack of credits
+    uint64_t stalls = 0;
+    uint64_t disconnects = 0;
+    uint64_t checksum_errors = 0;
+};
+
+// Stand-in for a Ditoo on the far side of the RFCOMM channel.
+//
+// The owner moves bytes in and out and drives the clock. It models the device
+// and the link only: what it measures is how a sender fares against that
+// model, the pty of ditoo-emu, loadgen-bench or trace-replay. bt.c does not
+// run against it, there is no btstack shim for that, so it says nothing about
+// how the adapter queues frames.
+// Every frame is answered with DIVOOM_RESPONSE, the command and DIVOOM_ACK,
+// followed by the payload registered for that command, unless the command was
+// marked silent.
+class Emulator {
+   public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit Emulator(EmulatorConfig config = {}, Clock::time_point now = Clock::now());
+
+    // Offers bytes sent by the adapter, returns how many were taken. While the
+    // device is out of credits it stops at the end of a frame, the caller has
+    // to hold the rest back like an RFCOMM sender without credits. Bytes sent
+    // while the link is down are taken and dropped.
+    size_t receive(const uint8_t* data, size_t size, Clock::time_point now);
+
+    // Encoded responses that went over the link by now
+    std::vector<uint8_t> poll(Clock::time_point now);
+
+    // Earliest time poll() or connected() may have something new
+    Clock::time_point next_event() const;
+
+    bool connected(Clock::time_point now);
+
+    void set_response(uint8_t command, std::vector<uint8_t> payload);
+    void set_silent(uint8_t command, bool silent = true);
+
+    const EmulatorStats& stats() const { return stats_; }
+
+   private:
+    struct Pending {
+        Clock::time_point due;
+        std::vector<uint8_t> frame;
+    };
+
+    static void on_frame(const uint8_t* frame, uint16_t length, void* context);
+    void handle_frame(const uint8_t* frame, uint16_t length);
+    Clock::time_point transfer(Clock::time_point& link, Clock::time_point start, size_t bytes) const;
+    void update_link(Clock::time_point now);
+
+    EmulatorConfig config_;
+    EmulatorStats stats_;
+
+    divoom_parser_t parser_;
+    // arrival time of the byte being fed, used by on_frame
+    Clock::time_point arrival_;
+
+    // when each direction of the link is free again
+    Clock::time_point rx_free_;
+    Clock::time_point tx_free_;
+
+    std::deque<Pending> pending_;
+    std::map<uint8_t, std::vector<uint8_t>> responses_;
+    std::set<uint8_t> silent_;
+
+    bool connected_ = true;
+    Clock::time_point link_changed_;
+};
+
+}  // namespace ditoo
@@ -0,0 +1,175 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ditoo/emulator.hpp"
+
+// Runs the emulator behind a pseudo terminal, which takes the place of the
+// RFCOMM serial port of a real Ditoo for host software that talks to one.
+// Stats are printed on exit.
+//
+// usage: ditoo-emu [--latency-us N] [--bandwidth BYTES/S] [--credits N]
+//                  [--disconnect-ms N] [--reconnect-ms N] [--silent CMD]...
+//                  [--raw] [--seconds N]
+
+using Clock = ditoo::Emulator::Clock;
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int) {
+    running = 0;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [--latency-us N] [--bandwidth BYTES/S] [--credits N] [--disconnect-ms N]\n"
+            "          [--reconnect-ms N] [--silent CMD]... [--raw] [--seconds N]\n",
+            name);
+}
+
+static int open_pty() {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) || unlockpt(fd)) return -1;
+
+    termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void print_stats(const ditoo::EmulatorStats& stats) {
+    printf("frames %llu  responses %llu  in %llu B  out %llu B  dropped %llu B\n",
+           (unsigned long long)stats.frames, (unsigned long long)stats.responses,
+           (unsigned long long)stats.bytes_in, (unsigned long long)stats.bytes_out,
+           (unsigned long long)stats.bytes_dropped);
+    printf("stalls %llu  disconnects %llu  checksum errors %llu\n",
+           (unsigned long long)stats.stalls, (unsigned long long)stats.disconnects,
+           (unsigned long long)stats.checksum_errors);
+}
+
+int main(int argc, char** argv) {
+    ditoo::EmulatorConfig config;
+    std::vector<uint8_t> silent;
+    double duration = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--raw") {
+            config.escaped = false;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        const char* value = argv[++i];
+        if (arg == "--latency-us")
+            config.latency = std::chrono::microseconds(strtoul(value, nullptr, 0));
+        else if (arg == "--bandwidth")
+            config.bytes_per_second = strtoul(value, nullptr, 0);
+        else if (arg == "--credits")
+            config.credits = strtoul(value, nullptr, 0);
+        else if (arg == "--disconnect-ms")
+            config.disconnect_after = std::chrono::milliseconds(strtoul(value, nullptr, 0));
+        else if (arg == "--reconnect-ms")
+            config.reconnect_after = std::chrono::milliseconds(strtoul(value, nullptr, 0));
+        else if (arg == "--silent")
+            silent.push_back(strtoul(value, nullptr, 0));
+        else if (arg == "--seconds")
+            duration = strtod(value, nullptr);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int fd = open_pty();
+    if (fd < 0) {
+        fprintf(stderr, "cannot open pty: %s\n", strerror(errno));
+        return 1;
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    Clock::time_point start = Clock::now();
+    ditoo::Emulator emulator(config, start);
+    for (uint8_t command : silent)
+        emulator.set_silent(command);
+
+    // keep the slave side open ourselves, otherwise the master reports a hang
+    // up whenever no client is attached
+    int slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+
+    printf("ditoo-emu on %s\n", ptsname(fd));
+    fflush(stdout);
+
+    // bytes read but not yet taken by the emulator, we stop reading while
+    // there are any so the pty buffer pushes back on the writer
+    std::vector<uint8_t> held;
+    bool was_connected = true;
+
+    while (running) {
+        Clock::time_point now = Clock::now();
+        if (duration > 0 && now - start >= std::chrono::duration<double>(duration)) break;
+
+        if (!held.empty()) {
+            size_t taken = emulator.receive(held.data(), held.size(), now);
+            held.erase(held.begin(), held.begin() + taken);
+        }
+
+        std::vector<uint8_t> out = emulator.poll(now);
+        for (size_t done = 0; done < out.size();) {
+            ssize_t step = write(fd, out.data() + done, out.size() - done);
+            if (step < 0 && errno != EINTR && errno != EAGAIN) break;
+            if (step > 0) done += step;
+        }
+
+        bool connected = emulator.connected(now);
+        if (connected != was_connected) {
+            printf("link %s\n", connected ? "up" : "down");
+            fflush(stdout);
+            was_connected = connected;
+        }
+
+        int timeout = 100;
+        Clock::time_point next = emulator.next_event();
+        if (!held.empty()) next = std::min(next, now + std::chrono::milliseconds(1));
+        if (next != Clock::time_point::max()) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+            timeout = (int)std::max<long long>(0, std::min<long long>(wait, timeout));
+        }
+
+        pollfd pfd = {fd, (short)(held.empty() ? POLLIN : 0), 0};
+        if (::poll(&pfd, 1, timeout) <= 0 || !(pfd.revents & POLLIN)) continue;
+
+        uint8_t buf[4096];
+        ssize_t count = read(fd, buf, sizeof(buf));
+        if (count <= 0) continue;
+
+        size_t taken = emulator.receive(buf, count, Clock::now());
+        held.assign(buf + taken, buf + count);
+    }
+
+    print_stats(emulator.stats());
+
+    close(slave);
+    close(fd);
+    return 0;
+}
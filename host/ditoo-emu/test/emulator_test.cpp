@@ -0,0 +1,160 @@
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "ditoo/emulator.hpp"
+
+// Drives the emulator's device and link model on a clock of its own: how long
+// a frame takes to be answered, how the link rate adds to that and how the
+// device stops reading while it is out of credits.
+
+using namespace std::chrono_literals;
+using Clock = ditoo::Emulator::Clock;
+
+static int failures;
+
+#define CHECK(cond)                                                                    \
+    do {                                                                               \
+        if (!(cond)) {                                                                 \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                                \
+        }                                                                              \
+    } while (0)
+
+static std::vector<uint8_t> frame(uint8_t command, std::vector<uint8_t> payload = {}) {
+    std::vector<uint8_t> out(2 * (payload.size() + 5) + 2);
+    out.resize(divoom_encode_frame(command, payload.data(), payload.size(), out.data(), out.size(), true));
+    return out;
+}
+
+// command + payload of every frame in data
+static std::vector<std::vector<uint8_t>> frames(const std::vector<uint8_t>& data) {
+    std::vector<std::vector<uint8_t>> out;
+    divoom_parser_t parser;
+    divoom_parser_init(&parser, true);
+
+    divoom_parser_feed(
+        &parser, data.data(), data.size(),
+        [](const uint8_t* frame, uint16_t length, void* context) {
+            static_cast<std::vector<std::vector<uint8_t>>*>(context)->emplace_back(frame, frame + length);
+        },
+        &out);
+
+    return out;
+}
+
+static bool near(Clock::time_point a, Clock::time_point b) {
+    return a - b < 1us && b - a < 1us;
+}
+
+// Without a link rate the answer is due exactly the latency after the frame
+static void test_latency() {
+    Clock::time_point start = Clock::now();
+    ditoo::EmulatorConfig config;
+    config.latency = 10ms;
+    ditoo::Emulator emulator(config, start);
+
+    std::vector<uint8_t> brightness = frame(DIVOOM_SET_BRIGHTNESS, {50});
+    CHECK(emulator.receive(brightness.data(), brightness.size(), start) == brightness.size());
+
+    CHECK(near(emulator.next_event(), start + 10ms));
+    CHECK(emulator.poll(start + 9ms).empty());
+
+    auto answered = frames(emulator.poll(start + 10ms));
+    CHECK(answered.size() == 1);
+    if (!answered.empty())
+        CHECK(answered[0] == std::vector<uint8_t>({DIVOOM_RESPONSE, DIVOOM_SET_BRIGHTNESS, DIVOOM_ACK}));
+
+    CHECK(emulator.stats().frames == 1);
+    CHECK(emulator.stats().responses == 1);
+}
+
+// At 1000 bytes/s every byte takes 1 ms in either direction, the answer
+// starts after the last byte of the frame and the latency
+static void test_bandwidth() {
+    Clock::time_point start = Clock::now();
+    ditoo::EmulatorConfig config;
+    config.latency = 5ms;
+    config.bytes_per_second = 1000;
+    ditoo::Emulator emulator(config, start);
+
+    std::vector<uint8_t> volume = frame(DIVOOM_SET_VOLUME, {8});
+    size_t answer = frame(DIVOOM_RESPONSE, {DIVOOM_SET_VOLUME, DIVOOM_ACK}).size();
+    emulator.receive(volume.data(), volume.size(), start);
+
+    Clock::time_point due = start + std::chrono::milliseconds(volume.size() + answer) + 5ms;
+    CHECK(near(emulator.next_event(), due));
+    CHECK(emulator.poll(due - 10us).empty());
+    CHECK(frames(emulator.poll(due)).size() == 1);
+
+    // the link was idle again, a later frame does not queue behind the first
+    Clock::time_point later = due + 100ms;
+    emulator.receive(volume.data(), volume.size(), later);
+    CHECK(near(emulator.next_event(), later + std::chrono::milliseconds(volume.size() + answer) + 5ms));
+}
+
+// With one credit the device takes a frame, stops right behind it and reads
+// on once it answered
+static void test_credits() {
+    Clock::time_point start = Clock::now();
+    ditoo::EmulatorConfig config;
+    config.latency = 10ms;
+    config.credits = 1;
+    ditoo::Emulator emulator(config, start);
+
+    std::vector<uint8_t> first = frame(DIVOOM_SET_CHANNEL, {1});
+    std::vector<uint8_t> both = first;
+    std::vector<uint8_t> second = frame(DIVOOM_SET_CHANNEL, {2});
+    both.insert(both.end(), second.begin(), second.end());
+
+    CHECK(emulator.receive(both.data(), both.size(), start) == first.size());
+    CHECK(emulator.stats().stalls == 1);
+
+    // still out of credits
+    CHECK(emulator.receive(second.data(), second.size(), start + 5ms) == 0);
+    CHECK(emulator.poll(start + 5ms).empty());
+
+    CHECK(frames(emulator.poll(start + 10ms)).size() == 1);
+    CHECK(emulator.receive(second.data(), second.size(), start + 10ms) == second.size());
+    CHECK(emulator.stats().frames == 2);
+}
+
+// A silent command sends nothing but holds its credit for the latency
+static void test_silent() {
+    Clock::time_point start = Clock::now();
+    ditoo::EmulatorConfig config;
+    config.latency = 10ms;
+    config.credits = 1;
+    ditoo::Emulator emulator(config, start);
+    emulator.set_silent(DIVOOM_SET_ANIMATION);
+
+    std::vector<uint8_t> animation = frame(DIVOOM_SET_ANIMATION, {0});
+    std::vector<uint8_t> image = frame(DIVOOM_SET_IMAGE, {0});
+
+    CHECK(emulator.receive(animation.data(), animation.size(), start) == animation.size());
+    CHECK(emulator.receive(image.data(), image.size(), start + 5ms) == 0);
+
+    CHECK(emulator.poll(start + 10ms).empty());
+    CHECK(emulator.receive(image.data(), image.size(), start + 10ms) == image.size());
+    CHECK(emulator.stats().responses == 0);
+}
+
+int main() {
+    struct {
+        const char* name;
+        void (*run)();
+    } tests[] = {
+        {"latency", &test_latency},
+        {"bandwidth", &test_bandwidth},
+        {"credits", &test_credits},
+        {"silent", &test_silent},
+    };
+
+    for (const auto& test : tests) {
+        int before = failures;
+        test.run();
+        std::printf("%-16s %s\n", test.name, failures == before ? "ok" : "FAILED");
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,437 @@
+#include "ditoo/client.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+// mpack
+#include "mpack/mpack.h"
+
+namespace ditoo {
+
+namespace {
+
+// ext header and [id, ext, flags] envelope take at most 11 bytes
+constexpr size_t kEnvelopeSize = 11;
+
+constexpr size_t kMaxMessageSize = 64 * 1024;
+constexpr size_t kMaxNodes = 1024;
+
+// CMD_CREDIT with this third byte replaces the credit count, see src/commands/flow.h
+constexpr uint8_t kFlowGrant = 1;
+
+void write_node(mpack_writer_t* writer, mpack_node_t node) {
+    switch (mpack_node_type(node)) {
+        case mpack_type_nil:
+            mpack_write_nil(writer);
+            break;
+        case mpack_type_bool:
+            mpack_write_bool(writer, mpack_node_bool(node));
+            break;
+        case mpack_type_int:
+            mpack_write_int(writer, mpack_node_i64(node));
+            break;
+        case mpack_type_uint:
+            mpack_write_uint(writer, mpack_node_u64(node));
+            break;
+        case mpack_type_float:
+            mpack_write_float(writer, mpack_node_float(node));
+            break;
+        case mpack_type_double:
+            mpack_write_double(writer, mpack_node_double(node));
+            break;
+        case mpack_type_str:
+            mpack_write_str(writer, mpack_node_str(node), mpack_node_strlen(node));
+            break;
+        case mpack_type_bin:
+            mpack_write_bin(writer, mpack_node_bin_data(node), mpack_node_bin_size(node));
+            break;
+        case mpack_type_ext:
+            mpack_write_ext(writer, mpack_node_exttype(node), mpack_node_data(node), mpack_node_data_len(node));
+            break;
+        case mpack_type_array: {
+            size_t count = mpack_node_array_length(node);
+            mpack_start_array(writer, count);
+            for (size_t i = 0; i < count; ++i)
+                write_node(writer, mpack_node_array_at(node, i));
+            mpack_finish_array(writer);
+            break;
+        }
+        case mpack_type_map: {
+            size_t count = mpack_node_map_count(node);
+            mpack_start_map(writer, count);
+            for (size_t i = 0; i < count; ++i) {
+                write_node(writer, mpack_node_map_key_at(node, i));
+                write_node(writer, mpack_node_map_value_at(node, i));
+            }
+            mpack_finish_map(writer);
+            break;
+        }
+        default:
+            mpack_writer_flag_error(writer, mpack_error_type);
+            break;
+    }
+}
+
+Message ext_message(mpack_node_t ext, uint16_t id) {
+    Message message;
+    message.type = static_cast<Command>(mpack_node_exttype(ext));
+    message.id = id;
+
+    const char* data = mpack_node_data(ext);
+    message.data.assign(data, data + mpack_node_data_len(ext));
+
+    return message;
+}
+
+size_t read_tty(mpack_tree_t* tree, char* buf, size_t count) {
+    int fd = *static_cast<int*>(mpack_tree_context(tree));
+
+    // wake up regularly so the reader notices when the client shuts down
+    pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 100) <= 0) return 0;
+
+    ssize_t step = read(fd, buf, count);
+    if (step < 0 && errno == EINTR) return 0;
+    if (step <= 0) {
+        mpack_tree_flag_error(tree, mpack_error_io);
+        return 0;
+    }
+
+    return step;
+}
+
+}  // namespace
+
+Client::Client(const std::string& tty, Options options) : options_(options) {
+    fd_ = open(tty.c_str(), O_RDWR | O_NOCTTY);
+    if (fd_ < 0) throw std::system_error(errno, std::generic_category(), "open " + tty);
+
+    termios tio;
+    if (tcgetattr(fd_, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd_, TCSANOW, &tio);
+    }
+
+    // the adapter grants its window on DTR, ask explicitly in case the line
+    // was already up
+    enqueue_sync();
+
+    writer_thread_ = std::thread(&Client::writer, this);
+    reader_thread_ = std::thread(&Client::reader, this);
+}
+
+Client::~Client() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+    }
+    queue_cv_.notify_all();
+
+    writer_thread_.join();
+    reader_thread_.join();
+
+    close(fd_);
+}
+
+std::future<Message> Client::request(Command type, std::vector<uint8_t> data, uint8_t flags) {
+    std::future<Message> future;
+    uint16_t id;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // the adapter keeps the top bit for the client that sent the id
+        id = next_id_++;
+        if (next_id_ > 0x7FFF) next_id_ = 1;
+
+        // ids wrap after 32767 requests, a request still waiting by then is
+        // not going to be answered anymore
+        auto stale = requests_.find(id);
+        if (stale != requests_.end()) {
+            stale->second.set_exception(std::make_exception_ptr(std::runtime_error("request id reused")));
+            requests_.erase(stale);
+        }
+
+        future = requests_[id].get_future();
+    }
+
+    enqueue(type, id, std::move(data), flags);
+
+    return future;
+}
+
+void Client::send(Command type, std::vector<uint8_t> data, uint8_t flags) {
+    enqueue(type, 0, std::move(data), flags);
+}
+
+void Client::on(Command type, Handler handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    handlers_[type] = std::move(handler);
+}
+
+void Client::on_object(Handler handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    object_handler_ = std::move(handler);
+}
+
+void Client::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    flushed_cv_.wait(lock, [this] { return (queue_.empty() && !writing_) || !running_; });
+}
+
+Stats Client::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+//--------------------------------------------------------------------+
+// Writer
+//--------------------------------------------------------------------+
+
+bool Client::takes_credit(Command type) {
+    // IMMEDIATE in COMMANDS of src/commands/cmd.h, handled by the adapter's cdc
+    // task and never queued towards bluetooth
+    switch (type) {
+        case Command::Credit:
+        case Command::Sink:
+        case Command::Stats:
+        case Command::Capture:
+        case Command::Config:
+        case Command::Boot:
+        case Command::Power:
+        case Command::Clients:
+            return false;
+        default:
+            return true;
+    }
+}
+
+void Client::enqueue(Command type, uint16_t id, std::vector<uint8_t> data, uint8_t flags) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back({type, id, std::move(data), flags});
+        ++stats_.commands;
+    }
+    queue_cv_.notify_all();
+}
+
+// Asks the adapter for its current window, ahead of everything queued
+void Client::enqueue_sync() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.insert(queue_.begin(), {Command::Credit, 0, {}});
+        ++syncs_;
+    }
+    queue_cv_.notify_all();
+}
+
+void Client::writer() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    auto sendable = [this] {
+        if (queue_.empty()) return false;
+        return !takes_credit(queue_.front().type) || (!syncs_ && credits_ > 0);
+    };
+
+    while (true) {
+        queue_cv_.wait(lock, [&] { return !running_ || sendable(); });
+        if (!running_) break;
+
+        // give a lone command the chance to share its write
+        if (options_.batch_delay.count() && queue_.size() == 1)
+            queue_cv_.wait_for(lock, options_.batch_delay, [this] { return !running_ || queue_.size() > 1; });
+
+        std::vector<uint8_t> batch;
+        size_t taken = 0;
+
+        // keep the order, stop at the first command the adapter has no room for
+        for (const Pending& pending : queue_) {
+            bool credit = takes_credit(pending.type);
+            if (credit && (syncs_ || credits_ == 0)) break;
+            if (taken && batch.size() + pending.data.size() + kEnvelopeSize > options_.max_batch_bytes) break;
+
+            size_t offset = batch.size();
+            batch.resize(offset + pending.data.size() + kEnvelopeSize);
+
+            mpack_writer_t writer;
+            mpack_writer_init(&writer, reinterpret_cast<char*>(batch.data() + offset), batch.size() - offset);
+
+            // flags need the envelope, with id 0 if there is none
+            bool envelope = pending.id || pending.flags;
+            if (envelope) {
+                mpack_start_array(&writer, pending.flags ? 3 : 2);
+                mpack_write_u16(&writer, pending.id);
+            }
+
+            mpack_write_ext(&writer, static_cast<int8_t>(pending.type), reinterpret_cast<const char*>(pending.data.data()), pending.data.size());
+
+            if (pending.flags) mpack_write_u8(&writer, pending.flags);
+            if (envelope) mpack_finish_array(&writer);
+
+            size_t count = mpack_writer_buffer_used(&writer);
+            if (mpack_writer_destroy(&writer) != mpack_ok) count = 0;
+
+            batch.resize(offset + count);
+            ++taken;
+            if (credit) --credits_;
+        }
+
+        queue_.erase(queue_.begin(), queue_.begin() + taken);
+        writing_ = true;
+
+        lock.unlock();
+        write_all(batch.data(), batch.size());
+        lock.lock();
+
+        writing_ = false;
+        ++stats_.writes;
+        stats_.bytes_written += batch.size();
+        flushed_cv_.notify_all();
+    }
+
+    flushed_cv_.notify_all();
+}
+
+void Client::write_all(const uint8_t* data, size_t size) {
+    while (size) {
+        ssize_t step = write(fd_, data, size);
+        if (step < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        data += step;
+        size -= step;
+    }
+}
+
+//--------------------------------------------------------------------+
+// Reader
+//--------------------------------------------------------------------+
+
+void Client::reader() {
+    mpack_tree_t tree;
+    mpack_tree_init_stream(&tree, read_tty, &fd_, kMaxMessageSize, kMaxNodes);
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_) break;
+        }
+
+        if (!mpack_tree_try_parse(&tree)) {
+            if (mpack_tree_error(&tree) == mpack_ok) continue;
+
+            // the adapter went away
+            if (mpack_tree_error(&tree) == mpack_error_io) break;
+
+            // resynchronise on garbage by starting over with a fresh stream
+            mpack_tree_destroy(&tree);
+            mpack_tree_init_stream(&tree, read_tty, &fd_, kMaxMessageSize, kMaxNodes);
+            continue;
+        }
+
+        mpack_node_t root = mpack_tree_root(&tree);
+        mpack_type_t type = mpack_node_type(root);
+
+        if (type == mpack_type_ext) {
+            dispatch(ext_message(root, 0));
+        } else if (type == mpack_type_array && mpack_node_array_length(root) == 2 &&
+                   mpack_node_type(mpack_node_array_at(root, 1)) == mpack_type_ext) {
+            dispatch(ext_message(mpack_node_array_at(root, 1), mpack_node_u16(mpack_node_array_at(root, 0))));
+        } else {
+            Message message;
+            message.ext = false;
+
+            char* data;
+            size_t size;
+            mpack_writer_t writer;
+            mpack_writer_init_growable(&writer, &data, &size);
+            write_node(&writer, root);
+
+            if (mpack_writer_destroy(&writer) == mpack_ok) {
+                message.data.assign(data, data + size);
+                dispatch(std::move(message));
+            }
+            MPACK_FREE(data);
+        }
+    }
+
+    mpack_tree_destroy(&tree);
+
+    // nothing is going to answer the outstanding requests anymore
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& request : requests_)
+        request.second.set_exception(std::make_exception_ptr(std::runtime_error("adapter disconnected")));
+    requests_.clear();
+}
+
+void Client::handle_credit(const Message& message) {
+    if (message.data.size() < 2) return;
+
+    uint16_t credits = message.data[0] | (message.data[1] << 8);
+
+    if (message.data.size() > 2 && message.data[2] == kFlowGrant) {
+        // the DTR grant is unsolicited and may come before or after the answer
+        // to our sync, both were taken before we sent anything, use the first
+        if (!syncs_) return;
+
+        --syncs_;
+        credits_ = credits;
+    } else {
+        credits_ += credits;
+    }
+}
+
+void Client::dispatch(Message message) {
+    Handler handler;
+    message.received = std::chrono::steady_clock::now();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.messages;
+
+        if (!message.ext) {
+            handler = object_handler_;
+        } else {
+            if (message.type == Command::Credit) {
+                handle_credit(message);
+                queue_cv_.notify_all();
+                return;
+            }
+
+            if (message.type == Command::Busy) {
+                // a full ring means we are out of sync with the adapter's
+                // window, stop sending until it granted a new one. Rejected
+                // and dropped commands get their credit back as usual.
+                ++stats_.busy;
+                bool full = message.data.size() < 2 || message.data[1] == kBusyFull;
+                if (full && !syncs_) {
+                    queue_.insert(queue_.begin(), {Command::Credit, 0, {}});
+                    ++syncs_;
+                    queue_cv_.notify_all();
+                }
+            }
+
+            auto request = message.id ? requests_.find(message.id) : requests_.end();
+            if (request != requests_.end()) {
+                request->second.set_value(message);
+                requests_.erase(request);
+            }
+
+            auto it = handlers_.find(message.type);
+            if (it != handlers_.end()) handler = it->second;
+        }
+    }
+
+    if (handler) handler(message);
+}
+
+}  // namespace ditoo
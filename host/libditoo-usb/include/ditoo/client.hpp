@@ -0,0 +1,161 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ditoo {
+
+// Ext types of the adapter protocol, keep in sync with src/commands/cmd.h
+enum class Command : uint8_t {
+    ListDevice = 0,
+    SelectDevice,
+    Ditoo,
+    Sink,
+    Credit,
+    Busy,
+    // answered with a msgpack map of counters
+    Stats,
+    // one byte profile to select, empty to query, answered with a map
+    LinkPolicy,
+    // btsnoop capture control and data, see src/capture/include/capture.h
+    Capture,
+    // upload and replay frame sequences on the adapter, see src/bt-client/macro.h
+    Macro,
+    // runtime parameters, see src/params/include/params.h
+    Config,
+    // scrolling text rendered on the adapter, see src/bt-client/ticker.h
+    Text,
+    // boot milestones, see src/boot/include/boot.h
+    Boot,
+    // residency counters of the low power states, see src/power/include/power.h
+    Power,
+    // counters of the CDC and WebUSB clients, see src/usb-dev/dev.c
+    Clients,
+    // synthetic traffic and its summary, see src/loadgen/include/loadgen.h
+    Bench,
+    // suppression of repeated frames, see src/bt-client/dedupe.h
+    Dedupe,
+};
+
+// Envelope flags, keep in sync with CMD_FLAG_* in src/commands/cmd.h
+constexpr uint8_t kFlagForce = 0x01;
+
+// Second byte of a Command::Busy, keep in sync with FLOW_BUSY_* in
+// src/commands/flow.h. The first byte is the type of the command.
+constexpr uint8_t kBusyFull = 0;
+constexpr uint8_t kBusyInvalid = 1;
+constexpr uint8_t kBusyNoLink = 2;
+
+struct Message {
+    // false for plain msgpack objects such as scan reports, data then holds the
+    // encoded object and type is meaningless
+    bool ext = true;
+    Command type = Command::Ditoo;
+    // request id this message answers, 0 if unsolicited, at most 0x7FFF
+    uint16_t id = 0;
+    std::vector<uint8_t> data;
+    // when the reader parsed it, for timing replies
+    std::chrono::steady_clock::time_point received;
+};
+
+struct Options {
+    // how long a command may wait for more commands to share its USB write
+    std::chrono::microseconds batch_delay{0};
+    // upper bound for one USB write
+    size_t max_batch_bytes = 16 * 1024;
+};
+
+struct Stats {
+    uint64_t commands = 0;
+    uint64_t writes = 0;
+    uint64_t bytes_written = 0;
+    uint64_t messages = 0;
+    uint64_t busy = 0;
+};
+
+// Client for the adapter's data CDC.
+//
+// Commands are queued and a writer thread packs everything that is queued
+// into a single write, as far as the adapter's credits allow. A reader thread
+// parses the replies, resolves the futures of requests by their id and hands
+// everything to the handlers registered for its type.
+class Client {
+   public:
+    using Handler = std::function<void(const Message&)>;
+
+    explicit Client(const std::string& tty, Options options = {});
+    ~Client();
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    // Sends a command with a fresh request id. The future is resolved with
+    // the reply carrying that id, or with a Command::Busy message if the
+    // adapter rejected or dropped the command, see kBusy*. flags are kFlag*
+    // values.
+    std::future<Message> request(Command type, std::vector<uint8_t> data, uint8_t flags = 0);
+
+    // Sends a command without a request id
+    void send(Command type, std::vector<uint8_t> data, uint8_t flags = 0);
+
+    // Dispatch by type, Command::Credit is handled internally
+    void on(Command type, Handler handler);
+    // Called for everything that is not an ext, e.g. scan reports
+    void on_object(Handler handler);
+
+    // Blocks until every queued command has been written
+    void flush();
+
+    Stats stats();
+
+   private:
+    struct Pending {
+        Command type;
+        uint16_t id;
+        std::vector<uint8_t> data;
+        uint8_t flags = 0;
+    };
+
+    void enqueue(Command type, uint16_t id, std::vector<uint8_t> data, uint8_t flags = 0);
+    void enqueue_sync();
+    void writer();
+    void reader();
+    void dispatch(Message message);
+    void handle_credit(const Message& message);
+    void write_all(const uint8_t* data, size_t size);
+    static bool takes_credit(Command type);
+
+    int fd_ = -1;
+    Options options_;
+    bool running_ = true;
+
+    std::mutex mutex_;
+    std::condition_variable queue_cv_;
+    std::condition_variable flushed_cv_;
+    std::vector<Pending> queue_;
+    bool writing_ = false;
+
+    // commands the adapter can take right now, nothing is sent while a credit
+    // sync is unanswered
+    uint32_t credits_ = 0;
+    uint32_t syncs_ = 0;
+
+    uint16_t next_id_ = 1;
+    std::map<uint16_t, std::promise<Message>> requests_;
+    std::map<Command, Handler> handlers_;
+    Handler object_handler_;
+    Stats stats_;
+
+    std::thread writer_thread_;
+    std::thread reader_thread_;
+};
+
+}  // namespace ditoo
@@ -0,0 +1,382 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ditoo/client.hpp"
+
+// mpack
+#include "mpack/mpack.h"
+
+// Runs ditoo::Client against a stand-in for the adapter on a pty: request ids
+// are matched with replies that come back out of order, no more commands are
+// in flight than the adapter granted credits for, and CMD_BUSY either resyncs
+// the window or just answers the request, depending on its reason.
+
+using namespace std::chrono_literals;
+using ditoo::Command;
+
+static int failures;
+
+#define CHECK(cond)                                                                    \
+    do {                                                                               \
+        if (!(cond)) {                                                                 \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                                \
+        }                                                                              \
+    } while (0)
+
+// CMD_CREDIT with this third byte replaces the host's count, see src/commands/flow.h
+constexpr uint8_t kFlowGrant = 1;
+
+template <typename Pred>
+static bool wait_for(Pred pred, std::chrono::milliseconds timeout = 2000ms) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    while (!pred()) {
+        if (std::chrono::steady_clock::now() > deadline) return false;
+        std::this_thread::sleep_for(1ms);
+    }
+
+    return true;
+}
+
+// The adapter's side of the protocol on the pty master. It grants its window
+// on an empty CMD_CREDIT and hands every other command to on_command, which
+// answers it or holds it back.
+class Adapter {
+   public:
+    struct Received {
+        Command type;
+        uint16_t id;
+        std::vector<uint8_t> data;
+    };
+
+    using Handler = std::function<void(Adapter&, const Received&)>;
+
+    explicit Adapter(uint16_t window) : window_(window) {
+        master_ = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master_ < 0 || grantpt(master_) || unlockpt(master_)) throw std::runtime_error("no pty");
+        path_ = ptsname(master_);
+
+        // held open so the master does not see a hangup between clients
+        slave_ = open(path_.c_str(), O_RDWR | O_NOCTTY);
+        termios tio;
+        tcgetattr(slave_, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slave_, TCSANOW, &tio);
+
+        thread_ = std::thread(&Adapter::run, this);
+    }
+
+    ~Adapter() {
+        running_ = false;
+        thread_.join();
+        close(slave_);
+        close(master_);
+    }
+
+    const std::string& path() const { return path_; }
+
+    void on_command(Handler handler) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        handler_ = std::move(handler);
+    }
+
+    void write(Command type, uint16_t id, const std::vector<uint8_t>& data) {
+        char buf[512];
+        mpack_writer_t writer;
+        mpack_writer_init(&writer, buf, sizeof(buf));
+
+        if (id) {
+            mpack_start_array(&writer, 2);
+            mpack_write_u16(&writer, id);
+        }
+        mpack_write_ext(&writer, static_cast<int8_t>(type), reinterpret_cast<const char*>(data.data()), data.size());
+        if (id) mpack_finish_array(&writer);
+
+        size_t count = mpack_writer_buffer_used(&writer);
+        if (mpack_writer_destroy(&writer) != mpack_ok) return;
+
+        // the reader thread and the test both answer
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        for (size_t done = 0; done < count;) {
+            ssize_t step = ::write(master_, buf + done, count - done);
+            if (step <= 0) return;
+            done += step;
+        }
+    }
+
+    // Finishes a command the way the bt task does, its credit goes back
+    void finish(const Received& cmd, Command reply, std::vector<uint8_t> data) {
+        if (cmd.id) write(reply, cmd.id, data);
+        give_back(1);
+    }
+
+    void give_back(uint16_t credits) {
+        in_flight_ -= credits;
+        write(Command::Credit, 0, {uint8_t(credits & 0xFF), uint8_t(credits >> 8)});
+    }
+
+    // the command was not taken, its credit is lost until the host resyncs
+    void refuse(const Received& cmd, uint8_t reason) {
+        in_flight_--;
+        write(Command::Busy, cmd.id, {uint8_t(cmd.type), reason});
+    }
+
+    std::vector<Received> received() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return received_;
+    }
+
+    int syncs() const { return syncs_; }
+    int in_flight() const { return in_flight_; }
+    int max_in_flight() const { return max_in_flight_; }
+
+   private:
+    static size_t read_master(mpack_tree_t* tree, char* buf, size_t count) {
+        Adapter* adapter = static_cast<Adapter*>(mpack_tree_context(tree));
+
+        pollfd pfd = {adapter->master_, POLLIN, 0};
+        if (poll(&pfd, 1, 20) <= 0) return 0;
+
+        ssize_t step = read(adapter->master_, buf, count);
+        return step > 0 ? step : 0;
+    }
+
+    void run() {
+        mpack_tree_t tree;
+        mpack_tree_init_stream(&tree, &Adapter::read_master, this, 4096, 64);
+
+        while (running_) {
+            if (!mpack_tree_try_parse(&tree)) {
+                if (mpack_tree_error(&tree) != mpack_ok) {
+                    std::fprintf(stderr, "adapter: invalid stream from the client\n");
+                    ++failures;
+                    break;
+                }
+                continue;
+            }
+
+            mpack_node_t root = mpack_tree_root(&tree);
+            mpack_node_t ext = root;
+            Received cmd{Command::Busy, 0, {}};
+
+            if (mpack_node_type(root) == mpack_type_array) {
+                cmd.id = mpack_node_u16(mpack_node_array_at(root, 0));
+                ext = mpack_node_array_at(root, 1);
+            }
+
+            cmd.type = static_cast<Command>(mpack_node_exttype(ext));
+            const char* data = mpack_node_data(ext);
+            cmd.data.assign(data, data + mpack_node_data_len(ext));
+
+            if (cmd.type == Command::Credit && cmd.data.empty()) {
+                ++syncs_;
+                uint16_t credits = window_ - in_flight_;
+                write(Command::Credit, 0, {uint8_t(credits & 0xFF), uint8_t(credits >> 8), kFlowGrant});
+                continue;
+            }
+
+            int now = ++in_flight_;
+            if (now > max_in_flight_) max_in_flight_ = now;
+
+            Handler handler;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                received_.push_back(cmd);
+                handler = handler_;
+            }
+
+            if (handler) handler(*this, cmd);
+        }
+
+        mpack_tree_destroy(&tree);
+    }
+
+    uint16_t window_;
+    int master_ = -1;
+    int slave_ = -1;
+    std::string path_;
+
+    std::atomic<bool> running_{true};
+    std::atomic<int> syncs_{0};
+    std::atomic<int> in_flight_{0};
+    std::atomic<int> max_in_flight_{0};
+
+    std::mutex write_mutex_;
+    std::mutex mutex_;
+    Handler handler_;
+    std::vector<Received> received_;
+    std::thread thread_;
+};
+
+// Replies come back in reverse order of the requests, each carries the
+// payload of its request
+static void test_request_ids() {
+    // outlives the adapter's thread, which uses it
+    std::vector<Adapter::Received> held;
+    Adapter adapter(4);
+
+    adapter.on_command([&](Adapter& a, const Adapter::Received& cmd) {
+        held.push_back(cmd);
+        if (held.size() < 4) return;
+
+        for (auto it = held.rbegin(); it != held.rend(); ++it)
+            a.finish(*it, Command::Ditoo, it->data);
+        held.clear();
+    });
+
+    ditoo::Client client(adapter.path());
+
+    std::vector<std::future<ditoo::Message>> replies;
+    for (uint8_t i = 0; i < 16; ++i)
+        replies.push_back(client.request(Command::Ditoo, {0x45, i}));
+
+    for (uint8_t i = 0; i < 16; ++i) {
+        if (replies[i].wait_for(2s) != std::future_status::ready) {
+            CHECK(!"request answered");
+            continue;
+        }
+
+        ditoo::Message reply = replies[i].get();
+        CHECK(reply.type == Command::Ditoo);
+        CHECK(reply.id != 0);
+        CHECK(reply.data == std::vector<uint8_t>({0x45, i}));
+    }
+
+    CHECK(adapter.max_in_flight() <= 4);
+}
+
+// With a window of 2 the third command waits until a credit came back
+static void test_credit_window() {
+    std::atomic<bool> hold{true};
+    std::vector<Adapter::Received> held;
+    std::mutex held_mutex;
+    Adapter adapter(2);
+
+    adapter.on_command([&](Adapter& a, const Adapter::Received& cmd) {
+        if (hold) {
+            std::lock_guard<std::mutex> lock(held_mutex);
+            held.push_back(cmd);
+            return;
+        }
+        a.finish(cmd, Command::Ditoo, {});
+    });
+
+    ditoo::Client client(adapter.path());
+    for (uint8_t i = 0; i < 5; ++i)
+        client.send(Command::Ditoo, {0x45, i});
+
+    CHECK(wait_for([&] { return adapter.received().size() == 2; }));
+    std::this_thread::sleep_for(100ms);
+    CHECK(adapter.received().size() == 2);
+
+    hold = false;
+    {
+        std::lock_guard<std::mutex> lock(held_mutex);
+        for (const auto& cmd : held)
+            adapter.finish(cmd, Command::Ditoo, {});
+    }
+
+    CHECK(wait_for([&] { return adapter.received().size() == 5; }));
+    client.flush();
+    CHECK(wait_for([&] { return adapter.in_flight() == 0; }));
+    CHECK(adapter.max_in_flight() <= 2);
+
+    // the commands kept their order across the stall
+    auto received = adapter.received();
+    for (size_t i = 0; i < received.size(); ++i)
+        CHECK(received[i].data.size() == 2 && received[i].data[1] == i);
+}
+
+// A full ring means the host's count is off, it stops and resyncs. The busy
+// request is answered with the CMD_BUSY.
+static void test_busy_full() {
+    std::atomic<int> seen{0};
+    Adapter adapter(4);
+
+    adapter.on_command([&](Adapter& a, const Adapter::Received& cmd) {
+        if (seen++ == 0)
+            a.refuse(cmd, ditoo::kBusyFull);
+        else
+            a.finish(cmd, Command::Ditoo, cmd.data);
+    });
+
+    ditoo::Client client(adapter.path());
+    CHECK(wait_for([&] { return adapter.syncs() == 1; }));
+
+    auto busy = client.request(Command::Ditoo, {0x45, 1});
+    CHECK(busy.wait_for(2s) == std::future_status::ready);
+    if (busy.valid()) {
+        ditoo::Message reply = busy.get();
+        CHECK(reply.type == Command::Busy);
+        CHECK(reply.data.size() == 2 && reply.data[0] == uint8_t(Command::Ditoo) && reply.data[1] == ditoo::kBusyFull);
+    }
+
+    CHECK(wait_for([&] { return adapter.syncs() == 2; }));
+
+    auto next = client.request(Command::Ditoo, {0x45, 2});
+    CHECK(next.wait_for(2s) == std::future_status::ready);
+    if (next.valid()) CHECK(next.get().type == Command::Ditoo);
+
+    CHECK(client.stats().busy == 1);
+}
+
+// A rejected command gets its credit back like any other, no resync
+static void test_busy_invalid() {
+    Adapter adapter(1);
+
+    adapter.on_command([&](Adapter& a, const Adapter::Received& cmd) {
+        if (cmd.data.empty()) {
+            a.write(Command::Busy, cmd.id, {uint8_t(cmd.type), ditoo::kBusyInvalid});
+            a.give_back(1);
+        } else {
+            a.finish(cmd, Command::Ditoo, cmd.data);
+        }
+    });
+
+    ditoo::Client client(adapter.path());
+
+    auto rejected = client.request(Command::Ditoo, {});
+    auto next = client.request(Command::Ditoo, {0x45, 3});
+
+    CHECK(rejected.wait_for(2s) == std::future_status::ready);
+    if (rejected.valid()) CHECK(rejected.get().type == Command::Busy);
+    CHECK(next.wait_for(2s) == std::future_status::ready);
+    if (next.valid()) CHECK(next.get().type == Command::Ditoo);
+
+    // a resync would follow the CMD_BUSY right away
+    CHECK(!wait_for([&] { return adapter.syncs() > 1; }, 100ms));
+}
+
+int main() {
+    struct {
+        const char* name;
+        void (*run)();
+    } tests[] = {
+        {"request_ids", &test_request_ids},
+        {"credit_window", &test_credit_window},
+        {"busy_full", &test_busy_full},
+        {"busy_invalid", &test_busy_invalid},
+    };
+
+    for (const auto& test : tests) {
+        int before = failures;
+        test.run();
+        std::printf("%-16s %s\n", test.name, failures == before ? "ok" : "FAILED");
+    }
+
+    return failures ? 1 : 0;
+}
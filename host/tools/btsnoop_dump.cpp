@@ -0,0 +1,92 @@
+#include <signal.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <thread>
+
+#include "ditoo/client.hpp"
+
+// Records the adapter's HCI traffic into a btsnoop file for Wireshark. The
+// capture is streamed live while it runs, so the RAM ring on the adapter only
+// has to bridge the USB latency. With --trace it records the traffic trace
+// (src/capture/include/trace.h) instead, for host/tools/trace_replay.cpp.
+//
+// usage: btsnoop-dump [--trace] <tty> <file> [seconds, default until Ctrl-C]
+
+// capture_op_t in src/capture/include/capture.h
+enum : uint8_t {
+    CAPTURE_STOP = 0,
+    CAPTURE_START,
+    CAPTURE_READ,
+    CAPTURE_TRACE,
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int) {
+    running = 0;
+}
+
+int main(int argc, char** argv) {
+    bool trace = argc > 1 && strcmp(argv[1], "--trace") == 0;
+    if (trace) {
+        --argc;
+        ++argv;
+    }
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: btsnoop-dump [--trace] <tty> <file> [seconds]\n");
+        return 1;
+    }
+
+    double duration = argc > 3 ? strtod(argv[3], nullptr) : 0;
+
+    FILE* out = fopen(argv[2], "wb");
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    ditoo::Client client(argv[1]);
+
+    size_t total = 0;
+    bool ended = false;
+    std::promise<void> done;
+
+    // an empty message ends the stream
+    client.on(ditoo::Command::Capture, [&](const ditoo::Message& message) {
+        if (ended) return;
+
+        if (message.data.empty()) {
+            ended = true;
+            done.set_value();
+            return;
+        }
+
+        fwrite(message.data.data(), 1, message.data.size(), out);
+        total += message.data.size();
+    });
+
+    client.send(ditoo::Command::Capture, {trace ? CAPTURE_TRACE : CAPTURE_START});
+    client.send(ditoo::Command::Capture, {CAPTURE_READ});
+
+    auto start = std::chrono::steady_clock::now();
+    while (running && (duration <= 0 || std::chrono::steady_clock::now() - start < std::chrono::duration<double>(duration)))
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    client.send(ditoo::Command::Capture, {CAPTURE_STOP});
+
+    if (done.get_future().wait_for(std::chrono::seconds(5)) != std::future_status::ready)
+        fprintf(stderr, "capture stream did not end, file may be truncated\n");
+
+    fclose(out);
+    printf("%zu bytes written to %s\n", total, argv[2]);
+
+    return 0;
+}
@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Streams CMD_SINK messages to the adapter's data CDC as fast as the device
+// accepts them and reports the sustained host -> device rate. The firmware
+// parses and discards CMD_SINK, so this measures the USB ingest path only.
+//
+// With a telemetry tty the telemetry CDC is opened and drained for the whole
+// run, comparing against a run without it shows what the telemetry costs the
+// data path. Lower params.telemetry_ms over CMD_CONFIG to load it harder.
+//
+// usage: cdc-throughput <tty> [payload bytes (1-256), default 250] [seconds, default 10] [telemetry tty]
+
+#define CMD_SINK 3
+#define BATCH_SIZE (64 * 1024)
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_tty(const char* path) {
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) return -1;
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+
+    return fd;
+}
+
+static volatile int draining = 1;
+static uint64_t telemetry_bytes;
+
+static void* drain_telemetry(void* arg) {
+    int fd = *(int*)arg;
+    uint8_t buf[4096];
+
+    while (draining) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0) telemetry_bytes += n;
+        else if (n < 0 && errno != EINTR && errno != EAGAIN) break;
+    }
+
+    return NULL;
+}
+
+// msgpack ext with the payload filled with a counter pattern
+static size_t write_message(uint8_t* buf, size_t payload, uint32_t seq) {
+    size_t pos = 0;
+
+    if (payload <= 0xFF) {
+        buf[pos++] = 0xC7;
+        buf[pos++] = (uint8_t)payload;
+    } else {
+        buf[pos++] = 0xC8;
+        buf[pos++] = (uint8_t)(payload >> 8);
+        buf[pos++] = (uint8_t)payload;
+    }
+    buf[pos++] = CMD_SINK;
+
+    for (size_t i = 0; i < payload; ++i)
+        buf[pos++] = (uint8_t)(seq + i);
+
+    return pos;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <tty> [payload bytes] [seconds] [telemetry tty]\n", argv[0]);
+        return 1;
+    }
+
+    size_t payload = argc > 2 ? strtoul(argv[2], NULL, 0) : 250;
+    double duration = argc > 3 ? strtod(argv[3], NULL) : 10;
+
+    if (payload < 1 || payload > 256) {
+        fprintf(stderr, "payload must be between 1 and 256 bytes\n");
+        return 1;
+    }
+
+    int fd = open_tty(argv[1]);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    int telemetry_fd = -1;
+    pthread_t telemetry_thread;
+    if (argc > 4) {
+        telemetry_fd = open_tty(argv[4]);
+        if (telemetry_fd < 0) {
+            fprintf(stderr, "cannot open %s: %s\n", argv[4], strerror(errno));
+            return 1;
+        }
+
+        // wake up now and then to see whether the run is over
+        struct termios tio;
+        if (tcgetattr(telemetry_fd, &tio) == 0) {
+            tio.c_cc[VMIN] = 0;
+            tio.c_cc[VTIME] = 1;
+            tcsetattr(telemetry_fd, TCSANOW, &tio);
+        }
+
+        pthread_create(&telemetry_thread, NULL, drain_telemetry, &telemetry_fd);
+    }
+
+    static uint8_t batch[BATCH_SIZE];
+    size_t batch_len = 0;
+    uint32_t messages = 0;
+    while (batch_len + payload + 4 <= sizeof(batch))
+        batch_len += write_message(batch + batch_len, payload, messages++);
+
+    printf("%u messages of %zu bytes per %zu byte write\n", messages, payload, batch_len);
+
+    double start = now_s();
+    double last = start;
+    uint64_t total = 0;
+    uint64_t interval = 0;
+
+    while (now_s() - start < duration) {
+        ssize_t n = write(fd, batch, batch_len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        // a partial write would split a message, finish it before moving on
+        for (size_t done = n; done < batch_len;) {
+            ssize_t rest = write(fd, batch + done, batch_len - done);
+            if (rest < 0) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "write failed: %s\n", strerror(errno));
+                return 1;
+            }
+            done += rest;
+        }
+
+        total += batch_len;
+        interval += batch_len;
+
+        double t = now_s();
+        if (t - last >= 1.0) {
+            printf("%8.1f KB/s\n", interval / 1024.0 / (t - last));
+            interval = 0;
+            last = t;
+        }
+    }
+
+    tcdrain(fd);
+    double elapsed = now_s() - start;
+
+    printf("sustained: %.1f KB/s (%llu bytes in %.2f s)\n", total / 1024.0 / elapsed, (unsigned long long)total, elapsed);
+
+    if (telemetry_fd >= 0) {
+        draining = 0;
+        pthread_join(telemetry_thread, NULL);
+        printf("telemetry: %llu bytes received alongside\n", (unsigned long long)telemetry_bytes);
+        close(telemetry_fd);
+    }
+
+    close(fd);
+    return 0;
+}
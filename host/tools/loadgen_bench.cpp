@@ -0,0 +1,176 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ditoo/emulator.hpp"
+#include "divoom.h"
+#include "loadgen.h"
+
+// Runs the adapter's CMD_BENCH traffic generator (src/loadgen) on the host and
+// prints the summary the adapter would answer with. Without --emu the frames
+// go through a Divoom parser like the adapter's loopback mode, with --emu they
+// go to the Ditoo emulator, which stands in for the RFCOMM link: --bandwidth
+// limits the link rate and --credits makes the device stop reading until it
+// answered. The generator feeds the link directly, the numbers leave out the
+// bt task and its queue.
+//
+// usage: loadgen-bench [--size N] [--rate N] [--duration-ms N] [--command N]
+//                      [--emu] [--bandwidth BYTES/S] [--credits N]
+//                      [--latency-us N]
+
+using Clock = std::chrono::steady_clock;
+
+static void usage(const char* name) {
+    std::fprintf(stderr,
+                 "usage: %s [--size N] [--rate N] [--duration-ms N] [--command N]\n"
+                 "          [--emu] [--bandwidth BYTES/S] [--credits N] [--latency-us N]\n",
+                 name);
+}
+
+static uint32_t micros(Clock::time_point start, Clock::time_point now) {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+}
+
+static void on_frame(const uint8_t*, uint16_t, void* context) {
+    *static_cast<bool*>(context) = true;
+}
+
+int main(int argc, char** argv) {
+    loadgen_config_t config = {};
+    config.mode = LOADGEN_LOOPBACK;
+    config.command = LOADGEN_COMMAND;
+    config.size = LOADGEN_SIZE;
+    config.duration_ms = LOADGEN_DURATION_MS;
+    ditoo::EmulatorConfig emu_config;
+    uint32_t bandwidth = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--emu") {
+            config.mode = LOADGEN_RFCOMM;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        unsigned long value = std::strtoul(argv[++i], nullptr, 0);
+        if (arg == "--size")
+            config.size = value;
+        else if (arg == "--rate")
+            config.rate = value;
+        else if (arg == "--duration-ms")
+            config.duration_ms = value;
+        else if (arg == "--command")
+            config.command = value;
+        else if (arg == "--bandwidth")
+            bandwidth = value;
+        else if (arg == "--credits")
+            emu_config.credits = value;
+        else if (arg == "--latency-us")
+            emu_config.latency = std::chrono::microseconds(value);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!config.size || config.size >= DIVOOM_MAX_FRAME || !config.duration_ms) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Clock::time_point start = Clock::now();
+    ditoo::Emulator emulator(emu_config, start);
+
+    divoom_parser_t loopback;
+    divoom_parser_init(&loopback, true);
+
+    loadgen_t gen;
+    loadgen_start(&gen, &config, 0);
+
+    std::vector<uint8_t> frame(2 * (3 + DIVOOM_MAX_FRAME + 2) + 2);
+    // bytes of the current frame the emulator did not take yet
+    size_t frame_size = 0;
+    size_t frame_taken = 0;
+    // the link is busy with the previous frame until then
+    Clock::time_point link_free = start;
+
+    while (true) {
+        Clock::time_point now = Clock::now();
+        if (!loadgen_poll(&gen, micros(start, now))) break;
+
+        if (config.mode == LOADGEN_LOOPBACK) {
+            while (loadgen_frame_ready(&gen)) {
+                size_t size = loadgen_frame(&gen, frame.data(), frame.size(), loopback.escaped);
+
+                bool looped = false;
+                divoom_parser_feed(&loopback, frame.data(), size, &on_frame, &looped);
+                if (!looped) {
+                    std::fprintf(stderr, "frame lost in the loopback\n");
+                    return 1;
+                }
+
+                loadgen_sent(&gen, size, micros(start, Clock::now()));
+                loadgen_poll(&gen, micros(start, Clock::now()));
+            }
+        } else {
+            emulator.poll(now);
+
+            if (!frame_size && loadgen_frame_ready(&gen) && now >= link_free) {
+                frame_size = loadgen_frame(&gen, frame.data(), frame.size(), true);
+                frame_taken = 0;
+            }
+
+            if (frame_size) {
+                frame_taken += emulator.receive(frame.data() + frame_taken, frame_size - frame_taken, now);
+
+                // like RFCOMM, a frame is sent once the link took all of it
+                if (frame_taken == frame_size) {
+                    if (bandwidth) link_free = now + std::chrono::microseconds((uint64_t)frame_size * 1000000 / bandwidth);
+                    loadgen_sent(&gen, frame_size, micros(start, now));
+                    frame_size = 0;
+                    continue;
+                }
+            }
+        }
+
+        // sleep until the next frame is due, the link is free or the device
+        // may have read on
+        Clock::time_point next = now + std::chrono::microseconds(loadgen_next_us(&gen, micros(start, now)));
+        if (config.mode == LOADGEN_RFCOMM) {
+            if (loadgen_frame_ready(&gen) && !frame_size) next = std::min(next, link_free);
+            if (frame_size) next = std::min(next, std::min(emulator.next_event(), now + std::chrono::milliseconds(1)));
+        }
+        if (next > now) std::this_thread::sleep_until(next);
+    }
+
+    loadgen_result_t result;
+    loadgen_result(&gen, micros(start, Clock::now()), &result);
+
+    double seconds = result.duration_us / 1e6;
+
+    std::printf("%s, %u byte payload, %s\n", config.mode == LOADGEN_LOOPBACK ? "loopback" : "emulator", config.size,
+                config.rate ? (std::to_string(config.rate) + " frames/s").c_str() : "as fast as possible");
+    std::printf("frames %u  bytes %llu  drops %u  in %.3f s\n", result.frames, (unsigned long long)result.bytes,
+                result.drops, seconds);
+    std::printf("%.0f frames/s  %.0f bytes/s\n", seconds > 0 ? result.frames / seconds : 0.0,
+                seconds > 0 ? result.bytes / seconds : 0.0);
+    std::printf("latency p50 %u us  p90 %u us  p99 %u us  max %u us\n", result.p50_us, result.p90_us, result.p99_us,
+                result.max_us);
+
+    if (config.mode == LOADGEN_RFCOMM) {
+        const ditoo::EmulatorStats& stats = emulator.stats();
+        std::printf("device frames %llu  stalls %llu  checksum errors %llu\n", (unsigned long long)stats.frames,
+                    (unsigned long long)stats.stalls, (unsigned long long)stats.checksum_errors);
+    }
+
+    return 0;
+}
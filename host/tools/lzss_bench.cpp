@@ -0,0 +1,224 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "divoom.h"
+#include "lzss.h"
+#include "text.h"
+
+// Compresses macro code (see src/bt-client/macro.h) the way it is stored with
+// "lzss": true and replays it like the adapter's macro player, which reads
+// each instruction header and then each frame into the RFCOMM send buffer.
+// Reports the compression ratio and the decompression throughput for built-in
+// sample animations and for files of macro code given on the command line.
+// --out writes the stream of the last input, ready to be uploaded.
+//
+// usage: lzss-bench [--iterations N] [--out FILE] [file...]
+
+using Clock = std::chrono::steady_clock;
+
+// MACRO_STORAGE in src/bt-client/macro.h
+constexpr size_t kMacroStorage = 4096;
+// largest RFCOMM frame the player decodes into at once
+constexpr size_t kSendBuffer = 1024;
+
+constexpr uint8_t kOpFrame = 0x00;
+constexpr uint8_t kOpDelay = 0x01;
+
+struct Sample {
+    std::string name;
+    std::vector<uint8_t> code;
+};
+
+static void put_op(std::vector<uint8_t>& code, uint8_t op, uint16_t arg) {
+    code.push_back(op);
+    code.push_back(arg & 0xFF);
+    code.push_back(arg >> 8);
+}
+
+static void put_image(std::vector<uint8_t>& code, const uint8_t* bitmap, const uint8_t* foreground,
+                      const uint8_t* background, uint16_t delay_ms) {
+    uint8_t frame[256];
+    size_t size = divoom_encode_image(bitmap, foreground, background, frame, sizeof(frame), true);
+
+    put_op(code, kOpFrame, size);
+    code.insert(code.end(), frame, frame + size);
+    put_op(code, kOpDelay, delay_ms);
+}
+
+// One pass of scrolling text, as the ticker sends it
+static Sample ticker_sample() {
+    Sample sample{"ticker", {}};
+    const char* message = "Hello Ditoo! 0123456789";
+    const uint8_t white[3] = {0xFF, 0xFF, 0xFF};
+    const uint8_t black[3] = {0, 0, 0};
+
+    text_t text;
+    text_layout(&text, message, std::strlen(message), 2);
+
+    uint8_t bitmap[TEXT_BITMAP_SIZE];
+    for (int32_t offset = -TEXT_SIZE; offset <= text_width(&text); ++offset) {
+        text_render(&text, offset, bitmap);
+        put_image(sample.code, bitmap, white, black, 100);
+    }
+
+    return sample;
+}
+
+// A fixed picture fading through colours, only the palette changes
+static Sample pulse_sample() {
+    Sample sample{"pulse", {}};
+    const uint8_t black[3] = {0, 0, 0};
+
+    uint8_t bitmap[TEXT_BITMAP_SIZE];
+    for (int y = 0; y < TEXT_SIZE; ++y)
+        for (int x = 0; x < TEXT_SIZE; ++x) {
+            int dx = 2 * x - 15, dy = 2 * y - 15;
+            int n = y * TEXT_SIZE + x;
+            if (dx * dx + dy * dy < 180) bitmap[n >> 3] |= 1 << (n & 7);
+            else bitmap[n >> 3] &= ~(1 << (n & 7));
+        }
+
+    for (int i = 0; i < 64; ++i) {
+        uint8_t level = i < 32 ? i * 8 : (63 - i) * 8;
+        const uint8_t colour[3] = {0xFF, level, (uint8_t)(0xFF - level)};
+        put_image(sample.code, bitmap, colour, black, 50);
+    }
+
+    return sample;
+}
+
+// Random pixels, the worst case
+static Sample noise_sample() {
+    Sample sample{"noise", {}};
+    std::mt19937 random(1);
+
+    for (int i = 0; i < 32; ++i) {
+        uint8_t bitmap[TEXT_BITMAP_SIZE];
+        for (uint8_t& byte : bitmap)
+            byte = random();
+
+        const uint8_t foreground[3] = {(uint8_t)random(), (uint8_t)random(), (uint8_t)random()};
+        const uint8_t background[3] = {(uint8_t)random(), (uint8_t)random(), (uint8_t)random()};
+        put_image(sample.code, bitmap, foreground, background, 50);
+    }
+
+    return sample;
+}
+
+static bool read_file(const char* path, std::vector<uint8_t>& data) {
+    FILE* file = std::fopen(path, "rb");
+    if (!file) return false;
+
+    uint8_t buf[4096];
+    size_t size;
+    while ((size = std::fread(buf, 1, sizeof(buf), file)) > 0)
+        data.insert(data.end(), buf, buf + size);
+
+    std::fclose(file);
+    return true;
+}
+
+// Decodes the stream like the macro player, returns the frames or -1 if the
+// code does not come out as it went in
+static long replay(const std::vector<uint8_t>& stream, const std::vector<uint8_t>& code, bool verify) {
+    static lzss_decoder_t decoder;
+    uint8_t buffer[kSendBuffer];
+    size_t pos = 0;
+    long frames = 0;
+
+    lzss_decoder_init(&decoder);
+
+    while (true) {
+        uint8_t header[3];
+        size_t got = lzss_decode(&decoder, stream.data(), stream.size(), header, sizeof(header));
+        if (got < sizeof(header)) return got == 0 && lzss_done(&decoder, stream.size()) && pos == code.size() ? frames : -1;
+
+        if (verify && std::memcmp(header, &code[pos], sizeof(header)) != 0) return -1;
+        pos += sizeof(header);
+
+        if (header[0] != kOpFrame) continue;
+
+        size_t size = header[1] | header[2] << 8;
+        if (size > sizeof(buffer) || lzss_decode(&decoder, stream.data(), stream.size(), buffer, size) != size) return -1;
+
+        if (verify && std::memcmp(buffer, &code[pos], size) != 0) return -1;
+        pos += size;
+        ++frames;
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = 200;
+    const char* out_path = nullptr;
+    std::vector<Sample> samples = {ticker_sample(), pulse_sample(), noise_sample()};
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = std::strtoul(argv[++i], nullptr, 0);
+        } else if (std::strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            std::fprintf(stderr, "usage: %s [--iterations N] [--out FILE] [file...]\n", argv[0]);
+            return 1;
+        } else {
+            Sample sample{argv[i], {}};
+            if (!read_file(argv[i], sample.code)) {
+                std::fprintf(stderr, "cannot read %s\n", argv[i]);
+                return 1;
+            }
+            samples.push_back(std::move(sample));
+        }
+    }
+
+    if (!iterations) iterations = 1;
+
+    std::printf("%-12s %7s %7s %6s %6s %10s %10s\n", "sample", "raw", "lzss", "ratio", "frames", "encode", "decode");
+
+    std::vector<uint8_t> stream;
+
+    for (const Sample& sample : samples) {
+        stream.resize(LZSS_BOUND(sample.code.size()));
+
+        Clock::time_point start = Clock::now();
+        stream.resize(lzss_encode(sample.code.data(), sample.code.size(), stream.data(), stream.size()));
+        double encode_s = std::chrono::duration<double>(Clock::now() - start).count();
+
+        long frames = replay(stream, sample.code, true);
+        if (frames < 0) {
+            std::fprintf(stderr, "%s: the stream does not decode to its input\n", sample.name.c_str());
+            return 1;
+        }
+
+        start = Clock::now();
+        for (size_t i = 0; i < iterations; ++i)
+            replay(stream, sample.code, false);
+        double decode_s = std::chrono::duration<double>(Clock::now() - start).count();
+
+        // the fits marks show which form the adapter's macro storage can hold
+        std::printf("%-12s %6zu%s %6zu%s %5.2fx %6ld %7.1f MB/s %5.1f MB/s\n", sample.name.c_str(), sample.code.size(),
+                    sample.code.size() <= kMacroStorage ? " " : "*", stream.size(),
+                    stream.size() <= kMacroStorage ? " " : "*",
+                    stream.size() ? double(sample.code.size()) / stream.size() : 0.0, frames,
+                    encode_s > 0 ? sample.code.size() / encode_s / 1e6 : 0.0,
+                    decode_s > 0 ? sample.code.size() * iterations / decode_s / 1e6 : 0.0);
+    }
+
+    std::printf("* does not fit the %zu byte macro storage\n", kMacroStorage);
+
+    if (out_path) {
+        FILE* file = std::fopen(out_path, "wb");
+        if (!file || std::fwrite(stream.data(), 1, stream.size(), file) != stream.size()) {
+            std::fprintf(stderr, "cannot write %s\n", out_path);
+            return 1;
+        }
+        std::fclose(file);
+    }
+
+    return 0;
+}
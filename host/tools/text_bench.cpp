@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "divoom.h"
+#include "text.h"
+
+// Renders scrolling text the way the adapter's ticker does (src/bt-client/
+// ticker.c) and reports the time per frame, for the rasteriser alone and
+// together with encoding the Divoom image frame. With --preview it prints the
+// frames as text instead.
+//
+// usage: text-bench [--preview] [--scale 1|2] [--frames n] [text]
+
+using Clock = std::chrono::steady_clock;
+
+static void print_bitmap(const uint8_t* bitmap) {
+    for (int y = 0; y < TEXT_SIZE; ++y) {
+        for (int x = 0; x < TEXT_SIZE; ++x) {
+            int n = y * TEXT_SIZE + x;
+            std::putchar(bitmap[n >> 3] & (1 << (n & 7)) ? '#' : '.');
+        }
+        std::putchar('\n');
+    }
+    std::putchar('\n');
+}
+
+static void report(const char* name, std::vector<double>& ns) {
+    std::sort(ns.begin(), ns.end());
+
+    double sum = 0;
+    for (double v : ns) sum += v;
+
+    std::printf("%-16s avg %8.1f ns  p50 %8.1f ns  p99 %8.1f ns  max %8.1f ns\n", name, sum / ns.size(), ns[ns.size() / 2],
+                ns[ns.size() * 99 / 100], ns.back());
+}
+
+int main(int argc, char** argv) {
+    bool preview = false;
+    uint8_t scale = 2;
+    size_t frames = 100000;
+    std::string message = "Hello Ditoo! 23\xC2\xB0" "C, 0123456789 abcdefghijklmnopqrstuvwxyz";
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--preview") == 0) {
+            preview = true;
+        } else if (std::strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = std::strtoul(argv[++i], nullptr, 0);
+        } else if (argv[i][0] == '-') {
+            std::fprintf(stderr, "usage: %s [--preview] [--scale 1|2] [--frames n] [text]\n", argv[0]);
+            return 1;
+        } else {
+            message = argv[i];
+        }
+    }
+
+    text_t text;
+    text_layout(&text, message.data(), message.size(), scale);
+    int32_t width = text_width(&text);
+
+    std::printf("%u glyphs, %d columns, %d frames per pass\n", text.count, width, width + TEXT_SIZE + 1);
+
+    uint8_t bitmap[TEXT_BITMAP_SIZE];
+
+    if (preview) {
+        for (int32_t offset = -TEXT_SIZE; offset <= width; offset += TEXT_SIZE / 2) {
+            text_render(&text, offset, bitmap);
+            print_bitmap(bitmap);
+        }
+        return 0;
+    }
+
+    const uint8_t white[3] = {0xFF, 0xFF, 0xFF};
+    const uint8_t black[3] = {0, 0, 0};
+    uint8_t frame[256];
+
+    std::vector<double> render_ns, frame_ns;
+    render_ns.reserve(frames);
+    frame_ns.reserve(frames);
+
+    size_t bytes = 0;
+    int32_t offset = -TEXT_SIZE;
+
+    for (size_t i = 0; i < frames; ++i) {
+        auto start = Clock::now();
+        text_render(&text, offset, bitmap);
+        auto rendered = Clock::now();
+        bytes += divoom_encode_image(bitmap, white, black, frame, sizeof(frame), true);
+        auto encoded = Clock::now();
+
+        render_ns.push_back(std::chrono::duration<double, std::nano>(rendered - start).count());
+        frame_ns.push_back(std::chrono::duration<double, std::nano>(encoded - start).count());
+
+        if (++offset > width) offset = -TEXT_SIZE;
+    }
+
+    report("render", render_ns);
+    report("render + encode", frame_ns);
+    std::printf("%.1f bytes per frame on the wire\n", double(bytes) / frames);
+
+    return 0;
+}
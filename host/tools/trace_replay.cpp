@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ditoo/client.hpp"
+#include "ditoo/emulator.hpp"
+#include "divoom.h"
+#include "trace.h"
+
+// Replays a traffic trace recorded with btsnoop-dump --trace.
+//
+// By default the RFCOMM frames of the trace go to the Ditoo emulator at the
+// times they were sent, which shows how the link model copes with the
+// workload: how far the frames fall behind their schedule and how often the
+// device stalled. No firmware code runs in that mode. With --tty the host
+// commands of the trace are sent to an adapter instead, requests are timed
+// until their reply, so firmware builds can be compared on the same
+// workload. --speed scales the clock, 2 replays twice as fast, 0 as fast as
+// it goes. --dump lists the records.
+//
+// usage: trace-replay [--dump] [--speed X] [--tty DEV] [--credits N]
+//                     [--bandwidth BYTES/S] [--latency-us N] <file>
+
+using Clock = std::chrono::steady_clock;
+
+struct Event {
+    // us since the trace started
+    uint64_t at_us;
+    uint8_t kind;
+    std::vector<uint8_t> payload;
+};
+
+static void usage(const char* name) {
+    std::fprintf(stderr,
+                 "usage: %s [--dump] [--speed X] [--tty DEV] [--credits N]\n"
+                 "          [--bandwidth BYTES/S] [--latency-us N] <file>\n",
+                 name);
+}
+
+static bool load(const char* path, std::vector<Event>& events, uint64_t& drops) {
+    FILE* file = std::fopen(path, "rb");
+    if (!file) {
+        std::perror(path);
+        return false;
+    }
+
+    std::vector<uint8_t> data;
+    uint8_t buf[4096];
+    size_t size;
+    while ((size = std::fread(buf, 1, sizeof(buf), file)) > 0)
+        data.insert(data.end(), buf, buf + size);
+    std::fclose(file);
+
+    if (data.size() < TRACE_FILE_HEADER_SIZE || std::memcmp(data.data(), "dtrace\0\0", 8) != 0 ||
+        data[8] != TRACE_VERSION) {
+        std::fprintf(stderr, "%s is not a trace\n", path);
+        return false;
+    }
+
+    uint64_t at = 0;
+    size_t pos = TRACE_FILE_HEADER_SIZE;
+
+    while (pos < data.size()) {
+        trace_record_t record;
+        size_t used = trace_parse_record(&data[pos], data.size() - pos, &record);
+        // the stream may end in the middle of a record
+        if (!used) break;
+
+        at += record.delta_us;
+        pos += used;
+
+        if (record.kind == TRACE_DROPS) {
+            uint32_t count;
+            if (trace_get_varint(record.payload, record.length, &count)) drops += count;
+            continue;
+        }
+
+        events.push_back({at, record.kind, std::vector<uint8_t>(record.payload, record.payload + record.length)});
+    }
+
+    return true;
+}
+
+static Clock::time_point due(Clock::time_point start, uint64_t at_us, double speed) {
+    if (speed <= 0) return start;
+    return start + std::chrono::microseconds((uint64_t)(at_us / speed));
+}
+
+static void report(const char* name, std::vector<uint32_t>& us) {
+    if (us.empty()) return;
+
+    std::sort(us.begin(), us.end());
+    std::printf("%s p50 %u us  p90 %u us  p99 %u us  max %u us\n", name, us[us.size() / 2], us[us.size() * 9 / 10],
+                us[us.size() * 99 / 100], us.back());
+}
+
+static void dump(const std::vector<Event>& events) {
+    for (const Event& event : events) {
+        std::printf("%10.3f ms  ", event.at_us / 1000.0);
+
+        if (event.kind == TRACE_COMMAND && event.payload.size() >= TRACE_COMMAND_HEADER_SIZE) {
+            const uint8_t* p = event.payload.data();
+            std::printf("command  client %u  type %u  id %u  flags 0x%02x  %zu bytes\n", p[0], p[1], p[2] | p[3] << 8,
+                        p[4], event.payload.size() - TRACE_COMMAND_HEADER_SIZE);
+        } else if (event.kind == TRACE_RFCOMM) {
+            int command = divoom_frame_command(event.payload.data(), event.payload.size(), true);
+            std::printf("rfcomm   command 0x%02x  %zu bytes\n", command < 0 ? 0 : command, event.payload.size());
+        } else {
+            std::printf("kind %u  %zu bytes\n", event.kind, event.payload.size());
+        }
+    }
+}
+
+// Frames into the emulator, the link takes one frame at a time like RFCOMM
+static void replay_emulator(const std::vector<Event>& events, double speed, const ditoo::EmulatorConfig& config,
+                            uint32_t bandwidth) {
+    Clock::time_point start = Clock::now();
+    ditoo::Emulator emulator(config, start);
+
+    std::vector<uint32_t> behind;
+    uint64_t frames = 0, bytes = 0;
+    Clock::time_point link_free = start;
+
+    for (const Event& event : events) {
+        if (event.kind != TRACE_RFCOMM) continue;
+
+        Clock::time_point scheduled = due(start, event.at_us, speed);
+        std::this_thread::sleep_until(std::max(scheduled, link_free));
+
+        size_t taken = 0;
+        while (true) {
+            Clock::time_point now = Clock::now();
+            emulator.poll(now);
+            taken += emulator.receive(event.payload.data() + taken, event.payload.size() - taken, now);
+            if (taken == event.payload.size()) break;
+
+            // out of credits, wait for the device to read on
+            std::this_thread::sleep_until(std::min(emulator.next_event(), now + std::chrono::milliseconds(1)));
+        }
+
+        Clock::time_point now = Clock::now();
+        if (bandwidth) link_free = now + std::chrono::microseconds((uint64_t)event.payload.size() * 1000000 / bandwidth);
+
+        behind.push_back(std::chrono::duration_cast<std::chrono::microseconds>(now - scheduled).count());
+        frames++;
+        bytes += event.payload.size();
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    const ditoo::EmulatorStats& stats = emulator.stats();
+
+    std::printf("emulator: %llu frames, %llu bytes in %.3f s, %.0f bytes/s\n", (unsigned long long)frames,
+                (unsigned long long)bytes, seconds, seconds > 0 ? bytes / seconds : 0.0);
+    report("behind schedule", behind);
+    std::printf("device frames %llu  stalls %llu  checksum errors %llu\n", (unsigned long long)stats.frames,
+                (unsigned long long)stats.stalls, (unsigned long long)stats.checksum_errors);
+}
+
+// Host commands to an adapter. A waiter thread collects the replies, each
+// request is timed from its send until the client received its reply and
+// given up on 5 s after its send, whatever the requests before it did.
+static int replay_adapter(const std::vector<Event>& events, double speed, const std::string& tty) {
+    ditoo::Client client(tty);
+
+    struct Request {
+        Clock::time_point sent;
+        std::future<ditoo::Message> reply;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Request> pending;
+    bool done = false;
+
+    std::vector<uint32_t> latency;
+    uint64_t requests = 0, busy = 0, lost = 0;
+
+    std::thread waiter([&] {
+        while (true) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return done || !pending.empty(); });
+                if (pending.empty()) return;
+                request = std::move(pending.front());
+                pending.pop_front();
+            }
+
+            if (request.reply.wait_until(request.sent + std::chrono::seconds(5)) != std::future_status::ready) {
+                lost++;
+                continue;
+            }
+
+            try {
+                ditoo::Message reply = request.reply.get();
+                if (reply.type == ditoo::Command::Busy) busy++;
+                latency.push_back(
+                    std::chrono::duration_cast<std::chrono::microseconds>(reply.received - request.sent).count());
+            } catch (const std::exception&) {
+                lost++;
+            }
+        }
+    });
+
+    uint64_t sent = 0;
+    Clock::time_point start = Clock::now();
+
+    for (const Event& event : events) {
+        if (event.kind != TRACE_COMMAND || event.payload.size() < TRACE_COMMAND_HEADER_SIZE) continue;
+
+        const uint8_t* p = event.payload.data();
+        auto type = static_cast<ditoo::Command>(p[1]);
+        uint16_t id = p[2] | p[3] << 8;
+        uint8_t flags = p[4];
+
+        // the client runs its own flow control, and a capture would end the
+        // one that may be recording this replay
+        if (type == ditoo::Command::Credit || type == ditoo::Command::Capture) continue;
+
+        std::vector<uint8_t> data(event.payload.begin() + TRACE_COMMAND_HEADER_SIZE, event.payload.end());
+
+        std::this_thread::sleep_until(due(start, event.at_us, speed));
+
+        if (id) {
+            Request request{Clock::now(), client.request(type, std::move(data), flags)};
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(std::move(request));
+            requests++;
+            cv.notify_one();
+        } else {
+            client.send(type, std::move(data), flags);
+        }
+        sent++;
+    }
+
+    client.flush();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        cv.notify_one();
+    }
+    waiter.join();
+
+    double recorded = events.empty() ? 0 : events.back().at_us / 1e6;
+    std::printf("adapter: %llu commands in %.3f s (recorded %.3f s), %llu requests, %llu busy, %llu unanswered\n",
+                (unsigned long long)sent, seconds, recorded, (unsigned long long)requests, (unsigned long long)busy,
+                (unsigned long long)lost);
+    report("reply latency", latency);
+
+    return lost ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    bool list = false;
+    double speed = 1;
+    std::string tty;
+    const char* path = nullptr;
+    ditoo::EmulatorConfig config;
+    uint32_t bandwidth = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--dump") {
+            list = true;
+        } else if (arg[0] != '-') {
+            path = argv[i];
+        } else if (i + 1 < argc) {
+            const char* value = argv[++i];
+            if (arg == "--speed")
+                speed = std::strtod(value, nullptr);
+            else if (arg == "--tty")
+                tty = value;
+            else if (arg == "--credits")
+                config.credits = std::strtoul(value, nullptr, 0);
+            else if (arg == "--bandwidth")
+                bandwidth = std::strtoul(value, nullptr, 0);
+            else if (arg == "--latency-us")
+                config.latency = std::chrono::microseconds(std::strtoul(value, nullptr, 0));
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<Event> events;
+    uint64_t drops = 0;
+    if (!load(path, events, drops)) return 1;
+
+    size_t commands = std::count_if(events.begin(), events.end(), [](const Event& e) { return e.kind == TRACE_COMMAND; });
+    std::printf("%zu records, %zu commands, %zu frames over %.3f s, %llu records lost while recording\n", events.size(),
+                commands, events.size() - commands, events.empty() ? 0 : events.back().at_us / 1e6,
+                (unsigned long long)drops);
+
+    if (list) {
+        dump(events);
+        return 0;
+    }
+
+    if (!tty.empty()) return replay_adapter(events, speed, tty);
+
+    replay_emulator(events, speed, config, bandwidth);
+    return 0;
+}
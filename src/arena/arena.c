@@ -0,0 +1,103 @@
+#include "arena.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define ALIGN 8
+
+// every block starts with its size, rounded up to ALIGN, and the offset of
+// the block below it
+typedef struct {
+    size_t size;
+    size_t prev;
+} header_t;
+
+// set in the size of a block that was freed while others sat on top of it
+#define FREED 1
+
+static uint8_t arena[ARENA_SIZE] __attribute__((aligned(ALIGN)));
+
+static size_t top;
+static size_t peak;
+// offset of the topmost block's header
+static size_t last = SIZE_MAX;
+
+static size_t round_up(size_t size) {
+    return (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+}
+
+static header_t* header_of(void* ptr) {
+    return (header_t*)ptr - 1;
+}
+
+void* arena_malloc(size_t size) {
+    size = round_up(size);
+    if (size > ARENA_SIZE - sizeof(header_t) || top > ARENA_SIZE - sizeof(header_t) - size) return NULL;
+
+    header_t* header = (header_t*)(arena + top);
+    header->size = size;
+    header->prev = last;
+
+    last = top;
+    top += sizeof(header_t) + size;
+
+    if (top > peak) peak = top;
+
+    return header + 1;
+}
+
+void* arena_realloc(void* ptr, size_t size) {
+    if (!ptr) return arena_malloc(size);
+
+    header_t* header = header_of(ptr);
+    size = round_up(size);
+
+    if (size <= header->size) return ptr;
+
+    // the topmost block grows in place
+    if ((uint8_t*)header == arena + last) {
+        if (size > ARENA_SIZE - last - sizeof(header_t)) return NULL;
+
+        header->size = size;
+        top = last + sizeof(header_t) + size;
+        if (top > peak) peak = top;
+
+        return ptr;
+    }
+
+    void* moved = arena_malloc(size);
+    if (!moved) return NULL;
+
+    memcpy(moved, ptr, header->size);
+    arena_free(ptr);
+
+    return moved;
+}
+
+void arena_free(void* ptr) {
+    if (!ptr) return;
+
+    header_t* header = header_of(ptr);
+
+    if ((uint8_t*)header != arena + last) {
+        header->size |= FREED;
+        return;
+    }
+
+    // the topmost block goes back together with the freed ones below it
+    top = last;
+    last = header->prev;
+
+    while (last != SIZE_MAX && (((header_t*)(arena + last))->size & FREED)) {
+        top = last;
+        last = ((header_t*)(arena + last))->prev;
+    }
+}
+
+size_t arena_used(void) {
+    return top;
+}
+
+size_t arena_peak(void) {
+    return peak;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+
+// Fixed RAM arena standing in for malloc in the static allocation build
+// (DITOO_STATIC_ALLOC), mpack's MPACK_MALLOC, MPACK_REALLOC and MPACK_FREE
+// point here so that the cdc task's stream trees need no heap.
+//
+// Blocks are taken from the top and growing the topmost block works in place.
+// Freeing the topmost block returns it together with every freed block right
+// below it, a block freed further down waits for the ones above it. That fits
+// the stream trees of the USB clients, which keep their buffer and root page
+// for as long as they live and only allocate again for messages beyond them. A
+// request that does not fit fails, mpack reports it as mpack_error_memory and
+// the stream is reset.
+//
+// Not thread safe, the cdc task is the only user. The default holds the trees
+// of both clients, see dev.c.
+
+#ifndef ARENA_SIZE
+#define ARENA_SIZE (24 * 1024)
+#endif
+
+void* arena_malloc(size_t size);
+void* arena_realloc(void* ptr, size_t size);
+void arena_free(void* ptr);
+
+size_t arena_used(void);
+size_t arena_peak(void);
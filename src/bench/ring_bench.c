@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+
+// FreeRTOS
+#include "FreeRTOS.h"
+#include "queue.h"
+#include "task.h"
+
+// Pico
+#include "pico/stdlib.h"
+
+// Ditoo stack
+#include "cmd.h"
+
+// Compares the cross-core handoff used between the bt and cdc tasks
+// (cmd_ring_t + task notification) with a FreeRTOS queue of the same depth.
+// The producer runs on core 0, the consumer on core 1, results go to UART.
+
+#define BENCH_MESSAGES 20000
+#define BENCH_LATENCY_SAMPLES 2000
+
+typedef struct {
+    const char* name;
+    void (*send)(const command_t* cmd);
+    void (*recv)(command_t* cmd);
+} transport_t;
+
+static cmd_ring_t ring;
+static QueueHandle_t queue;
+static TaskHandle_t consumer_handle;
+static const transport_t* transport;
+
+static volatile uint32_t consumed;
+static uint64_t latency_sum;
+static uint32_t latency_max;
+
+//--------------------------------------------------------------------+
+// Transports
+//--------------------------------------------------------------------+
+
+static void ring_wake(void) {
+    xTaskNotifyGive(consumer_handle);
+}
+
+static void ring_send(const command_t* cmd) {
+    while (!cmd_ring_push(&ring, cmd))
+        taskYIELD();
+}
+
+static void ring_recv(command_t* cmd) {
+    while (!cmd_ring_pop(&ring, cmd))
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+static void queue_send(const command_t* cmd) {
+    xQueueSend(queue, cmd, portMAX_DELAY);
+}
+
+static void queue_recv(command_t* cmd) {
+    xQueueReceive(queue, cmd, portMAX_DELAY);
+}
+
+static const transport_t transports[] = {
+    {"xQueue", queue_send, queue_recv},
+    {"cmd_ring", ring_send, ring_recv},
+};
+
+//--------------------------------------------------------------------+
+// Bench
+//--------------------------------------------------------------------+
+
+static void consumer_task(__unused void* param) {
+    static command_t cmd;
+
+    while (true) {
+        transport->recv(&cmd);
+
+        uint32_t sent;
+        memcpy(&sent, cmd.data, sizeof(sent));
+
+        uint32_t latency = time_us_32() - sent;
+        latency_sum += latency;
+        if (latency > latency_max) latency_max = latency;
+
+        consumed = consumed + 1;
+    }
+}
+
+static void send_stamped(command_t* cmd) {
+    uint32_t now = time_us_32();
+    memcpy(cmd->data, &now, sizeof(now));
+    transport->send(cmd);
+}
+
+static void run(const transport_t* t) {
+    static command_t cmd = {.type = CMD_DITOO, .length = sizeof(cmd.data)};
+
+    transport = t;
+    consumed = 0;
+    memset(&ring, 0, sizeof(ring));
+    xQueueReset(queue);
+
+    xTaskCreateAffinitySet(consumer_task, "consumer", configMINIMAL_STACK_SIZE, NULL, configMAX_PRIORITIES - 1, 2, &consumer_handle);
+    cmd_ring_set_wake(&ring, &ring_wake);
+
+    // throughput: push as fast as the consumer lets us
+    uint64_t start = time_us_64();
+    for (uint32_t i = 0; i < BENCH_MESSAGES; ++i)
+        send_stamped(&cmd);
+    while (consumed != BENCH_MESSAGES)
+        taskYIELD();
+    uint64_t elapsed = time_us_64() - start;
+
+    // latency: one message in flight at a time, so every send wakes the consumer
+    latency_sum = 0;
+    latency_max = 0;
+    for (uint32_t i = 0; i < BENCH_LATENCY_SAMPLES; ++i) {
+        uint32_t target = consumed + 1;
+        send_stamped(&cmd);
+        while (consumed != target)
+            taskYIELD();
+    }
+
+    vTaskDelete(consumer_handle);
+
+    printf("%-8s %7llu msg/s  latency avg %4lu us  max %5lu us\n", t->name,
+           (unsigned long long)BENCH_MESSAGES * 1000000ull / elapsed,
+           (unsigned long)(latency_sum / BENCH_LATENCY_SAMPLES), (unsigned long)latency_max);
+}
+
+static void bench_task(__unused void* param) {
+    printf("BENCH: %d x %u byte messages core 0 -> core 1\n", BENCH_MESSAGES, (unsigned)sizeof(command_t));
+
+    for (size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); ++i)
+        run(&transports[i]);
+
+    vTaskDelete(NULL);
+}
+
+int main(void) {
+    stdio_init_all();
+
+    queue = xQueueCreate(CMD_RING_SIZE, sizeof(command_t));
+
+    xTaskCreateAffinitySet(bench_task, "bench", configMINIMAL_STACK_SIZE, NULL, configMAX_PRIORITIES - 2, 1, NULL);
+
+    vTaskStartScheduler();
+
+    return 0;
+}
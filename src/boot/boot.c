@@ -0,0 +1,48 @@
+#include "boot.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Pico
+#include "pico/stdlib.h"
+
+static const char* const names[BOOT_COUNT] = {
+#define BOOT_NAME(name) #name,
+    BOOT_MILESTONES(BOOT_NAME)
+#undef BOOT_NAME
+};
+
+// written once each, 0 until then
+static volatile uint32_t times[BOOT_COUNT];
+static volatile bool reported;
+
+void boot_mark(boot_milestone_t milestone) {
+    if (times[milestone]) return;
+
+    uint32_t now = time_us_32();
+    // 0 means not reached
+    times[milestone] = now ? now : 1;
+
+    uint32_t ready = boot_ready_us();
+    if (ready && !reported) {
+        reported = true;
+        printf("BOOT: ready after %lu.%03lu ms\n", (unsigned long)(ready / 1000), (unsigned long)(ready % 1000));
+    }
+}
+
+const char* boot_name(boot_milestone_t milestone) {
+    return names[milestone];
+}
+
+uint32_t boot_time_us(boot_milestone_t milestone) {
+    return times[milestone];
+}
+
+uint32_t boot_ready_us(void) {
+    uint32_t usb = times[BOOT_usb_mounted];
+    uint32_t hci = times[BOOT_hci_working];
+
+    if (!usb || !hci) return 0;
+
+    return usb > hci ? usb : hci;
+}
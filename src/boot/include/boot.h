@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// Boot milestones, each stamped with the time it was first reached in
+// microseconds since the timer started at reset. The adapter is ready once
+// the host configured the USB device and HCI is working, whichever comes last.
+//
+// CMD_BOOT, answered by the cdc task with a msgpack map of every milestone
+// reached so far to its time, plus "ready" once both are done.
+
+// X(name)
+#define BOOT_MILESTONES(X)                                     \
+    X(main)             /* main() entered */                   \
+    X(params)           /* parameters loaded from flash */     \
+    X(scheduler)        /* the first task runs */              \
+    X(usb_init)         /* device stack up, pull-up enabled */ \
+    X(usb_board)        /* board support initialised */        \
+    X(usb_mounted)      /* configured by the host */           \
+    X(cdc_open)         /* host opened the data CDC */         \
+    X(cyw43_init)       /* radio driver and firmware loaded */ \
+    X(bt_init)          /* btstack layers set up */            \
+    X(hci_working)      /* HCI_STATE_WORKING */                \
+    X(first_command)    /* first host command taken by bt */
+
+typedef enum {
+#define BOOT_ID(name) BOOT_##name,
+    BOOT_MILESTONES(BOOT_ID)
+#undef BOOT_ID
+    BOOT_COUNT,
+} boot_milestone_t;
+
+// Stamps milestone unless it was reached before, callable from any task
+void boot_mark(boot_milestone_t milestone);
+
+const char* boot_name(boot_milestone_t milestone);
+
+// 0 if not reached yet
+uint32_t boot_time_us(boot_milestone_t milestone);
+uint32_t boot_ready_us(void);
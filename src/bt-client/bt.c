@@ -3,7 +3,19 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "boot.h"
+#include "capture.h"
 #include "cmd.h"
+#include "dedupe.h"
+#include "divoom.h"
+#include "generator.h"
+#include "link.h"
+#include "macro.h"
+#include "params.h"
+#include "power.h"
+#include "ticker.h"
+#include "scan.h"
+#include "trace.h"
 
 // bluetooth stack
 #include "btstack.h"
@@ -16,7 +28,11 @@
 // mpack
 #include "mpack/mpack.h"
 
-#define HEARTBEAT_PERIOD_MS 1000
+// Pack all frames that arrive in one RFCOMM packet into a single USB message
+#define RX_BATCH_FRAMES 1
+
+// Classic inquiry runs in rounds of params.inquiry_len and is restarted until
+// discovery stops
 
 typedef enum {
     IDLE,
@@ -28,23 +44,46 @@ typedef enum {
     SEND
 } state_t;
 
+// Hex dump every received RFCOMM packet and every command taken from the ring
+// on UART. The dumps are copied into the telemetry log ring as well, where
+// they push the real diagnostics out.
+#define DUMP_PACKETS 0
+
 static bd_addr_t empty = {0, 0, 0, 0, 0, 0};
 
-static uint8_t known_severs = 0;
-static bd_addr_t *known_server_addrs;
 static char device_name[31];
 static bd_addr_t server_addr;
 static bd_addr_type_t server_addr_type;
 static uint8_t rfcomm_server_channel;
 
 static command_t bt_cmd;
+static command_t select_cmd;
+
+// Request ids of sent frames, a reply takes the oldest id sent with the
+// command it answers
+#define PENDING_IDS 16
+static struct {
+    uint8_t command;
+    uint16_t id;
+} pending_ids[PENDING_IDS];
+static uint8_t pending_count;
+
+static divoom_parser_t divoom_rx;
+static command_t rx_batch = {.type = MPACK};
 
 static state_t state = IDLE;
+// whether the host's frame goes next when the adapter has a frame ready as well
+static bool host_turn;
 static uint16_t rfcomm_cid = 0;
 static uint16_t rfcomm_mtu;
 
+// the host suspended the bus, discovery is resumed with it
+static bool host_suspended;
+static bool scan_paused;
+
 // Handler
 static btstack_timer_source_t heartbeat;
+static btstack_data_source_t command_source;
 static btstack_packet_callback_registration_t hci_event_callback_registration;
 static btstack_context_callback_registration_t handle_sdp_client_query_request;
 
@@ -54,12 +93,35 @@ static void hci_packet_handler(uint8_t *packet, uint16_t size);
 static void handle_start_sdp_client_query(void *context);
 static void handle_query_rfcomm_event(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
 static void rfcomm_packet_handler(uint8_t *packet, uint16_t size);
+static void divoom_frame_handler(const uint8_t *frame, uint16_t length, void *context);
+static void reply_no_link(const command_t *cmd);
+static void reply_invalid(const command_t *cmd);
 static void bt_queue_handler();
+static void request_send(void);
+static bool local_frame_ready(void);
+static void command_source_handler(btstack_data_source_t *ds, btstack_data_source_callback_type_t callback_type);
 static void heart_beat_handler(btstack_timer_source_t *ts);
+static void power_changed(void);
+static void traffic(void);
+static void capture_reset(void);
+static void capture_log_packet(uint8_t packet_type, uint8_t in, uint8_t *packet, uint16_t len);
+static void capture_log_message(int log_level, const char *format, va_list argptr);
+
+// hci_dump backend feeding the btsnoop capture ring
+static const hci_dump_t capture_dump = {
+    .reset = &capture_reset,
+    .log_packet = &capture_log_packet,
+    .log_message = &capture_log_message,
+};
 
 // Helper methods
-static bool advertisement_report_contains_device_name(char *search_name, uint8_t *advertisement_report);
-static bool is_server_addr_known(bd_addr_t addr);
+static void advertisement_report_get_device_name(uint8_t *advertisement_report);
+static void inquiry_result_get_device_name(uint8_t *inquiry_result);
+static void usb_send(command_t *cmd);
+static void pending_id_push(uint8_t command, uint16_t id);
+static uint16_t pending_id_take(uint8_t command);
+static void rx_batch_add(command_t *cmd);
+static void rx_batch_flush(void);
 
 //--------------------------------------------------------------------+
 // Main
@@ -67,23 +129,47 @@ static bool is_server_addr_known(bd_addr_t addr);
 
 void bt_client_task(void *param) {
     UNUSED(param);
+    boot_mark(BOOT_scheduler);
+
     hard_assert(cyw43_arch_init() == PICO_OK);
+    boot_mark(BOOT_cyw43_init);
+
+    // HCI traffic is recorded once a capture is started over USB
+    hci_dump_init(&capture_dump);
 
     l2cap_init();
     rfcomm_init();
 
+    // the Ditoo escapes 0x01-0x03 inside frames
+    divoom_parser_init(&divoom_rx, true);
+
+    macro_init(&request_send);
+    ticker_init(&request_send);
+    generator_init(&request_send);
+
     hci_event_callback_registration.callback = &packet_handler;
     hci_add_event_handler(&hci_event_callback_registration);
 
     // SDP init
     gap_ssp_set_io_capability(SSP_IO_CAPABILITY_DISPLAY_YES_NO);
 
+    // inquiry results carry RSSI and the name from the extended inquiry response
+    hci_set_inquiry_mode(INQUIRY_MODE_RSSI_AND_EIR);
+
     handle_sdp_client_query_request.callback = &handle_start_sdp_client_query;
 
     btstack_run_loop_set_timer_handler(&heartbeat, heart_beat_handler);
-    btstack_run_loop_set_timer(&heartbeat, HEARTBEAT_PERIOD_MS);
+    btstack_run_loop_set_timer(&heartbeat, params.heartbeat_ms);
     btstack_run_loop_add_timer(&heartbeat);
 
+    // the cdc task wakes us through the run loop as soon as a command is queued
+    btstack_run_loop_set_data_source_handler(&command_source, &command_source_handler);
+    btstack_run_loop_enable_data_source_callbacks(&command_source, DATA_SOURCE_CALLBACK_POLL);
+    btstack_run_loop_add_data_source(&command_source);
+    cmd_ring_set_wake(&bt_command_ring, &btstack_run_loop_poll_data_sources_from_irq);
+    power_set_wake(&btstack_run_loop_poll_data_sources_from_irq);
+
+    boot_mark(BOOT_bt_init);
     hci_power_control(HCI_POWER_ON);
 
     while (true) {
@@ -93,21 +179,24 @@ void bt_client_task(void *param) {
 
 static void start_scan() {
     printf("Starting scanning!\n");
-    known_severs = 0;
-    if (known_server_addrs != NULL) {
-        free(known_server_addrs);
-        known_server_addrs = NULL;
-    }
-    known_server_addrs = malloc(sizeof(bd_addr_t) * 64);
+    scan_start();
     state = W4_SCAN_RESULTS;
-    gap_set_scan_parameters(1, 0x0030, 0x0030);
-    gap_start_scan();
+
+    if (scan_le_enabled()) {
+        gap_set_scan_parameters(params.scan_active, params.scan_interval, MIN(params.scan_window, params.scan_interval));
+        gap_start_scan();
+    }
+
+    if (scan_classic_enabled()) gap_inquiry_start(params.inquiry_len);
 }
 
 static void stop_scan() {
     printf("Stop scanning!\n");
     state = W4_SCAN_COMPLETE;
+    // both, the configuration may have changed since the start
     gap_stop_scan();
+    gap_inquiry_stop();
+    scan_stop();
 }
 
 //--------------------------------------------------------------------+
@@ -130,54 +219,57 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
 }
 
 static void hci_packet_handler(uint8_t *packet, uint16_t size) {
-    UNUSED(size);
-
     uint8_t event = hci_event_packet_get_type(packet);
 
+    link_policy_handle_event(packet, size);
+
     switch (event) {
         case BTSTACK_EVENT_STATE:
             // BTstack activated, get started
             if (btstack_event_state_get_state(packet) != HCI_STATE_WORKING) return;
-            if (state == IDLE) state = W4_SCAN;
+            boot_mark(BOOT_hci_working);
+            if (state == IDLE) {
+                state = W4_SCAN;
+                // run what the host queued while HCI was coming up
+                bt_queue_handler();
+            }
             break;
 
         case GAP_EVENT_ADVERTISING_REPORT:
             if (state != W4_SCAN_RESULTS) return;
 
-            if (!advertisement_report_contains_device_name("DitooPro", packet)) return;
+            advertisement_report_get_device_name(packet);
             gap_event_advertising_report_get_address(packet, server_addr);
             server_addr_type = gap_event_advertising_report_get_address_type(packet);
-            if (is_server_addr_known(server_addr)) return;
-
-            printf("Found DitooPro on %s!\n", bd_addr_to_str(server_addr));
 
-            {
-                size_t size = sizeof(device_name) + BD_ADDR_LEN + 15;
-                char *buf = malloc(size);
-                mpack_writer_t writer;
-                mpack_writer_init(&writer, buf, size);
+            // reported with the next scan report
+            if (scan_update(server_addr, server_addr_type, SCAN_LE, device_name, gap_event_advertising_report_get_rssi(packet))) {
+                stop_scan();
+                state = W4_SCAN;
+            }
+            break;
 
-                mpack_build_map(&writer);
-                mpack_write_cstr(&writer, device_name);
-                mpack_write_bin(&writer, server_addr, BD_ADDR_LEN);
-                mpack_complete_map(&writer);
+        case GAP_EVENT_INQUIRY_RESULT:
+            if (state != W4_SCAN_RESULTS) return;
 
-                size_t count = mpack_writer_buffer_used(&writer);
+            inquiry_result_get_device_name(packet);
+            gap_event_inquiry_result_get_bd_addr(packet, server_addr);
+            server_addr_type = BD_ADDR_TYPE_ACL;
 
-                if (mpack_writer_destroy(&writer) != mpack_ok) {
-                    printf("BT: An error occurred encoding the mpack data!\n");
-                    return;
+            {
+                int8_t rssi = gap_event_inquiry_result_get_rssi_available(packet) ? gap_event_inquiry_result_get_rssi(packet) : -127;
+                if (scan_update(server_addr, server_addr_type, SCAN_CLASSIC, device_name, rssi)) {
+                    stop_scan();
+                    state = W4_SCAN;
                 }
-
-                command_t usb_cmd;
-                mpack_in_command(buf, count, &usb_cmd);
-
-                xQueueSend(usb_command_queue, &usb_cmd, 0);
-
-                free(buf);
             }
             break;
 
+        case GAP_EVENT_INQUIRY_COMPLETE:
+            // keep inquiring for as long as discovery runs
+            if (state == W4_SCAN_RESULTS && scan_classic_enabled()) gap_inquiry_start(params.inquiry_len);
+            break;
+
         case RFCOMM_EVENT_CHANNEL_OPENED:
             if (rfcomm_event_channel_opened_get_status(packet)) {
                 printf("RFCOMM channel open failed, status 0x%02x\n", rfcomm_event_channel_opened_get_status(packet));
@@ -187,18 +279,63 @@ static void hci_packet_handler(uint8_t *packet, uint16_t size) {
             rfcomm_mtu = rfcomm_event_channel_opened_get_max_frame_size(packet);
             printf("RFCOMM channel open succeeded. New RFCOMM Channel ID 0x%02x, max frame size %u\n", rfcomm_cid, rfcomm_mtu);
 
-            xQueueSend(usb_command_queue, &bt_cmd, 0);
+            link_policy_open(rfcomm_event_channel_opened_get_con_handle(packet), server_addr);
+
+            usb_send(&select_cmd);
+            dedupe_clear();
             state = WAIT_CMD;
+            bt_queue_handler();
             break;
 
         case RFCOMM_EVENT_CAN_SEND_NOW:
-            rfcomm_send(rfcomm_cid, bt_cmd.data, bt_cmd.length);
-            state = WAIT_CMD;
+            // frames made on the adapter and the host take turns
+            if (local_frame_ready() && (state != SEND || !host_turn)) {
+                if (macro_frame_ready())
+                    macro_send(rfcomm_cid);
+                else if (ticker_frame_ready())
+                    ticker_send(rfcomm_cid, divoom_rx.escaped);
+                else
+                    generator_send(rfcomm_cid, divoom_rx.escaped);
+                dedupe_clear();
+                host_turn = true;
+                traffic();
+            } else if (state == SEND) {
+                capture_trace(TRACE_RFCOMM, NULL, 0, bt_cmd.data, bt_cmd.length);
+                rfcomm_send(rfcomm_cid, bt_cmd.data, bt_cmd.length);
+                if (bt_cmd.id) {
+                    int command = divoom_frame_command(bt_cmd.data, bt_cmd.length, divoom_rx.escaped);
+                    if (command >= 0) pending_id_push(command, bt_cmd.id);
+                }
+                state = WAIT_CMD;
+                flow_return_credit();
+                host_turn = false;
+                traffic();
+            }
+            bt_queue_handler();
             break;
 
         case RFCOMM_EVENT_CHANNEL_CLOSED:
             printf("RFCOMM channel closed\n");
             rfcomm_cid = 0;
+            pending_count = 0;
+            link_policy_close();
+            macro_stop();
+            ticker_stop();
+            generator_stop();
+            dedupe_clear();
+            divoom_parser_reset(&divoom_rx);
+
+            // the frame waiting for CAN_SEND_NOW will not go out, hand its
+            // credit back and let the queue run again
+            if (state == SEND) {
+                printf("BT: link lost, dropping frame\n");
+                reply_no_link(&bt_cmd);
+                flow_return_credit();
+            }
+            // a SELECT that closed the channel already moved on
+            if (state == SEND || state == WAIT_CMD) state = W4_SCAN;
+
+            bt_queue_handler();
             break;
 
         default:
@@ -240,70 +377,227 @@ static void handle_query_rfcomm_event(uint8_t packet_type, uint16_t channel, uin
 }
 
 static void rfcomm_packet_handler(uint8_t *packet, uint16_t size) {
+#if DUMP_PACKETS
     printf("BT: Data recived (size: %d): '", size);
     for (int i = 0; i < size; ++i)
         printf("%02x ", packet[i]);
     printf("'\n");
+#endif
+
+    traffic();
+    divoom_parser_feed(&divoom_rx, packet, size, &divoom_frame_handler, NULL);
+
+    rx_batch_flush();
+}
+
+static void divoom_frame_handler(const uint8_t *frame, uint16_t length, void *context) {
+    UNUSED(context);
+
+    command_t usb_cmd = {.type = CMD_DITOO, .length = length};
+    memcpy(usb_cmd.data, frame, length);
+
+    if (frame[0] == DIVOOM_RESPONSE && length > 1)
+        usb_cmd.id = pending_id_take(frame[1]);
+
+    if (RX_BATCH_FRAMES)
+        rx_batch_add(&usb_cmd);
+    else
+        usb_send(&usb_cmd);
+}
+
+//--------------------------------------------------------------------+
+// Commands
+//--------------------------------------------------------------------+
+
+typedef void (*bt_handler_t)(const command_t *cmd);
+
+static void handle_list_device(const command_t *cmd) {
+    if (scan_configure(cmd->data, cmd->length)) {
+        printf("BT: invalid scan configuration\n");
+        return;
+    }
+    if (state == W4_SCAN) start_scan();
+}
+
+_Static_assert(BD_ADDR_LEN == 6, "CMD_SELECT_DEVICE carries a bd_addr");
 
-    command_t usb_cmd;
+static void handle_select_device(const command_t *cmd) {
+    if (state == W4_SCAN_RESULTS) stop_scan();
+    if (rfcomm_cid) rfcomm_disconnect(rfcomm_cid);
 
-    if (rfcomm_packet_to_mpack(packet, size, CMD_DITOO, &usb_cmd)) {
-        printf("BT: Writing mpack faild\n");
+    if (memcmp(cmd->data, empty, BD_ADDR_LEN) == 0) {
+        state = W4_SCAN;
+        printf("Disconnected from %s\n", bd_addr_to_str(server_addr));
         return;
     }
 
-    xQueueSend(usb_command_queue, &usb_cmd, 0);
+    memcpy(server_addr, cmd->data, BD_ADDR_LEN);
+    select_cmd = *cmd;
+
+    state = W4_SCAN_COMPLETE;
+    (void)sdp_client_register_query_callback(&handle_sdp_client_query_request);
 }
 
-static void bt_queue_handler() {
-    if (xQueueReceive(bt_command_queue, &bt_cmd, 0) != errQUEUE_EMPTY) {
-        printf("BT CMD RECIVED: %d\n", bt_cmd.type);
-        switch (bt_cmd.type) {
-            case CMD_LIST_DEVICE:
-                if (state == W4_SCAN) start_scan();
-                break;
-            case CMD_SELECT_DEVICE:
-                if (bt_cmd.length != BD_ADDR_LEN) break;
-                if (state == W4_SCAN_RESULTS) stop_scan();
-                if (rfcomm_cid) rfcomm_disconnect(rfcomm_cid);
+// A frame for the Ditoo that cannot go out, a request learns why
+static void reply_no_link(const command_t *cmd) {
+    if (!cmd->id) return;
 
-                if (memcmp(bt_cmd.data, empty, BD_ADDR_LEN) == 0) {
-                    state = W4_SCAN;
-                    printf("Disconnected from %s\n", bd_addr_to_str(server_addr));
-                    break;
-                };
+    command_t busy = {.type = CMD_BUSY, .id = cmd->id, .length = 2};
+    busy.data[0] = cmd->type;
+    busy.data[1] = FLOW_BUSY_NO_LINK;
+    usb_send(&busy);
+}
 
-                memcpy(server_addr, bt_cmd.data, BD_ADDR_LEN);
+// A command the handler refused, a request is told so
+static void reply_invalid(const command_t *cmd) {
+    if (!cmd->id) return;
 
-                state = W4_SCAN_COMPLETE;
-                (void)sdp_client_register_query_callback(&handle_sdp_client_query_request);
+    command_t busy;
+    command_reject(cmd, &busy);
+    usb_send(&busy);
+}
 
-            case CMD_DITOO:
-                if (state == WAIT_CMD) state = SEND;
-                break;
-            default:
-                break;
+// The frame stays in bt_cmd until RFCOMM takes it
+static void handle_ditoo(const command_t *cmd) {
+    if (state != WAIT_CMD) {
+        reply_no_link(cmd);
+        return;
+    }
+
+    if (dedupe_check(cmd->data, cmd->length, divoom_rx.escaped, cmd->flags & CMD_FLAG_FORCE)) {
+        // the Ditoo has it, the request is answered on its behalf
+        if (cmd->id) {
+            command_t reply = {.type = CMD_DITOO, .id = cmd->id};
+            usb_send(&reply);
         }
+        return;
+    }
+
+    state = SEND;
+}
+
+static void handle_link_policy(const command_t *cmd) {
+    if (link_policy_command(cmd->data, cmd->length, cmd->id)) {
+        printf("BT: invalid link profile\n");
+        reply_invalid(cmd);
+    }
+}
+
+static void handle_macro(const command_t *cmd) {
+    macro_command(cmd->data, cmd->length, cmd->id);
+}
+
+static void handle_text(const command_t *cmd) {
+    ticker_command(cmd->data, cmd->length, cmd->id);
+}
+
+static void handle_bench(const command_t *cmd) {
+    generator_command(cmd->data, cmd->length, cmd->id, rfcomm_cid ? rfcomm_get_max_frame_size(rfcomm_cid) : 0,
+                      divoom_rx.escaped);
+}
+
+static void handle_dedupe(const command_t *cmd) {
+    dedupe_command(cmd->data, cmd->length, cmd->id);
+}
+
+// the QUEUED commands, see COMMANDS in cmd.h
+#define BT_HANDLER(name, min, max, prio, handler) CMD_HANDLER_ENTRY(QUEUED, name, prio, handler)
+static const bt_handler_t bt_handlers[CMD_COUNT] = {COMMANDS(BT_HANDLER)};
+#undef BT_HANDLER
+
+static void bt_queue_handler() {
+    // commands wait in the ring until HCI is working, their credits with them
+    if (state == IDLE) return;
+
+    // while bt_cmd waits for its RFCOMM slot the rest stays queued
+    while (state != SEND && cmd_ring_pop(&bt_command_ring, &bt_cmd)) {
+        boot_mark(BOOT_first_command);
+#if DUMP_PACKETS
+        printf("BT CMD RECIVED: %d\n", bt_cmd.type);
+#endif
+
+        // the cdc task only queues types with a handler here
+        if (bt_cmd.type < CMD_COUNT && bt_handlers[bt_cmd.type]) bt_handlers[bt_cmd.type](&bt_cmd);
+
+        // a frame waiting for RFCOMM returns its credit once it is sent
+        if (state != SEND) flow_return_credit();
     }
+
+    request_send();
+}
+
+static bool local_frame_ready(void) {
+    return macro_frame_ready() || ticker_frame_ready() || generator_frame_ready();
+}
+
+static void request_send(void) {
+    if (rfcomm_cid && (state == SEND || local_frame_ready()))
+        rfcomm_request_can_send_now_event(rfcomm_cid);
+}
+
+static void command_source_handler(btstack_data_source_t *ds, btstack_data_source_callback_type_t callback_type) {
+    UNUSED(ds);
+    UNUSED(callback_type);
+
+    power_changed();
+    bt_queue_handler();
 }
 
 static void heart_beat_handler(btstack_timer_source_t *ts) {
     bt_queue_handler();
 
-    if (rfcomm_cid && state == SEND) {
-        printf("BT: CMD recived\n");
-        rfcomm_request_can_send_now_event(rfcomm_cid);
+    btstack_run_loop_set_timer(ts, params.heartbeat_ms);
+    btstack_run_loop_add_timer(ts);
+}
+
+static void traffic(void) {
+    link_activity();
+    power_activity();
+}
+
+// Nobody takes scan reports from a suspended host and the heartbeat would
+// only wake the core, a quiet link may sniff right away
+static void power_changed(void) {
+    if (power_suspended() == host_suspended) return;
+    host_suspended = !host_suspended;
+
+    if (host_suspended) {
+        printf("BT: host suspended, pausing\n");
+        btstack_run_loop_remove_timer(&heartbeat);
+        if (state == W4_SCAN_RESULTS) {
+            stop_scan();
+            state = W4_SCAN;
+            scan_paused = true;
+        }
+        link_quiet();
+    } else {
+        printf("BT: host resumed\n");
+        btstack_run_loop_set_timer(&heartbeat, params.heartbeat_ms);
+        btstack_run_loop_add_timer(&heartbeat);
+        if (scan_paused && state == W4_SCAN) start_scan();
+        scan_paused = false;
     }
+}
 
-    btstack_run_loop_set_timer(ts, HEARTBEAT_PERIOD_MS);
-    btstack_run_loop_add_timer(ts);
+static void capture_reset(void) {}
+
+static void capture_log_packet(uint8_t packet_type, uint8_t in, uint8_t *packet, uint16_t len) {
+    capture_packet(packet_type, in, packet, len);
+}
+
+// btstack's log_info and log_error end up here once the backend is
+// installed, they go to UART as before, the capture only holds HCI packets
+static void capture_log_message(int log_level, const char *format, va_list argptr) {
+    UNUSED(log_level);
+    vprintf(format, argptr);
+    printf("\n");
 }
 
 //--------------------------------------------------------------------+
 // Helper methods
 //--------------------------------------------------------------------+
 
-static bool advertisement_report_contains_device_name(char *search_name, uint8_t *advertisement_report) {
+static void advertisement_report_get_device_name(uint8_t *advertisement_report) {
     // get advertisement from report event
     const uint8_t *adv_data = gap_event_advertising_report_get_data(advertisement_report);
     uint8_t adv_len = gap_event_advertising_report_get_data_length(advertisement_report);
@@ -329,15 +623,71 @@ static bool advertisement_report_contains_device_name(char *search_name, uint8_t
         }
     }
 
-    return strncmp(device_name, search_name, strlen(search_name)) == 0;
 }
 
-static bool is_server_addr_known(bd_addr_t addr) {
-    for (int i = 0; i < known_severs; ++i)
-        if (memcmp(known_server_addrs[i], addr, BD_ADDR_LEN) == 0) return true;
+static void inquiry_result_get_device_name(uint8_t *inquiry_result) {
+    device_name[0] = '\0';
+
+    // parsed from the extended inquiry response by btstack
+    if (!gap_event_inquiry_result_get_name_available(inquiry_result)) return;
+
+    uint8_t len = MIN(gap_event_inquiry_result_get_name_len(inquiry_result), sizeof(device_name) - 1);
+    memcpy(device_name, gap_event_inquiry_result_get_name(inquiry_result), len);
+    device_name[len] = '\0';
+}
+
+static void usb_send(command_t *cmd) {
+    if (!cmd_ring_push(&usb_command_ring, cmd))
+        printf("BT: usb queue full, dropping message\n");
+}
+
+static void pending_id_push(uint8_t command, uint16_t id) {
+    // the oldest id gets lost if the Ditoo never answered it
+    if (pending_count == PENDING_IDS) {
+        memmove(&pending_ids[0], &pending_ids[1], sizeof(pending_ids[0]) * (PENDING_IDS - 1));
+        --pending_count;
+    }
+
+    pending_ids[pending_count].command = command;
+    pending_ids[pending_count].id = id;
+    ++pending_count;
+}
+
+static uint16_t pending_id_take(uint8_t command) {
+    for (uint8_t i = 0; i < pending_count; ++i) {
+        if (pending_ids[i].command != command) continue;
+
+        uint16_t id = pending_ids[i].id;
+        memmove(&pending_ids[i], &pending_ids[i + 1], sizeof(pending_ids[0]) * (pending_count - i - 1));
+        --pending_count;
+
+        return id;
+    }
+
+    return 0;
+}
+
+static void rx_batch_add(command_t *cmd) {
+    char *end = (char *)rx_batch.data + rx_batch.length;
+    size_t count = command_to_mpack(cmd, end, sizeof(rx_batch.data) - rx_batch.length);
+
+    if (count == 0 && rx_batch.length) {
+        rx_batch_flush();
+        count = command_to_mpack(cmd, (char *)rx_batch.data, sizeof(rx_batch.data));
+    }
+
+    // a frame that does not fit a batch on its own goes out unbatched
+    if (count == 0) {
+        usb_send(cmd);
+        return;
+    }
+
+    rx_batch.length += count;
+}
 
-    memcpy(known_server_addrs[0], addr, BD_ADDR_LEN);
-    ++known_severs;
+static void rx_batch_flush(void) {
+    if (!rx_batch.length) return;
 
-    return false;
+    usb_send(&rx_batch);
+    rx_batch.length = 0;
 }
\ No newline at end of file
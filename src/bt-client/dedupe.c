@@ -0,0 +1,151 @@
+#include "dedupe.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cmd.h"
+#include "divoom.h"
+#include "params.h"
+
+// bluetooth stack
+#include "btstack.h"
+
+// mpack
+#include "mpack/mpack.h"
+
+#define CONFIG_NODES 4
+
+// a slot per command, a command that lands on a taken slot evicts it and the
+// evicted one is simply sent the next time
+typedef struct {
+    bool valid;
+    uint8_t command;
+    uint16_t length;
+    uint32_t digest;
+    uint32_t sent_ms;
+} entry_t;
+
+static entry_t table[DEDUPE_SLOTS];
+
+static struct {
+    uint32_t frames;
+    uint32_t hits;
+    uint32_t forced;
+    uint32_t bytes_saved;
+} counters;
+
+static uint32_t fnv1a(const uint8_t *data, size_t size) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ data[i]) * 16777619u;
+
+    return hash;
+}
+
+// Setting these twice leaves the Ditoo as it was after the first
+static bool dedupe_command_allowed(uint8_t command) {
+    switch (command) {
+        case DIVOOM_SET_IMAGE:
+        case DIVOOM_SET_ANIMATION:
+        case DIVOOM_SET_BRIGHTNESS:
+        case DIVOOM_SET_CHANNEL:
+        case DIVOOM_SET_VOLUME:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void dedupe_clear(void) {
+    memset(table, 0, sizeof(table));
+}
+
+bool dedupe_check(const uint8_t *frame, size_t length, bool escaped, bool force) {
+    if (!params.dedupe_s) return false;
+
+    int command = divoom_frame_command(frame, length, escaped);
+    if (command < 0 || !dedupe_command_allowed(command)) return false;
+
+    entry_t *entry = &table[command % DEDUPE_SLOTS];
+    uint32_t digest = fnv1a(frame, length);
+    uint32_t now = btstack_run_loop_get_time_ms();
+
+    counters.frames++;
+
+    bool same = entry->valid && entry->command == command && entry->length == length && entry->digest == digest &&
+                now - entry->sent_ms < params.dedupe_s * 1000u;
+
+    if (same && !force) {
+        counters.hits++;
+        counters.bytes_saved += length;
+        return true;
+    }
+
+    if (same) counters.forced++;
+
+    *entry = (entry_t){
+        .valid = true,
+        .command = command,
+        .length = length,
+        .digest = digest,
+        .sent_ms = now,
+    };
+
+    return false;
+}
+
+static void report(uint16_t id) {
+    command_t cmd = {.type = CMD_DEDUPE, .id = id};
+
+    uint32_t entries = 0;
+    for (int i = 0; i < DEDUPE_SLOTS; ++i)
+        entries += table[i].valid;
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char *)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "enabled");
+    mpack_write_bool(&writer, params.dedupe_s != 0);
+    mpack_write_cstr(&writer, "entries");
+    mpack_write_u32(&writer, entries);
+    mpack_write_cstr(&writer, "frames");
+    mpack_write_u32(&writer, counters.frames);
+    mpack_write_cstr(&writer, "hits");
+    mpack_write_u32(&writer, counters.hits);
+    mpack_write_cstr(&writer, "forced");
+    mpack_write_u32(&writer, counters.forced);
+    mpack_write_cstr(&writer, "hit_pct");
+    mpack_write_u32(&writer, counters.frames ? (uint64_t)counters.hits * 100 / counters.frames : 0);
+    mpack_write_cstr(&writer, "bytes_saved");
+    mpack_write_u32(&writer, counters.bytes_saved);
+    mpack_complete_map(&writer);
+
+    cmd.length = mpack_writer_buffer_used(&writer);
+    if (mpack_writer_destroy(&writer) != mpack_ok) return;
+
+    if (!cmd_ring_push(&usb_command_ring, &cmd))
+        printf("BT: usb queue full, dropping dedupe report\n");
+}
+
+void dedupe_command(const uint8_t *data, size_t length, uint16_t id) {
+    if (length) {
+        mpack_node_data_t pool[CONFIG_NODES];
+        mpack_tree_t tree;
+        mpack_tree_init_pool(&tree, (const char *)data, length, pool, CONFIG_NODES);
+        mpack_tree_parse(&tree);
+
+        mpack_node_t root = mpack_tree_root(&tree);
+        bool clear = false;
+
+        if (mpack_node_type(root) == mpack_type_map) {
+            mpack_node_t node = mpack_node_map_cstr_optional(root, "clear");
+            if (!mpack_node_is_missing(node)) clear = mpack_node_bool(node);
+        }
+
+        if (mpack_tree_destroy(&tree) == mpack_ok && clear) dedupe_clear();
+    }
+
+    report(id);
+}
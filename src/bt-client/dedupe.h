@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Suppression of host frames the Ditoo already has.
+//
+// Hosts re-send the same image or setting after a reconnect or on a periodic
+// refresh, each copy costs RFCOMM airtime. The bt task keeps the FNV-1a digest
+// of the last frame sent per Divoom command in a small table, a CMD_DITOO
+// identical to it is not sent again while the entry is younger than
+// params.dedupe_s. Its credit goes back right away and a request id is
+// answered with an empty CMD_DITOO, there is no reply from the Ditoo to wait
+// for.
+//
+// Only commands that set state and are merely acknowledged are suppressed:
+// image, animation, brightness, channel and volume. Queries and everything
+// else always go out, their answer is the Ditoo's and may change between two
+// identical requests.
+//
+// A frame sent in the envelope with CMD_FLAG_FORCE always goes out. The table
+// is cleared when a channel opens or closes and whenever the adapter sends a
+// frame of its own (macros, text, benchmarks), those change what the Ditoo
+// shows behind the host's back.
+//
+// CMD_DEDUPE with an empty payload queries the counters, {"clear": true}
+// clears the table first. Both are answered with CMD_DEDUPE carrying a map:
+//   "enabled"      params.dedupe_s is not 0
+//   "entries"      commands with a digest in the table
+//   "frames"       frames checked so far
+//   "hits"         frames suppressed
+//   "forced"       frames sent because of CMD_FLAG_FORCE
+//   "hit_pct"      hits per 100 frames
+//   "bytes_saved"  encoded bytes that did not go over the air
+
+#define DEDUPE_SLOTS 32
+
+// Forgets every digest
+void dedupe_clear(void);
+
+// True if the encoded frame is the last one sent with its command and is to
+// be dropped, otherwise it is remembered as sent
+bool dedupe_check(const uint8_t *frame, size_t length, bool escaped, bool force);
+
+// Handles CMD_DEDUPE, the answer carries id
+void dedupe_command(const uint8_t *data, size_t length, uint16_t id);
@@ -0,0 +1,207 @@
+#include "generator.h"
+
+#include <stdio.h>
+
+#include "capture.h"
+#include "cmd.h"
+#include "divoom.h"
+#include "loadgen.h"
+#include "trace.h"
+
+// bluetooth stack
+#include "btstack.h"
+
+// mpack
+#include "mpack/mpack.h"
+
+// Pico
+#include "pico/stdlib.h"
+
+// worst case of a frame of size payload bytes with every byte escaped
+#define ESCAPED_SIZE(size) (2 * (3 + (size) + 2) + 2)
+#define FRAME_SIZE ESCAPED_SIZE(DIVOOM_MAX_FRAME)
+
+static loadgen_t gen;
+// a run was started and not answered yet
+static bool active;
+static uint16_t run_id;
+
+static uint8_t frame[FRAME_SIZE];
+static divoom_parser_t loopback;
+static bool looped;
+
+static generator_wake_fn wake_bt;
+static btstack_timer_source_t due_timer;
+
+static void send_reply(command_t *cmd) {
+    if (!cmd_ring_push(&usb_command_ring, cmd))
+        printf("BT: usb queue full, dropping bench reply\n");
+}
+
+// Answers a command that did not start a run
+static void reply_status(uint16_t id, const char *status) {
+    command_t cmd = {.type = CMD_BENCH, .id = id};
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char *)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "status");
+    mpack_write_cstr(&writer, status);
+    mpack_complete_map(&writer);
+
+    cmd.length = mpack_writer_buffer_used(&writer);
+    if (mpack_writer_destroy(&writer) == mpack_ok) send_reply(&cmd);
+}
+
+// Ends the run and answers it with the summary
+static void finish(const char *status) {
+    if (!active) return;
+    active = false;
+
+    uint32_t now = time_us_32();
+    loadgen_stop(&gen, now);
+    btstack_run_loop_remove_timer(&due_timer);
+
+    printf("BT: bench %s after %lu frames, %lu dropped\n", status, (unsigned long)gen.frames, (unsigned long)gen.drops);
+
+    command_t cmd = {.type = CMD_BENCH, .id = run_id};
+    cmd.length = loadgen_summary(&gen, status, now, cmd.data, sizeof(cmd.data));
+    if (cmd.length) send_reply(&cmd);
+}
+
+static void loopback_frame_handler(const uint8_t *data, uint16_t length, void *context) {
+    UNUSED(data);
+    UNUSED(length);
+    UNUSED(context);
+
+    looped = true;
+}
+
+// Pushes the due frames through the parser, at most a queue full per call so
+// that the run loop gets its turn at rate 0
+static void loopback_run(void) {
+    for (int i = 0; i < LOADGEN_QUEUE && loadgen_frame_ready(&gen); ++i) {
+        size_t size = loadgen_frame(&gen, frame, sizeof(frame), loopback.escaped);
+
+        looped = false;
+        divoom_parser_feed(&loopback, frame, size, &loopback_frame_handler, NULL);
+
+        if (!looped) {
+            finish("failed");
+            return;
+        }
+
+        loadgen_sent(&gen, size, time_us_32());
+        loadgen_poll(&gen, time_us_32());
+    }
+}
+
+// Queues what became due, ends the run once its time is up and waits for the
+// next frame
+static void schedule(void) {
+    uint32_t now = time_us_32();
+
+    if (!loadgen_poll(&gen, now)) {
+        finish("ok");
+        return;
+    }
+
+    uint32_t next_us = loadgen_next_us(&gen, now);
+
+    if (gen.config.mode == LOADGEN_LOOPBACK && loadgen_frame_ready(&gen)) next_us = 0;
+
+    btstack_run_loop_remove_timer(&due_timer);
+    btstack_run_loop_set_timer(&due_timer, (next_us + 999) / 1000);
+    btstack_run_loop_add_timer(&due_timer);
+
+    if (gen.config.mode == LOADGEN_RFCOMM && loadgen_frame_ready(&gen)) wake_bt();
+}
+
+static void due_timer_handler(btstack_timer_source_t *ts) {
+    UNUSED(ts);
+
+    if (gen.config.mode == LOADGEN_LOOPBACK) {
+        loadgen_poll(&gen, time_us_32());
+        loopback_run();
+        if (!gen.running) return;
+    }
+
+    schedule();
+}
+
+void generator_init(generator_wake_fn wake) {
+    wake_bt = wake;
+    btstack_run_loop_set_timer_handler(&due_timer, &due_timer_handler);
+    divoom_parser_init(&loopback, true);
+}
+
+void generator_command(const uint8_t *data, size_t length, uint16_t id, uint16_t max_frame, bool escaped) {
+    loadgen_config_t config;
+    bool stop;
+
+    if (!loadgen_parse(data, length, &config, &stop)) {
+        reply_status(id, "invalid");
+        return;
+    }
+
+    // the new run replaces the running one
+    finish("stopped");
+
+    if (stop) {
+        reply_status(id, "ok");
+        return;
+    }
+
+    if (config.mode == LOADGEN_RFCOMM && !max_frame) {
+        reply_status(id, "no link");
+        return;
+    }
+
+    // every frame has to fit into one RFCOMM frame, however it is escaped
+    size_t largest = escaped ? ESCAPED_SIZE(config.size) : 3 + config.size + 2 + 2;
+    if (config.mode == LOADGEN_RFCOMM && largest > max_frame) {
+        reply_status(id, "invalid");
+        return;
+    }
+
+    printf("BT: bench of %u byte frames at %lu/s for %lu ms%s\n", config.size, (unsigned long)config.rate,
+           (unsigned long)config.duration_ms, config.mode == LOADGEN_LOOPBACK ? " in loopback" : "");
+
+    divoom_parser_reset(&loopback);
+    loadgen_start(&gen, &config, time_us_32());
+    active = true;
+    run_id = id;
+
+    schedule();
+}
+
+bool generator_frame_ready(void) {
+    return gen.config.mode == LOADGEN_RFCOMM && loadgen_frame_ready(&gen);
+}
+
+void generator_send(uint16_t rfcomm_cid, bool escaped) {
+    if (!generator_frame_ready()) return;
+
+    size_t size = loadgen_frame(&gen, frame, sizeof(frame), escaped);
+    if (!size || size > rfcomm_get_max_frame_size(rfcomm_cid)) {
+        finish("invalid");
+        return;
+    }
+
+    // a frame RFCOMM did not take stays queued for the next send slot, only
+    // the ones that went out count
+    uint8_t status = rfcomm_send(rfcomm_cid, frame, size);
+    if (status == ERROR_CODE_SUCCESS) {
+        capture_trace(TRACE_RFCOMM, NULL, 0, frame, size);
+        loadgen_sent(&gen, size, time_us_32());
+    } else {
+        printf("BT: bench frame not sent, status 0x%02x\n", status);
+    }
+
+    schedule();
+}
+
+void generator_stop(void) {
+    if (gen.config.mode == LOADGEN_RFCOMM) finish("no link");
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Synthetic Divoom traffic for CMD_BENCH, see src/loadgen/include/loadgen.h.
+//
+// In rfcomm mode the frames take turns with the host's and the other local
+// frames for RFCOMM send slots, a frame counts as sent once RFCOMM took it.
+// The loopback mode skips the radio: the bt task encodes every frame and runs
+// it through a Divoom parser of its own, a frame counts once it came out of
+// the parser again. Frames become due on a run loop timer, so the latencies
+// include the time the bt task was busy with other work.
+
+// Called when a frame becomes due, the bt task asks RFCOMM for a send slot
+typedef void (*generator_wake_fn)(void);
+
+void generator_init(generator_wake_fn wake);
+
+// Handles CMD_BENCH, the answer carries id. An rfcomm run needs an open
+// channel, max_frame is its RFCOMM frame size or 0 without one. A run whose
+// frames may not fit into an RFCOMM frame is answered with "invalid".
+void generator_command(const uint8_t *data, size_t length, uint16_t id, uint16_t max_frame, bool escaped);
+
+// True if an rfcomm run has a frame waiting
+bool generator_frame_ready(void);
+
+// Sends the oldest waiting frame into the channel, it counts once RFCOMM took
+// it
+void generator_send(uint16_t rfcomm_cid, bool escaped);
+
+// Ends an rfcomm run, e.g. because the channel closed
+void generator_stop(void);
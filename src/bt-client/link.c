@@ -0,0 +1,416 @@
+#include "link.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cmd.h"
+#include "params.h"
+#include "power.h"
+
+// Pico
+#include "pico/time.h"
+
+// mpack
+#include "mpack/mpack.h"
+
+// durations in baseband slots of 0.625 ms
+#define SLOTS_TO_MS(slots) ((uint32_t)(slots) * 5 / 8)
+
+// sniff interval range of a quiet link
+#define QUIET_SNIFF_MIN 0x0050  // 50 ms
+#define QUIET_SNIFF_MAX 0x00A0  // 100 ms
+
+// a role switch that is never answered gives up after this long, the profile
+// goes on with the role the link has
+#define ROLE_TIMEOUT_MS 2000
+
+typedef struct {
+    const char *name;
+    uint16_t policy;
+    // ask for the central role so we own the link timing
+    bool central;
+    // sniff interval range, 0 to keep the link active
+    uint16_t sniff_min;
+    uint16_t sniff_max;
+    uint16_t supervision_timeout;
+} link_profile_params_t;
+
+static const link_profile_params_t profiles[LINK_PROFILES] = {
+    [LINK_LOW_LATENCY] = {
+        .name = "low-latency",
+        .policy = LM_LINK_POLICY_ENABLE_ROLE_SWITCH,
+        .central = true,
+        .supervision_timeout = 0x0C80,  // 2 s
+    },
+    [LINK_BALANCED] = {
+        .name = "balanced",
+        .policy = LM_LINK_POLICY_ENABLE_ROLE_SWITCH | LM_LINK_POLICY_ENABLE_SNIFF_MODE,
+        .central = true,
+        .supervision_timeout = 0x1F40,  // 5 s
+    },
+    [LINK_LOW_POWER] = {
+        .name = "low-power",
+        .policy = LM_LINK_POLICY_ENABLE_ROLE_SWITCH | LM_LINK_POLICY_ENABLE_SNIFF_MODE,
+        .central = false,
+        .sniff_min = 0x0050,  // 50 ms
+        .sniff_max = 0x00A0,  // 100 ms
+        .supervision_timeout = 0x7D00,  // 20 s
+    },
+};
+
+typedef enum {
+    LINK_IDLE,
+    LINK_W2_POLICY,
+    LINK_W4_POLICY,
+    LINK_W4_ROLE,
+    LINK_W2_SUPERVISION,
+    LINK_W4_SUPERVISION,
+    LINK_DONE,
+} link_state_t;
+
+static link_profile_t profile = LINK_BALANCED;
+static link_state_t state = LINK_IDLE;
+static uint16_t report_id;
+
+static hci_con_handle_t con_handle = HCI_CON_HANDLE_INVALID;
+static bd_addr_t con_addr;
+
+// effective parameters as confirmed by the controller
+static uint8_t role;
+static uint8_t role_status;
+static uint8_t mode;
+static uint16_t sniff_interval;
+static uint8_t policy_status;
+static uint16_t supervision_timeout;
+static uint8_t supervision_status;
+
+// quiet sniff, requested by us rather than by the profile
+static btstack_timer_source_t quiet_timer;
+static bool quiet_armed;
+static bool quiet_sniff;
+static uint32_t last_activity_ms;
+// when traffic asked for the link back, 0 if it did not
+static uint32_t exit_requested_us;
+
+static btstack_timer_source_t role_timer;
+
+static void run(void);
+static void report(uint16_t id);
+static void quiet_arm(uint32_t ms);
+
+//--------------------------------------------------------------------+
+// Control
+//--------------------------------------------------------------------+
+
+static void apply(void) {
+    // the profile decides about sniff from here on
+    quiet_sniff = false;
+    exit_requested_us = 0;
+
+    policy_status = 0;
+    role_status = 0;
+    supervision_timeout = 0;
+    supervision_status = 0;
+
+    printf("BT: applying %s link profile\n", profiles[profile].name);
+
+    state = LINK_W2_POLICY;
+    run();
+}
+
+uint8_t link_policy_command(const uint8_t *data, size_t length, uint16_t id) {
+    if (length == 0) {
+        report(id);
+        return 0;
+    }
+
+    if (length != 1 || data[0] >= LINK_PROFILES) return 1;
+
+    profile = data[0];
+
+    // without a link there is nothing to wait for, the profile applies to
+    // the next one
+    if (con_handle == HCI_CON_HANDLE_INVALID) {
+        report(id);
+        return 0;
+    }
+
+    report_id = id;
+    apply();
+
+    return 0;
+}
+
+void link_policy_open(hci_con_handle_t handle, const bd_addr_t addr) {
+    con_handle = handle;
+    memcpy(con_addr, addr, BD_ADDR_LEN);
+
+    role = gap_get_role(handle);
+    mode = 0;
+    sniff_interval = 0;
+    power_link_open();
+
+    report_id = 0;
+    apply();
+
+    link_activity();
+}
+
+void link_policy_close(void) {
+    con_handle = HCI_CON_HANDLE_INVALID;
+    state = LINK_IDLE;
+
+    btstack_run_loop_remove_timer(&role_timer);
+    btstack_run_loop_remove_timer(&quiet_timer);
+    quiet_armed = false;
+    quiet_sniff = false;
+    exit_requested_us = 0;
+    power_link_close();
+}
+
+//--------------------------------------------------------------------+
+// Quiet sniff
+//--------------------------------------------------------------------+
+
+// Only profiles that allow sniff without asking for it themselves
+static bool quiet_allowed(void) {
+    const link_profile_params_t *current = &profiles[profile];
+
+    return params.sniff_idle_ms && con_handle != HCI_CON_HANDLE_INVALID &&
+           (current->policy & LM_LINK_POLICY_ENABLE_SNIFF_MODE) && !current->sniff_max;
+}
+
+static void quiet_enter(void) {
+    if (quiet_sniff || mode != 0) return;
+
+    quiet_sniff = true;
+    gap_sniff_mode_enter(con_handle, QUIET_SNIFF_MIN, QUIET_SNIFF_MAX, 4, 1);
+}
+
+static void quiet_handler(btstack_timer_source_t *ts) {
+    UNUSED(ts);
+    quiet_armed = false;
+
+    if (!quiet_allowed()) return;
+
+    // a profile being applied may still change the mode
+    uint32_t quiet = btstack_run_loop_get_time_ms() - last_activity_ms;
+    if (state != LINK_IDLE)
+        quiet_arm(params.sniff_idle_ms);
+    else if (quiet >= params.sniff_idle_ms)
+        quiet_enter();
+    else
+        quiet_arm(params.sniff_idle_ms - quiet);
+}
+
+static void quiet_arm(uint32_t ms) {
+    btstack_run_loop_set_timer_handler(&quiet_timer, &quiet_handler);
+    btstack_run_loop_set_timer(&quiet_timer, ms);
+    btstack_run_loop_add_timer(&quiet_timer);
+    quiet_armed = true;
+}
+
+void link_activity(void) {
+    last_activity_ms = btstack_run_loop_get_time_ms();
+
+    if (quiet_sniff) {
+        // the frame goes out at the next anchor point already, leaving sniff
+        // only speeds up the ones after it
+        if (!exit_requested_us && mode != 0) {
+            exit_requested_us = time_us_32() | 1;
+            gap_sniff_mode_exit(con_handle);
+        }
+        return;
+    }
+
+    if (!quiet_armed && quiet_allowed()) quiet_arm(params.sniff_idle_ms);
+}
+
+void link_quiet(void) {
+    if (quiet_allowed() && state == LINK_IDLE) quiet_enter();
+}
+
+//--------------------------------------------------------------------+
+// Sequence
+//--------------------------------------------------------------------+
+
+// The role switch is over, whether it worked or not
+static void role_done(uint8_t status) {
+    btstack_run_loop_remove_timer(&role_timer);
+    role_status = status;
+    state = role == HCI_ROLE_MASTER ? LINK_W2_SUPERVISION : LINK_DONE;
+}
+
+static void role_timeout(btstack_timer_source_t *ts) {
+    UNUSED(ts);
+    if (state != LINK_W4_ROLE) return;
+
+    printf("BT: role switch not answered\n");
+    role_done(ERROR_CODE_LMP_RESPONSE_TIMEOUT_LL_RESPONSE_TIMEOUT);
+    run();
+}
+
+// Next step once the link policy is in place
+static void policy_written(void) {
+    const link_profile_params_t *params = &profiles[profile];
+
+    // sniff requests are queued by btstack, no need to wait for them
+    if (params->sniff_max && mode == 0)
+        gap_sniff_mode_enter(con_handle, params->sniff_min, params->sniff_max, 4, 1);
+    else if (!params->sniff_max && mode != 0)
+        gap_sniff_mode_exit(con_handle);
+
+    if (params->central && role != HCI_ROLE_MASTER) {
+        role_status = gap_request_role(con_addr, HCI_ROLE_MASTER);
+        if (role_status != ERROR_CODE_SUCCESS) {
+            state = LINK_DONE;
+            return;
+        }
+
+        state = LINK_W4_ROLE;
+        btstack_run_loop_set_timer_handler(&role_timer, &role_timeout);
+        btstack_run_loop_set_timer(&role_timer, ROLE_TIMEOUT_MS);
+        btstack_run_loop_add_timer(&role_timer);
+        return;
+    }
+
+    state = role == HCI_ROLE_MASTER ? LINK_W2_SUPERVISION : LINK_DONE;
+}
+
+static void run(void) {
+    if (!hci_can_send_command_packet_now()) return;
+
+    switch (state) {
+        case LINK_W2_POLICY:
+            state = LINK_W4_POLICY;
+            hci_send_cmd(&hci_write_link_policy_settings, con_handle, profiles[profile].policy);
+            break;
+
+        case LINK_W2_SUPERVISION:
+            state = LINK_W4_SUPERVISION;
+            hci_send_cmd(&hci_write_link_supervision_timeout, con_handle, profiles[profile].supervision_timeout);
+            break;
+
+        case LINK_DONE:
+            state = LINK_IDLE;
+            report(report_id);
+            break;
+
+        default:
+            break;
+    }
+}
+
+void link_policy_handle_event(uint8_t *packet, uint16_t size) {
+    UNUSED(size);
+
+    if (con_handle == HCI_CON_HANDLE_INVALID) return;
+
+    switch (hci_event_packet_get_type(packet)) {
+        case HCI_EVENT_COMMAND_COMPLETE: {
+            uint16_t opcode = hci_event_command_complete_get_command_opcode(packet);
+            uint8_t status = hci_event_command_complete_get_return_parameters(packet)[0];
+
+            if (opcode == HCI_OPCODE_HCI_WRITE_LINK_POLICY_SETTINGS && state == LINK_W4_POLICY) {
+                policy_status = status;
+                policy_written();
+            } else if (opcode == HCI_OPCODE_HCI_WRITE_LINK_SUPERVISION_TIMEOUT && state == LINK_W4_SUPERVISION) {
+                supervision_status = status;
+                if (status == ERROR_CODE_SUCCESS) supervision_timeout = profiles[profile].supervision_timeout;
+                state = LINK_DONE;
+            }
+            break;
+        }
+
+        case HCI_EVENT_COMMAND_STATUS:
+            // a refused switch is not followed by a role change
+            if (state == LINK_W4_ROLE &&
+                hci_event_command_status_get_command_opcode(packet) == HCI_OPCODE_HCI_SWITCH_ROLE_COMMAND &&
+                hci_event_command_status_get_status(packet) != ERROR_CODE_SUCCESS)
+                role_done(hci_event_command_status_get_status(packet));
+            break;
+
+        case HCI_EVENT_ROLE_CHANGE: {
+            bd_addr_t addr;
+            hci_event_role_change_get_bd_addr(packet, addr);
+            if (memcmp(addr, con_addr, BD_ADDR_LEN) != 0) break;
+
+            uint8_t status = hci_event_role_change_get_status(packet);
+            if (status == ERROR_CODE_SUCCESS) role = hci_event_role_change_get_role(packet);
+
+            if (state == LINK_W4_ROLE) role_done(status);
+            break;
+        }
+
+        case HCI_EVENT_MODE_CHANGE:
+            if (hci_event_mode_change_get_handle(packet) != con_handle) break;
+
+            mode = hci_event_mode_change_get_mode(packet);
+            sniff_interval = mode ? hci_event_mode_change_get_interval(packet) : 0;
+            power_link_mode(mode != 0);
+
+            if (mode == 0 && quiet_sniff) {
+                if (exit_requested_us) power_sniff_exit(time_us_32() - exit_requested_us);
+                quiet_sniff = false;
+                exit_requested_us = 0;
+                link_activity();
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    run();
+}
+
+//--------------------------------------------------------------------+
+// Report
+//--------------------------------------------------------------------+
+
+static void report(uint16_t id) {
+    command_t cmd = {.type = CMD_LINK_POLICY, .id = id};
+    bool connected = con_handle != HCI_CON_HANDLE_INVALID;
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char *)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "profile");
+    mpack_write_cstr(&writer, profiles[profile].name);
+    mpack_write_cstr(&writer, "connected");
+    mpack_write_bool(&writer, connected);
+
+    if (connected) {
+        mpack_write_cstr(&writer, "role");
+        mpack_write_cstr(&writer, role == HCI_ROLE_MASTER ? "central" : "peripheral");
+        mpack_write_cstr(&writer, "role_status");
+        mpack_write_u8(&writer, role_status);
+        mpack_write_cstr(&writer, "mode");
+        mpack_write_cstr(&writer, mode ? "sniff" : "active");
+        mpack_write_cstr(&writer, "sniff_ms");
+        mpack_write_u32(&writer, SLOTS_TO_MS(sniff_interval));
+        mpack_write_cstr(&writer, "quiet");
+        mpack_write_bool(&writer, quiet_sniff);
+        mpack_write_cstr(&writer, "policy");
+        mpack_write_u16(&writer, profiles[profile].policy);
+        mpack_write_cstr(&writer, "policy_status");
+        mpack_write_u8(&writer, policy_status);
+        mpack_write_cstr(&writer, "supervision_ms");
+        mpack_write_u32(&writer, SLOTS_TO_MS(supervision_timeout));
+        mpack_write_cstr(&writer, "supervision_status");
+        mpack_write_u8(&writer, supervision_status);
+    }
+
+    mpack_complete_map(&writer);
+
+    cmd.length = mpack_writer_buffer_used(&writer);
+
+    if (mpack_writer_destroy(&writer) != mpack_ok) {
+        printf("BT: An error occurred encoding the link report!\n");
+        return;
+    }
+
+    if (!cmd_ring_push(&usb_command_ring, &cmd))
+        printf("BT: usb queue full, dropping link report\n");
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// bluetooth stack
+#include "btstack.h"
+
+// Link policy profiles for the ACL link to the Ditoo.
+//
+// CMD_LINK_POLICY with a single byte selects a link_profile_t. The profile is
+// applied right away if a channel is open and on every channel that opens
+// later. An empty CMD_LINK_POLICY queries the current state. Both are answered
+// with CMD_LINK_POLICY carrying a msgpack map of the effective parameters,
+// once the controller has confirmed them:
+//   "profile"             name of the selected profile
+//   "connected"           false if there is no link the profile applies to
+//   "role"                "central" or "peripheral"
+//   "role_status"         HCI status of the switch to central, 0 if none was
+//                         asked for. A switch that is not answered within 2 s
+//                         ends with 0x22, the link keeps its role.
+//   "mode"                "active" or "sniff"
+//   "sniff_ms"            sniff interval, 0 while active
+//   "quiet"               the sniff was entered because the link was quiet
+//   "policy"              link policy settings written for the link
+//   "policy_status"       HCI status of writing them
+//   "supervision_ms"      link supervision timeout, 0 if it was not written
+//   "supervision_status"  HCI status of writing it
+// An invalid profile is answered with CMD_BUSY and FLOW_BUSY_INVALID.
+//
+// Only the central may set the supervision timeout, it is left to the Ditoo
+// when it keeps that role. The automatic flush timeout stays disabled in every
+// profile, RFCOMM relies on a reliable link.
+//
+// Under a profile that allows sniff without asking for it, balanced by
+// default, a link without traffic for params.sniff_idle_ms enters sniff until
+// the next frame, so does the link of a suspended host right away. Frames are
+// still sent in sniff, at the next anchor point, and ask for the link back.
+
+typedef enum {
+    LINK_LOW_LATENCY = 0,
+    LINK_BALANCED,
+    LINK_LOW_POWER,
+    LINK_PROFILES,
+} link_profile_t;
+
+// Handles CMD_LINK_POLICY, returns 1 if the payload is invalid
+uint8_t link_policy_command(const uint8_t *data, size_t length, uint16_t id);
+
+// Applies the selected profile to a freshly opened channel
+void link_policy_open(hci_con_handle_t con_handle, const bd_addr_t addr);
+void link_policy_close(void);
+
+// Every frame sent or received over RFCOMM
+void link_activity(void);
+// Enters the quiet sniff now if it is enabled
+void link_quiet(void);
+
+// Feeds HCI events, the profile is applied step by step as the controller
+// confirms the previous one
+void link_policy_handle_event(uint8_t *packet, uint16_t size);
@@ -0,0 +1,556 @@
+#include "macro.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "capture.h"
+#include "cmd.h"
+#include "lzss.h"
+#include "trace.h"
+
+// bluetooth stack
+#include "btstack.h"
+
+// mpack
+#include "mpack/mpack.h"
+
+// Pico
+#include "hardware/flash.h"
+#include "pico/flash.h"
+#include "pico/stdlib.h"
+
+#define CONFIG_NODES 16
+
+// The two sectors below the stored parameters
+#ifndef MACRO_FLASH_OFFSET
+#define MACRO_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - 5 * FLASH_SECTOR_SIZE)
+#endif
+#define MACRO_FLASH_SIZE (2 * FLASH_SECTOR_SIZE)
+
+#define MACRO_MAGIC 0x4F524D44  // "DMRO"
+#define MACRO_VERSION 1
+#define MACRO_SAVE_TIMEOUT_MS 100
+
+typedef struct {
+    char name[MACRO_NAME_LEN];
+    uint16_t offset;
+    uint16_t size;
+    // the code is an LZSS stream
+    bool compressed;
+} macro_t;
+
+// A page with the table, the storage follows on the next page
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t used;
+    uint8_t count;
+    uint32_t checksum;
+    macro_t macros[MACRO_SLOTS];
+} stored_macros_t;
+
+_Static_assert(sizeof(stored_macros_t) <= FLASH_PAGE_SIZE, "the macro table must fit one flash page");
+_Static_assert(MACRO_STORAGE % FLASH_PAGE_SIZE == 0, "the macro storage is programmed in whole pages");
+_Static_assert(FLASH_PAGE_SIZE + MACRO_STORAGE <= MACRO_FLASH_SIZE, "the macros must fit their flash sectors");
+
+// Position in the code of a macro, relative to its offset as the storage
+// moves when other macros change
+typedef struct {
+    uint16_t pos;
+    lzss_decoder_t lzss;
+} reader_t;
+
+static uint8_t storage[MACRO_STORAGE];
+static uint16_t storage_used;
+
+static macro_t macros[MACRO_SLOTS];
+static uint8_t macro_count;
+
+// the running macro and its next instruction once fetched
+static macro_t *running;
+static reader_t player;
+static bool fetched;
+static uint8_t next_op;
+static uint16_t next_arg;
+static bool waiting;
+static uint16_t run_id;
+static uint32_t run_frames;
+static uint32_t run_started_ms;
+
+static macro_wake_fn wake_bt;
+static btstack_timer_source_t delay_timer;
+
+static void delay_timer_handler(btstack_timer_source_t *ts);
+static void step(void);
+static void finish(const char *status);
+
+//--------------------------------------------------------------------+
+// Storage
+//--------------------------------------------------------------------+
+
+static macro_t *find(const char *name) {
+    for (uint8_t i = 0; i < macro_count; ++i)
+        if (strcmp(macros[i].name, name) == 0) return &macros[i];
+
+    return NULL;
+}
+
+// Opens a gap of size bytes at the end of macro, the macros behind it move up
+static bool grow(macro_t *macro, uint16_t size) {
+    if (size > MACRO_STORAGE - storage_used) return false;
+
+    uint16_t end = macro->offset + macro->size;
+    memmove(&storage[end + size], &storage[end], storage_used - end);
+
+    for (uint8_t i = 0; i < macro_count; ++i)
+        if (macros[i].offset >= end && &macros[i] != macro) macros[i].offset += size;
+
+    macro->size += size;
+    storage_used += size;
+
+    return true;
+}
+
+static void shrink(macro_t *macro) {
+    uint16_t end = macro->offset + macro->size;
+    memmove(&storage[macro->offset], &storage[end], storage_used - end);
+
+    for (uint8_t i = 0; i < macro_count; ++i)
+        if (macros[i].offset >= end) macros[i].offset -= macro->size;
+
+    storage_used -= macro->size;
+    macro->size = 0;
+}
+
+static void remove_macro(macro_t *macro) {
+    if (running == macro) finish("deleted");
+
+    shrink(macro);
+
+    // keep the table packed, running never points behind a deleted slot
+    uint8_t index = macro - macros;
+    memmove(&macros[index], &macros[index + 1], sizeof(macro_t) * (macro_count - index - 1));
+    --macro_count;
+
+    if (running > macro) --running;
+}
+
+//--------------------------------------------------------------------+
+// Code
+//--------------------------------------------------------------------+
+
+static void reader_init(reader_t *reader) {
+    reader->pos = 0;
+    lzss_decoder_init(&reader->lzss);
+}
+
+// Reads up to size bytes of code, fewer at its end
+static size_t reader_read(reader_t *reader, const macro_t *macro, uint8_t *out, size_t size) {
+    const uint8_t *code = &storage[macro->offset];
+
+    if (macro->compressed) return lzss_decode(&reader->lzss, code, macro->size, out, size);
+
+    if (size > macro->size - reader->pos) size = macro->size - reader->pos;
+    memcpy(out, &code[reader->pos], size);
+    reader->pos += size;
+
+    return size;
+}
+
+static bool reader_done(const reader_t *reader, const macro_t *macro) {
+    if (macro->compressed) return lzss_done(&reader->lzss, macro->size);
+
+    return reader->pos == macro->size;
+}
+
+// Checks that every instruction is complete before a macro runs, a
+// compressed macro is decoded once for it
+static bool valid(const macro_t *macro) {
+    static reader_t check;
+    uint8_t scratch[32];
+
+    reader_init(&check);
+
+    while (true) {
+        uint8_t code[3];
+        size_t got = reader_read(&check, macro, code, sizeof(code));
+
+        if (!got && reader_done(&check, macro)) return true;
+        if (got < sizeof(code)) return false;
+
+        uint16_t length = little_endian_read_16(code, 1);
+        switch (code[0]) {
+            case MACRO_OP_FRAME:
+                if (length == 0) return false;
+
+                while (length) {
+                    size_t step = length < sizeof(scratch) ? length : sizeof(scratch);
+                    if (reader_read(&check, macro, scratch, step) != step) return false;
+                    length -= step;
+                }
+                break;
+            case MACRO_OP_DELAY:
+                break;
+            default:
+                return false;
+        }
+    }
+}
+
+//--------------------------------------------------------------------+
+// Flash
+//--------------------------------------------------------------------+
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    return hash;
+}
+
+static uint32_t checksum(const stored_macros_t *stored, const uint8_t *code) {
+    uint32_t hash = fnv1a(2166136261u, stored->macros, sizeof(macro_t) * stored->count);
+
+    return fnv1a(hash, code, stored->used);
+}
+
+static void load(void) {
+    const stored_macros_t *stored = (const stored_macros_t *)(XIP_BASE + MACRO_FLASH_OFFSET);
+    const uint8_t *code = (const uint8_t *)(XIP_BASE + MACRO_FLASH_OFFSET + FLASH_PAGE_SIZE);
+
+    if (stored->magic != MACRO_MAGIC || stored->version != MACRO_VERSION || stored->count > MACRO_SLOTS ||
+        stored->used > MACRO_STORAGE || stored->checksum != checksum(stored, code))
+        return;
+
+    memcpy(macros, stored->macros, sizeof(macro_t) * stored->count);
+    macro_count = stored->count;
+    memcpy(storage, code, stored->used);
+    storage_used = stored->used;
+
+    printf("BT: %u macros loaded from flash, %u bytes\n", macro_count, storage_used);
+}
+
+static void program(void *data) {
+    flash_range_erase(MACRO_FLASH_OFFSET, MACRO_FLASH_SIZE);
+    flash_range_program(MACRO_FLASH_OFFSET, data, FLASH_PAGE_SIZE);
+    flash_range_program(MACRO_FLASH_OFFSET + FLASH_PAGE_SIZE, storage, MACRO_STORAGE);
+}
+
+static bool save(void) {
+    static uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xFF, sizeof(page));
+
+    stored_macros_t *stored = (stored_macros_t *)page;
+    stored->magic = MACRO_MAGIC;
+    stored->version = MACRO_VERSION;
+    stored->used = storage_used;
+    stored->count = macro_count;
+    memcpy(stored->macros, macros, sizeof(macro_t) * macro_count);
+    stored->checksum = checksum(stored, storage);
+
+    // parks the other core and keeps interrupts away from XIP while we write
+    int result = flash_safe_execute(&program, page, MACRO_SAVE_TIMEOUT_MS);
+    if (result != PICO_OK) {
+        printf("BT: saving the macros failed (%d)\n", result);
+        return false;
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------+
+// Replies
+//--------------------------------------------------------------------+
+
+static void reply(uint16_t id, const char *status, const macro_t *macro) {
+    command_t cmd = {.type = CMD_MACRO, .id = id};
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char *)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "status");
+    mpack_write_cstr(&writer, status);
+    if (macro) {
+        mpack_write_cstr(&writer, "size");
+        mpack_write_u16(&writer, macro->size);
+    }
+    mpack_write_cstr(&writer, "free");
+    mpack_write_u16(&writer, MACRO_STORAGE - storage_used);
+    mpack_complete_map(&writer);
+
+    cmd.length = mpack_writer_buffer_used(&writer);
+    if (mpack_writer_destroy(&writer) != mpack_ok) return;
+
+    if (!cmd_ring_push(&usb_command_ring, &cmd))
+        printf("BT: usb queue full, dropping macro reply\n");
+}
+
+static void reply_list(uint16_t id) {
+    command_t cmd = {.type = CMD_MACRO, .id = id};
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char *)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "status");
+    mpack_write_cstr(&writer, "ok");
+    mpack_write_cstr(&writer, "macros");
+    mpack_build_map(&writer);
+    for (uint8_t i = 0; i < macro_count; ++i) {
+        mpack_write_cstr(&writer, macros[i].name);
+        mpack_write_u16(&writer, macros[i].size);
+    }
+    mpack_complete_map(&writer);
+    mpack_write_cstr(&writer, "free");
+    mpack_write_u16(&writer, MACRO_STORAGE - storage_used);
+    mpack_complete_map(&writer);
+
+    cmd.length = mpack_writer_buffer_used(&writer);
+    if (mpack_writer_destroy(&writer) != mpack_ok) return;
+
+    if (!cmd_ring_push(&usb_command_ring, &cmd))
+        printf("BT: usb queue full, dropping macro reply\n");
+}
+
+static void finish(const char *status) {
+    if (!running) return;
+
+    command_t cmd = {.type = CMD_MACRO, .id = run_id};
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char *)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "status");
+    mpack_write_cstr(&writer, status);
+    mpack_write_cstr(&writer, "name");
+    mpack_write_cstr(&writer, running->name);
+    mpack_write_cstr(&writer, "frames");
+    mpack_write_u32(&writer, run_frames);
+    mpack_write_cstr(&writer, "duration_ms");
+    mpack_write_u32(&writer, btstack_run_loop_get_time_ms() - run_started_ms);
+    mpack_complete_map(&writer);
+
+    cmd.length = mpack_writer_buffer_used(&writer);
+
+    printf("BT: macro %s %s after %lu frames\n", running->name, status, (unsigned long)run_frames);
+
+    running = NULL;
+    waiting = false;
+    btstack_run_loop_remove_timer(&delay_timer);
+
+    if (mpack_writer_destroy(&writer) == mpack_ok && !cmd_ring_push(&usb_command_ring, &cmd))
+        printf("BT: usb queue full, dropping macro reply\n");
+}
+
+//--------------------------------------------------------------------+
+// Control
+//--------------------------------------------------------------------+
+
+void macro_init(macro_wake_fn wake) {
+    wake_bt = wake;
+    btstack_run_loop_set_timer_handler(&delay_timer, &delay_timer_handler);
+
+    load();
+}
+
+void macro_command(const uint8_t *data, size_t length, uint16_t id) {
+    mpack_node_data_t pool[CONFIG_NODES];
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, (const char *)data, length, pool, CONFIG_NODES);
+    mpack_tree_parse(&tree);
+
+    mpack_node_t root = mpack_tree_root(&tree);
+
+    char op[8] = "";
+    char name[MACRO_NAME_LEN] = "";
+    const char *code = NULL;
+    size_t code_size = 0;
+    bool lzss = false;
+
+    if (mpack_node_type(root) == mpack_type_map) {
+        mpack_node_copy_cstr(mpack_node_map_cstr(root, "op"), op, sizeof(op));
+
+        mpack_node_t name_node = mpack_node_map_cstr_optional(root, "name");
+        if (!mpack_node_is_missing(name_node)) mpack_node_copy_cstr(name_node, name, sizeof(name));
+
+        mpack_node_t code_node = mpack_node_map_cstr_optional(root, "code");
+        if (!mpack_node_is_missing(code_node)) {
+            code = mpack_node_bin_data(code_node);
+            code_size = mpack_node_bin_size(code_node);
+        }
+
+        mpack_node_t lzss_node = mpack_node_map_cstr_optional(root, "lzss");
+        if (!mpack_node_is_missing(lzss_node)) lzss = mpack_node_bool(lzss_node);
+    }
+
+    // code points into data, which stays valid after the tree is gone
+    if (mpack_node_type(root) != mpack_type_map || mpack_tree_destroy(&tree) != mpack_ok) {
+        reply(id, "invalid", NULL);
+        return;
+    }
+
+    macro_t *macro = name[0] ? find(name) : NULL;
+
+    if (strcmp(op, "define") == 0 || strcmp(op, "append") == 0) {
+        if (!name[0]) {
+            reply(id, "invalid", NULL);
+            return;
+        }
+
+        if (macro && macro == running) {
+            reply(id, "busy", macro);
+            return;
+        }
+
+        if (!macro) {
+            if (macro_count == MACRO_SLOTS) {
+                reply(id, "no slot", NULL);
+                return;
+            }
+
+            macro = &macros[macro_count++];
+            strcpy(macro->name, name);
+            macro->offset = storage_used;
+            macro->size = 0;
+            macro->compressed = lzss;
+        } else if (strcmp(op, "define") == 0) {
+            shrink(macro);
+            macro->compressed = lzss;
+        }
+
+        uint16_t offset = macro->offset + macro->size;
+        if (!grow(macro, code_size)) {
+            reply(id, "no space", macro);
+            return;
+        }
+
+        memcpy(&storage[offset], code, code_size);
+        reply(id, "ok", macro);
+
+    } else if (strcmp(op, "run") == 0) {
+        if (!macro) {
+            reply(id, "unknown", NULL);
+            return;
+        }
+
+        if (!valid(macro)) {
+            reply(id, "invalid", macro);
+            return;
+        }
+
+        // a run replaces the one in progress
+        finish("stopped");
+
+        running = macro;
+        reader_init(&player);
+        fetched = false;
+        waiting = false;
+        run_id = id;
+        run_frames = 0;
+        run_started_ms = btstack_run_loop_get_time_ms();
+
+        step();
+
+    } else if (strcmp(op, "stop") == 0) {
+        finish("stopped");
+        reply(id, "ok", NULL);
+
+    } else if (strcmp(op, "delete") == 0) {
+        if (!macro) {
+            reply(id, "unknown", NULL);
+            return;
+        }
+
+        remove_macro(macro);
+        reply(id, "ok", NULL);
+
+    } else if (strcmp(op, "list") == 0) {
+        reply_list(id);
+
+    } else if (strcmp(op, "save") == 0) {
+        reply(id, save() ? "ok" : "failed", NULL);
+
+    } else {
+        reply(id, "invalid", NULL);
+    }
+}
+
+void macro_stop(void) {
+    finish("stopped");
+}
+
+//--------------------------------------------------------------------+
+// Replay
+//--------------------------------------------------------------------+
+
+// Runs delays until the next frame or the end of the macro
+static void step(void) {
+    while (running && !waiting) {
+        if (!fetched) {
+            uint8_t code[3];
+            if (reader_read(&player, running, code, sizeof(code)) < sizeof(code)) {
+                finish("ok");
+                return;
+            }
+
+            next_op = code[0];
+            next_arg = little_endian_read_16(code, 1);
+            fetched = true;
+        }
+
+        if (next_op == MACRO_OP_FRAME) {
+            wake_bt();
+            return;
+        }
+
+        fetched = false;
+
+        if (next_arg) {
+            waiting = true;
+            btstack_run_loop_set_timer(&delay_timer, next_arg);
+            btstack_run_loop_add_timer(&delay_timer);
+        }
+    }
+}
+
+static void delay_timer_handler(btstack_timer_source_t *ts) {
+    UNUSED(ts);
+
+    waiting = false;
+    step();
+}
+
+bool macro_frame_ready(void) {
+    return running && !waiting && fetched && next_op == MACRO_OP_FRAME;
+}
+
+// The frame is read straight into the RFCOMM send buffer, there is no copy of
+// it in between even if it has to be decompressed
+void macro_send(uint16_t rfcomm_cid) {
+    if (!macro_frame_ready()) return;
+
+    if (next_arg > rfcomm_get_max_frame_size(rfcomm_cid)) {
+        finish("too large");
+        return;
+    }
+
+    rfcomm_reserve_packet_buffer();
+    uint8_t *buffer = rfcomm_get_outgoing_buffer();
+
+    if (reader_read(&player, running, buffer, next_arg) != next_arg) {
+        rfcomm_release_packet_buffer();
+        finish("invalid");
+        return;
+    }
+
+    capture_trace(TRACE_RFCOMM, NULL, 0, buffer, next_arg);
+    rfcomm_send_prepared(rfcomm_cid, next_arg);
+
+    fetched = false;
+    ++run_frames;
+
+    step();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Named macros of Divoom frames replayed by the bt task straight into RFCOMM.
+//
+// A macro is a bytecode of instructions:
+//   MACRO_OP_FRAME  length (u16 LE), encoded Divoom frame as sent by CMD_DITOO
+//   MACRO_OP_DELAY  milliseconds (u16 LE)
+// The code may be stored as an LZSS stream of it (see lzss.h), a player then
+// decodes each frame straight into the RFCOMM send buffer, only the decoder's
+// window is kept in RAM. Macros live in RAM, "save" writes them to flash and
+// they are loaded from there at boot.
+//
+// CMD_MACRO carries a msgpack map with "op" and its arguments:
+//   "define"  "name", "code" (bin)  replaces the macro with this code, with
+//             "lzss": true the code is compressed
+//   "append"  "name", "code" (bin)  adds code, for macros larger than a message,
+//                                   a compressed stream continues
+//   "run"     "name"                replays the macro, answered when it ends
+//   "stop"                          ends the running macro
+//   "delete"  "name"
+//   "list"
+//   "save"                          keeps every macro across restarts
+// Every op is answered with CMD_MACRO carrying a map with "status" ("ok" or
+// the reason it failed) and, depending on the op, "size", "free", "frames",
+// "duration_ms" or "macros" (a map of name to size).
+
+#define MACRO_STORAGE 4096
+#define MACRO_SLOTS 8
+#define MACRO_NAME_LEN 16
+
+#define MACRO_OP_FRAME 0x00
+#define MACRO_OP_DELAY 0x01
+
+// Called when a frame becomes ready, the bt task asks RFCOMM for a send slot
+typedef void (*macro_wake_fn)(void);
+
+void macro_init(macro_wake_fn wake);
+
+// Handles CMD_MACRO, the answer carries id
+void macro_command(const uint8_t *data, size_t length, uint16_t id);
+
+// True if the running macro has a frame to send right now
+bool macro_frame_ready(void);
+
+// Sends the next frame into the channel and moves on
+void macro_send(uint16_t rfcomm_cid);
+
+// Ends the running macro, e.g. because the channel closed
+void macro_stop(void);
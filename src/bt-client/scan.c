@@ -0,0 +1,317 @@
+#include "scan.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cmd.h"
+
+// Pico
+#include "pico/stdlib.h"
+
+// mpack
+#include "mpack/mpack.h"
+
+// keys, prefixes and addresses of a configuration map
+#define CONFIG_NODES (16 + SCAN_MAX_PREFIXES + SCAN_MAX_ADDRESSES)
+
+static scan_entry_t table[SCAN_TABLE_SIZE];
+static uint8_t table_count;
+
+static uint32_t report_interval_ms = SCAN_REPORT_INTERVAL_MS;
+static bool report_delta = true;
+static bool reporting = false;
+
+static bool le_enabled = true;
+static bool classic_enabled = true;
+static char prefixes[SCAN_MAX_PREFIXES][31] = {"DitooPro"};
+static uint8_t prefix_count = 1;
+static bd_addr_t addresses[SCAN_MAX_ADDRESSES];
+static uint8_t address_count;
+static bool stop_on_match;
+
+static uint32_t started_ms;
+static bool matched;
+
+static btstack_timer_source_t report_timer;
+
+static void report_timer_handler(btstack_timer_source_t *ts);
+static void report(void);
+
+//--------------------------------------------------------------------+
+// Control
+//--------------------------------------------------------------------+
+
+uint8_t scan_configure(const uint8_t *data, size_t length) {
+    if (length == 0) return 0;
+
+    mpack_node_data_t pool[CONFIG_NODES];
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, (const char *)data, length, pool, CONFIG_NODES);
+    mpack_tree_parse(&tree);
+
+    mpack_node_t root = mpack_tree_root(&tree);
+    if (mpack_node_type(root) != mpack_type_map) {
+        mpack_tree_destroy(&tree);
+        return 1;
+    }
+
+    mpack_node_t interval = mpack_node_map_cstr_optional(root, "interval_ms");
+    mpack_node_t delta = mpack_node_map_cstr_optional(root, "delta");
+    mpack_node_t le = mpack_node_map_cstr_optional(root, "le");
+    mpack_node_t classic = mpack_node_map_cstr_optional(root, "classic");
+    mpack_node_t prefix_list = mpack_node_map_cstr_optional(root, "prefixes");
+    mpack_node_t address_list = mpack_node_map_cstr_optional(root, "addresses");
+    mpack_node_t stop = mpack_node_map_cstr_optional(root, "stop_on_match");
+
+    uint32_t new_interval = mpack_node_is_missing(interval) ? report_interval_ms : mpack_node_u32(interval);
+    bool new_delta = mpack_node_is_missing(delta) ? report_delta : mpack_node_bool(delta);
+    bool new_le = mpack_node_is_missing(le) ? le_enabled : mpack_node_bool(le);
+    bool new_classic = mpack_node_is_missing(classic) ? classic_enabled : mpack_node_bool(classic);
+
+    // parse the lists into copies, nothing changes if the map is invalid
+    char new_prefixes[SCAN_MAX_PREFIXES][31];
+    uint8_t new_prefix_count = prefix_count;
+    memcpy(new_prefixes, prefixes, sizeof(prefixes));
+
+    if (!mpack_node_is_missing(prefix_list)) {
+        new_prefix_count = MIN(mpack_node_array_length(prefix_list), SCAN_MAX_PREFIXES);
+        for (uint8_t i = 0; i < new_prefix_count; ++i)
+            mpack_node_copy_cstr(mpack_node_array_at(prefix_list, i), new_prefixes[i], sizeof(new_prefixes[i]));
+    }
+
+    bd_addr_t new_addresses[SCAN_MAX_ADDRESSES];
+    uint8_t new_address_count = address_count;
+    memcpy(new_addresses, addresses, sizeof(addresses));
+
+    bool invalid = false;
+    if (!mpack_node_is_missing(address_list)) {
+        new_address_count = MIN(mpack_node_array_length(address_list), SCAN_MAX_ADDRESSES);
+        for (uint8_t i = 0; i < new_address_count; ++i) {
+            mpack_node_t address = mpack_node_array_at(address_list, i);
+            if (mpack_node_data_len(address) != BD_ADDR_LEN) invalid = true;
+            mpack_node_copy_data(address, (char *)new_addresses[i], BD_ADDR_LEN);
+        }
+    }
+
+    bool new_stop = mpack_node_is_missing(stop) ? new_address_count > 0 : mpack_node_bool(stop);
+
+    if (mpack_tree_destroy(&tree) != mpack_ok || invalid) return 1;
+
+    report_interval_ms = MAX(new_interval, SCAN_REPORT_MIN_INTERVAL_MS);
+    report_delta = new_delta;
+    le_enabled = new_le;
+    classic_enabled = new_classic;
+    memcpy(prefixes, new_prefixes, sizeof(prefixes));
+    prefix_count = new_prefix_count;
+    memcpy(addresses, new_addresses, sizeof(addresses));
+    address_count = new_address_count;
+    stop_on_match = new_stop;
+
+    printf("BT: scan reports every %lu ms (%s), le %d, classic %d, %u prefixes, %u addresses\n",
+           (unsigned long)report_interval_ms, report_delta ? "delta" : "snapshot", le_enabled, classic_enabled,
+           prefix_count, address_count);
+
+    return 0;
+}
+
+bool scan_le_enabled(void) {
+    return le_enabled;
+}
+
+bool scan_classic_enabled(void) {
+    return classic_enabled;
+}
+
+void scan_start(void) {
+    memset(table, 0, sizeof(table));
+    table_count = 0;
+
+    started_ms = btstack_run_loop_get_time_ms();
+    matched = false;
+
+    reporting = true;
+    btstack_run_loop_remove_timer(&report_timer);
+    btstack_run_loop_set_timer_handler(&report_timer, &report_timer_handler);
+    btstack_run_loop_set_timer(&report_timer, report_interval_ms);
+    btstack_run_loop_add_timer(&report_timer);
+}
+
+void scan_stop(void) {
+    if (!reporting) return;
+
+    reporting = false;
+    btstack_run_loop_remove_timer(&report_timer);
+
+    report();
+}
+
+//--------------------------------------------------------------------+
+// Table
+//--------------------------------------------------------------------+
+
+const scan_entry_t *scan_find(const bd_addr_t addr) {
+    for (uint8_t i = 0; i < table_count; ++i)
+        if (memcmp(table[i].addr, addr, BD_ADDR_LEN) == 0) return &table[i];
+
+    return NULL;
+}
+
+static bool listed(const bd_addr_t addr) {
+    for (uint8_t i = 0; i < address_count; ++i)
+        if (memcmp(addresses[i], addr, BD_ADDR_LEN) == 0) return true;
+
+    return false;
+}
+
+static bool matches(const bd_addr_t addr, const char *name) {
+    if (listed(addr)) return true;
+
+    for (uint8_t i = 0; i < prefix_count; ++i)
+        if (name[0] && strncmp(name, prefixes[i], strlen(prefixes[i])) == 0) return true;
+
+    return false;
+}
+
+bool scan_update(const bd_addr_t addr, bd_addr_type_t addr_type, scan_transport_t transport, const char *name, int8_t rssi) {
+    scan_entry_t *entry = (scan_entry_t *)scan_find(addr);
+    uint32_t now = btstack_run_loop_get_time_ms();
+
+    // a known device may report without its name, e.g. in a scan response
+    if (!entry && !matches(addr, name)) return false;
+
+    if (!entry) {
+        if (table_count < SCAN_TABLE_SIZE) {
+            entry = &table[table_count++];
+        } else {
+            // make room by forgetting the device that was quiet the longest
+            entry = &table[0];
+            for (uint8_t i = 1; i < table_count; ++i)
+                if ((int32_t)(table[i].last_seen_ms - entry->last_seen_ms) < 0) entry = &table[i];
+        }
+
+        memset(entry, 0, sizeof(*entry));
+        memcpy(entry->addr, addr, BD_ADDR_LEN);
+        entry->rssi_min = rssi;
+        entry->rssi_max = rssi;
+        entry->found_ms = now - started_ms;
+
+        printf("BT: found %s on %s after %lu ms\n", name, bd_addr_to_str(addr), (unsigned long)entry->found_ms);
+
+        if (!matched) {
+            matched = true;
+            printf("BT: first match after %lu ms via %s\n", (unsigned long)entry->found_ms, transport == SCAN_CLASSIC ? "inquiry" : "LE scan");
+        }
+    }
+
+    entry->addr_type = addr_type;
+    entry->transport = transport;
+    if (name[0]) {
+        strncpy(entry->name, name, sizeof(entry->name) - 1);
+        entry->name[sizeof(entry->name) - 1] = '\0';
+    }
+
+    entry->rssi_min = MIN(entry->rssi_min, rssi);
+    entry->rssi_max = MAX(entry->rssi_max, rssi);
+    entry->rssi_sum += rssi;
+    entry->reports++;
+    entry->last_seen_ms = now;
+    entry->changed = true;
+
+    // with addresses given the prefixes only add to the reports, discovery
+    // goes on until one of the requested devices showed up
+    return stop_on_match && (!address_count || listed(addr));
+}
+
+//--------------------------------------------------------------------+
+// Reports
+//--------------------------------------------------------------------+
+
+static void write_entry(mpack_writer_t *writer, const scan_entry_t *entry, uint32_t now) {
+    mpack_start_array(writer, 9);
+    mpack_write_bin(writer, (const char *)entry->addr, BD_ADDR_LEN);
+    mpack_write_cstr(writer, entry->name);
+    mpack_write_int(writer, entry->rssi_min);
+    mpack_write_int(writer, entry->rssi_max);
+    mpack_write_int(writer, entry->rssi_sum / (int32_t)entry->reports);
+    mpack_write_u32(writer, entry->reports);
+    mpack_write_u32(writer, now - entry->last_seen_ms);
+    mpack_write_u32(writer, entry->found_ms);
+    mpack_write_u8(writer, entry->transport);
+    mpack_finish_array(writer);
+}
+
+static size_t entry_size(const scan_entry_t *entry, uint32_t now) {
+    char buf[sizeof(((command_t *)0)->data)];
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buf, sizeof(buf));
+
+    write_entry(&writer, entry, now);
+
+    size_t size = mpack_writer_buffer_used(&writer);
+    return mpack_writer_destroy(&writer) == mpack_ok ? size : 0;
+}
+
+static bool reported(const scan_entry_t *entry) {
+    return entry->changed || !report_delta;
+}
+
+// Sends the entries to report in as few messages as possible. Entries that
+// did not make it because the usb ring is full keep their changed flag and go
+// out with the next report.
+static void report(void) {
+    uint32_t now = btstack_run_loop_get_time_ms();
+    uint8_t next = 0;
+
+    while (next < table_count) {
+        // pick the entries that fit one message, the array header takes at
+        // most 3 bytes
+        size_t size = 3;
+        uint8_t count = 0;
+        uint8_t end = next;
+
+        for (; end < table_count; ++end) {
+            if (!reported(&table[end])) continue;
+
+            size_t entry = entry_size(&table[end], now);
+            if (size + entry > sizeof(((command_t *)0)->data)) break;
+
+            size += entry;
+            ++count;
+        }
+
+        if (count == 0) return;
+
+        command_t cmd = {.type = MPACK};
+        mpack_writer_t writer;
+        mpack_writer_init(&writer, (char *)cmd.data, sizeof(cmd.data));
+
+        mpack_start_array(&writer, count);
+        for (uint8_t i = next; i < end; ++i)
+            if (reported(&table[i])) write_entry(&writer, &table[i], now);
+        mpack_finish_array(&writer);
+
+        cmd.length = mpack_writer_buffer_used(&writer);
+
+        if (mpack_writer_destroy(&writer) != mpack_ok) {
+            printf("BT: An error occurred encoding the scan report!\n");
+            return;
+        }
+
+        if (!cmd_ring_push(&usb_command_ring, &cmd)) {
+            printf("BT: usb queue full, scan report deferred\n");
+            return;
+        }
+
+        for (uint8_t i = next; i < end; ++i)
+            table[i].changed = false;
+
+        next = end;
+    }
+}
+
+static void report_timer_handler(btstack_timer_source_t *ts) {
+    report();
+
+    btstack_run_loop_set_timer(ts, report_interval_ms);
+    btstack_run_loop_add_timer(ts);
+}
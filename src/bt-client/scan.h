@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// bluetooth stack
+#include "btstack.h"
+
+// Scan results are collected in a table and reported periodically instead of
+// one USB message per advertisement.
+//
+// Discovery runs LE scanning and classic inquiry side by side, only devices
+// whose name starts with one of the configured prefixes or whose address is
+// on the configured list make it into the table.
+//
+// A report is a msgpack array of entries, split over as many messages as
+// needed to fit command_t. Every entry is an array of
+//   [address (bin 6), name (str), rssi min, rssi max, rssi avg, reports, age ms,
+//    found ms, transport]
+// where the RSSI and the number of reports cover everything since the device
+// was first seen, age is the time since the last report, found is the time
+// from the start of discovery to the first report and transport is a
+// scan_transport_t. In delta mode only entries seen since the previous report
+// are included.
+//
+// CMD_LIST_DEVICE may carry a msgpack map to configure discovery, missing keys
+// keep their current value:
+//   "interval_ms"    time between reports, default SCAN_REPORT_INTERVAL_MS
+//   "delta"          report changed entries only, default true
+//   "le"             run LE scanning, default true
+//   "classic"        run classic inquiry, default true
+//   "prefixes"       array of name prefixes, default ["DitooPro"]
+//   "addresses"      array of addresses (bin 6), default none
+//   "stop_on_match"  end discovery at the first device that passes the
+//                    filter, or at the first one on the address list if
+//                    there is one, default true if addresses are given
+
+#define SCAN_TABLE_SIZE 32
+#define SCAN_REPORT_INTERVAL_MS 1000
+#define SCAN_REPORT_MIN_INTERVAL_MS 50
+
+#define SCAN_MAX_PREFIXES 4
+#define SCAN_MAX_ADDRESSES 8
+
+typedef enum {
+    SCAN_LE = 0,
+    SCAN_CLASSIC,
+} scan_transport_t;
+
+typedef struct {
+    bd_addr_t addr;
+    bd_addr_type_t addr_type;
+    scan_transport_t transport;
+    char name[31];
+
+    int8_t rssi_min;
+    int8_t rssi_max;
+    int32_t rssi_sum;
+    uint32_t reports;
+    uint32_t last_seen_ms;
+    uint32_t found_ms;
+
+    // seen since the last report that included it
+    bool changed;
+} scan_entry_t;
+
+// Returns 1 if the payload of CMD_LIST_DEVICE is not a valid configuration
+uint8_t scan_configure(const uint8_t *data, size_t length);
+
+bool scan_le_enabled(void);
+bool scan_classic_enabled(void);
+
+// Clears the table and starts reporting
+void scan_start(void);
+
+// Sends what is left to report and stops reporting
+void scan_stop(void);
+
+// Records a report if the device passes the filter, returns true if
+// discovery should stop because a requested target was found
+bool scan_update(const bd_addr_t addr, bd_addr_type_t addr_type, scan_transport_t transport, const char *name, int8_t rssi);
+
+const scan_entry_t *scan_find(const bd_addr_t addr);
@@ -0,0 +1,213 @@
+#include "ticker.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "capture.h"
+#include "cmd.h"
+#include "divoom.h"
+#include "text.h"
+#include "trace.h"
+
+// bluetooth stack
+#include "btstack.h"
+
+// mpack
+#include "mpack/mpack.h"
+
+#define CONFIG_NODES 16
+
+// worst case of an image frame with every byte escaped
+#define FRAME_SIZE (2 * (4 + 7 + 6 + TEXT_BITMAP_SIZE + 5) + 2)
+
+static text_t text;
+static uint8_t foreground[3];
+static uint8_t background[3];
+static uint16_t step_ms;
+static uint8_t loops;
+
+static bool running;
+static bool due;
+static int32_t offset;
+static uint8_t pass;
+static uint16_t run_id;
+static uint32_t run_frames;
+static uint32_t run_started_ms;
+
+static uint8_t frame[FRAME_SIZE];
+
+static ticker_wake_fn wake_bt;
+static btstack_timer_source_t step_timer;
+
+// Answers id, with the numbers of the running text if there is one
+static void reply(uint16_t id, const char *status) {
+    command_t cmd = {.type = CMD_TEXT, .id = id};
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char *)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "status");
+    mpack_write_cstr(&writer, status);
+    if (running) {
+        mpack_write_cstr(&writer, "frames");
+        mpack_write_u32(&writer, run_frames);
+        mpack_write_cstr(&writer, "duration_ms");
+        mpack_write_u32(&writer, btstack_run_loop_get_time_ms() - run_started_ms);
+    }
+    mpack_complete_map(&writer);
+
+    cmd.length = mpack_writer_buffer_used(&writer);
+    if (mpack_writer_destroy(&writer) != mpack_ok) return;
+
+    if (!cmd_ring_push(&usb_command_ring, &cmd))
+        printf("BT: usb queue full, dropping text reply\n");
+}
+
+static void finish(const char *status) {
+    if (!running) return;
+
+    printf("BT: text %s after %lu frames\n", status, (unsigned long)run_frames);
+
+    reply(run_id, status);
+
+    running = false;
+    due = false;
+    btstack_run_loop_remove_timer(&step_timer);
+}
+
+static void step_timer_handler(btstack_timer_source_t *ts) {
+    UNUSED(ts);
+
+    due = true;
+    wake_bt();
+}
+
+static void read_color(mpack_node_t map, const char *key, uint8_t rgb[3], uint32_t fallback) {
+    uint32_t color = fallback;
+
+    mpack_node_t node = mpack_node_map_cstr_optional(map, key);
+    if (!mpack_node_is_missing(node)) color = mpack_node_u32(node);
+
+    rgb[0] = color >> 16;
+    rgb[1] = color >> 8;
+    rgb[2] = color;
+}
+
+void ticker_init(ticker_wake_fn wake) {
+    wake_bt = wake;
+    btstack_run_loop_set_timer_handler(&step_timer, &step_timer_handler);
+}
+
+void ticker_command(const uint8_t *data, size_t length, uint16_t id) {
+    mpack_node_data_t pool[CONFIG_NODES];
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, (const char *)data, length, pool, CONFIG_NODES);
+    mpack_tree_parse(&tree);
+
+    mpack_node_t root = mpack_tree_root(&tree);
+    if (mpack_node_type(root) != mpack_type_map) {
+        mpack_tree_destroy(&tree);
+        reply(id, "invalid");
+        return;
+    }
+
+    mpack_node_t text_node = mpack_node_map_cstr_optional(root, "text");
+    if (mpack_node_is_missing(text_node)) {
+        bool ok = mpack_tree_destroy(&tree) == mpack_ok;
+        finish("stopped");
+        reply(id, ok ? "ok" : "invalid");
+        return;
+    }
+
+    uint8_t scale = 2;
+    mpack_node_t node = mpack_node_map_cstr_optional(root, "scale");
+    if (!mpack_node_is_missing(node)) scale = mpack_node_u8(node);
+
+    uint16_t step = TICKER_STEP_MS;
+    node = mpack_node_map_cstr_optional(root, "step_ms");
+    if (!mpack_node_is_missing(node)) step = mpack_node_u16(node);
+
+    uint8_t passes = 1;
+    node = mpack_node_map_cstr_optional(root, "loops");
+    if (!mpack_node_is_missing(node)) passes = mpack_node_u8(node);
+
+    uint8_t fg[3], bg[3];
+    read_color(root, "color", fg, 0xFFFFFF);
+    read_color(root, "background", bg, 0x000000);
+
+    text_t layout;
+    text_layout(&layout, mpack_node_str(text_node), mpack_node_strlen(text_node), scale);
+
+    if (mpack_tree_destroy(&tree) != mpack_ok || (scale != 1 && scale != 2) || !layout.count) {
+        reply(id, "invalid");
+        return;
+    }
+
+    // the new text replaces the running one
+    finish("stopped");
+
+    text = layout;
+    memcpy(foreground, fg, 3);
+    memcpy(background, bg, 3);
+    step_ms = step;
+    loops = passes;
+
+    running = true;
+    due = true;
+    // the text enters from the right edge
+    offset = -TEXT_SIZE;
+    pass = 0;
+    run_id = id;
+    run_frames = 0;
+    run_started_ms = btstack_run_loop_get_time_ms();
+
+    wake_bt();
+}
+
+bool ticker_frame_ready(void) {
+    return running && due;
+}
+
+void ticker_send(uint16_t rfcomm_cid, bool escaped) {
+    if (!ticker_frame_ready()) return;
+
+    uint8_t bitmap[TEXT_BITMAP_SIZE];
+    text_render(&text, offset, bitmap);
+
+    size_t size = divoom_encode_image(bitmap, foreground, background, frame, sizeof(frame), escaped);
+    if (!size || size > rfcomm_get_max_frame_size(rfcomm_cid)) {
+        finish("too large");
+        return;
+    }
+
+    due = false;
+
+    // a frame RFCOMM did not take is tried again on the next step
+    uint8_t status = rfcomm_send(rfcomm_cid, frame, size);
+    if (status != ERROR_CODE_SUCCESS) {
+        printf("BT: text frame not sent, status 0x%02x\n", status);
+        btstack_run_loop_set_timer(&step_timer, step_ms);
+        btstack_run_loop_add_timer(&step_timer);
+        return;
+    }
+
+    capture_trace(TRACE_RFCOMM, NULL, 0, frame, size);
+    ++run_frames;
+
+    // done once the text has left on the left edge
+    if (++offset > text_width(&text)) {
+        offset = -TEXT_SIZE;
+        if (loops && ++pass == loops) {
+            finish("ok");
+            return;
+        }
+    }
+
+    btstack_run_loop_set_timer(&step_timer, step_ms);
+    btstack_run_loop_add_timer(&step_timer);
+}
+
+void ticker_stop(void) {
+    finish("stopped");
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Scrolling text rendered on the adapter, see src/divoom/include/text.h.
+//
+// CMD_TEXT carries a msgpack map:
+//   "text"        UTF-8 string
+//   "color"       foreground as 0xRRGGBB, white by default
+//   "background"  0xRRGGBB, black by default
+//   "step_ms"     time per column scrolled, 80 by default
+//   "loops"       passes over the display, 0 scrolls until stopped, 1 by default
+//   "scale"       1 for the 5x7 font, 2 (default) for it doubled
+// A map without "text" stops the ticker. A new text replaces the running one.
+//
+// The bt task renders every frame right before RFCOMM takes it and starts the
+// next step from there, so a slow link slows the scroll down instead of
+// queueing frames. The text is answered with CMD_TEXT when it ends, carrying
+// "status", "frames" and "duration_ms", or with just "status" right away if it
+// is invalid.
+
+#define TICKER_STEP_MS 80
+
+// Called when a frame becomes due, the bt task asks RFCOMM for a send slot
+typedef void (*ticker_wake_fn)(void);
+
+void ticker_init(ticker_wake_fn wake);
+
+// Handles CMD_TEXT, the answer carries id
+void ticker_command(const uint8_t *data, size_t length, uint16_t id);
+
+// True if the next frame is due
+bool ticker_frame_ready(void);
+
+// Renders the next frame into the channel and schedules the one after it
+void ticker_send(uint16_t rfcomm_cid, bool escaped);
+
+// Ends the running text, e.g. because the channel closed
+void ticker_stop(void);
@@ -0,0 +1,212 @@
+#include "capture.h"
+
+#include <string.h>
+
+#include "trace.h"
+
+// Pico
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+
+// btsnoop timestamps count microseconds since 0000-01-01
+#define BTSNOOP_EPOCH_OFFSET 0x00DCDDB30F2F8000ull
+#define BTSNOOP_DATALINK_H4 1002
+#define BTSNOOP_RECORD_HEADER_SIZE 24
+
+#define BTSNOOP_FLAG_RECEIVED 0x01
+#define BTSNOOP_FLAG_COMMAND_EVENT 0x02
+
+// H4 packet types
+#define H4_COMMAND 0x01
+#define H4_EVENT 0x04
+
+_Static_assert((CAPTURE_RING_SIZE & (CAPTURE_RING_SIZE - 1)) == 0, "CAPTURE_RING_SIZE must be a power of two");
+_Static_assert(TRACE_FILE_HEADER_SIZE == CAPTURE_FILE_HEADER_SIZE, "both formats share the file header size");
+
+static uint8_t ring[CAPTURE_RING_SIZE];
+// head is written by the bt task, tail by the cdc task
+static volatile uint32_t head;
+static volatile uint32_t tail;
+
+static volatile bool recording;
+static volatile uint32_t drops;
+
+// the current or last recording is a trace, its producers serialise on lock
+static volatile bool tracing;
+static critical_section_t lock;
+static bool lock_ready;
+static uint64_t trace_last_us;
+static uint32_t trace_lost;
+
+static void store_be32(uint8_t* buf, uint32_t value) {
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+static void ring_write(uint32_t pos, const uint8_t* data, size_t size) {
+    if (!size) return;
+
+    uint32_t offset = pos & (CAPTURE_RING_SIZE - 1);
+    size_t first = MIN(size, CAPTURE_RING_SIZE - offset);
+
+    memcpy(&ring[offset], data, first);
+    memcpy(ring, data + first, size - first);
+}
+
+//--------------------------------------------------------------------+
+// BT task
+//--------------------------------------------------------------------+
+
+void capture_packet(uint8_t packet_type, bool in, const uint8_t* packet, uint16_t length) {
+    if (!recording || tracing) return;
+
+    uint16_t included = MIN(length, CAPTURE_SNAPLEN);
+    // the H4 packet type byte leads every record
+    size_t size = BTSNOOP_RECORD_HEADER_SIZE + 1 + included;
+
+    uint32_t pos = head;
+    uint32_t free = CAPTURE_RING_SIZE - (pos - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+
+    if (size > free) {
+        drops = drops + 1;
+        return;
+    }
+
+    uint32_t flags = in ? BTSNOOP_FLAG_RECEIVED : 0;
+    if (packet_type == H4_COMMAND || packet_type == H4_EVENT) flags |= BTSNOOP_FLAG_COMMAND_EVENT;
+
+    uint64_t timestamp = time_us_64() + BTSNOOP_EPOCH_OFFSET;
+
+    uint8_t header[BTSNOOP_RECORD_HEADER_SIZE + 1];
+    store_be32(&header[0], length + 1);
+    store_be32(&header[4], included + 1);
+    store_be32(&header[8], flags);
+    store_be32(&header[12], drops);
+    store_be32(&header[16], timestamp >> 32);
+    store_be32(&header[20], timestamp);
+    header[24] = packet_type;
+
+    ring_write(pos, header, sizeof(header));
+    ring_write(pos + sizeof(header), packet, included);
+
+    __atomic_store_n(&head, pos + size, __ATOMIC_RELEASE);
+}
+
+//--------------------------------------------------------------------+
+// Any task
+//--------------------------------------------------------------------+
+
+void capture_trace(uint8_t kind, const uint8_t* prefix, size_t prefix_size, const uint8_t* data, size_t size) {
+    if (!recording || !tracing) return;
+
+    critical_section_enter_blocking(&lock);
+
+    uint64_t now = time_us_64();
+    uint64_t elapsed = now - trace_last_us;
+    uint32_t delta = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+    uint32_t length = prefix_size + size;
+
+    // what was lost goes ahead of the next record that fits
+    uint8_t header[2 * TRACE_RECORD_HEADER_MAX + 5];
+    size_t header_size = 0;
+    if (trace_lost) {
+        uint8_t count[5];
+        size_t count_size = trace_put_varint(count, trace_lost);
+
+        header_size = trace_record_header(header, TRACE_DROPS, delta, count_size);
+        memcpy(&header[header_size], count, count_size);
+        header_size += count_size;
+        delta = 0;
+    }
+    header_size += trace_record_header(&header[header_size], kind, delta, length);
+
+    uint32_t pos = head;
+    uint32_t free = CAPTURE_RING_SIZE - (pos - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+
+    if (header_size + length > free) {
+        trace_lost++;
+        drops = drops + 1;
+    } else {
+        ring_write(pos, header, header_size);
+        ring_write(pos + header_size, prefix, prefix_size);
+        ring_write(pos + header_size + prefix_size, data, size);
+
+        __atomic_store_n(&head, pos + header_size + length, __ATOMIC_RELEASE);
+        trace_last_us = now;
+        trace_lost = 0;
+    }
+
+    critical_section_exit(&lock);
+}
+
+//--------------------------------------------------------------------+
+// CDC task
+//--------------------------------------------------------------------+
+
+// Starts over in the given format, a trace producer may be in the middle of
+// a record
+static void start(bool trace) {
+    if (!lock_ready) {
+        critical_section_init(&lock);
+        lock_ready = true;
+    }
+
+    critical_section_enter_blocking(&lock);
+    recording = false;
+    tracing = trace;
+    trace_last_us = time_us_64();
+    trace_lost = 0;
+    critical_section_exit(&lock);
+
+    // dropping what is left is up to the consumer, the bt task keeps writing
+    __atomic_store_n(&tail, __atomic_load_n(&head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    recording = true;
+}
+
+void capture_start(void) {
+    start(false);
+}
+
+void capture_start_trace(void) {
+    start(true);
+}
+
+void capture_stop(void) {
+    recording = false;
+}
+
+bool capture_recording(void) {
+    return recording;
+}
+
+size_t capture_file_header(uint8_t* buf) {
+    if (tracing) return trace_file_header(buf);
+
+    memcpy(buf, "btsnoop\0", 8);
+    store_be32(&buf[8], 1);
+    store_be32(&buf[12], BTSNOOP_DATALINK_H4);
+
+    return CAPTURE_FILE_HEADER_SIZE;
+}
+
+size_t capture_read(uint8_t* buf, size_t size) {
+    uint32_t pos = tail;
+    uint32_t available = __atomic_load_n(&head, __ATOMIC_ACQUIRE) - pos;
+    uint32_t offset = pos & (CAPTURE_RING_SIZE - 1);
+
+    size = MIN(size, available);
+    size_t first = MIN(size, CAPTURE_RING_SIZE - offset);
+
+    memcpy(buf, &ring[offset], first);
+    memcpy(buf + first, ring, size - first);
+
+    __atomic_store_n(&tail, pos + size, __ATOMIC_RELEASE);
+
+    return size;
+}
+
+uint32_t capture_drops(void) {
+    return drops;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// HCI capture in btsnoop format (datalink H4), recorded into a RAM ring.
+//
+// The bt task appends one record per HCI packet and never waits, a record that
+// does not fit is dropped and counted in the cumulative drops of the next one.
+// The cdc task owns everything else: it starts and stops the recording and
+// streams the ring out as CMD_CAPTURE messages, prefixed with the btsnoop file
+// header so that the concatenated payloads open in Wireshark as they are.
+//
+// CMD_CAPTURE carries one capture_op_t byte. CAPTURE_READ streams what is
+// recorded and keeps streaming live while the recording runs, the end of the
+// stream is marked by an empty CMD_CAPTURE.
+//
+// CAPTURE_TRACE records the traffic trace of trace.h instead of HCI, the
+// stream is then a trace file. Its events come from the cdc and the bt task,
+// they take a lock the HCI records do without.
+
+#define CAPTURE_RING_SIZE (16 * 1024)
+// longer packets are cut, the record keeps their original length
+#define CAPTURE_SNAPLEN 256
+#define CAPTURE_FILE_HEADER_SIZE 16
+
+typedef enum : uint8_t {
+    CAPTURE_STOP = 0,
+    CAPTURE_START,
+    CAPTURE_READ,
+    CAPTURE_TRACE,
+} capture_op_t;
+
+// bt task: records one HCI packet if a capture is running
+void capture_packet(uint8_t packet_type, bool in, const uint8_t* packet, uint16_t length);
+
+// any task: records a trace event if a trace is running, its payload is
+// prefix followed by data
+void capture_trace(uint8_t kind, const uint8_t* prefix, size_t prefix_size, const uint8_t* data, size_t size);
+
+// cdc task
+void capture_start(void);
+void capture_start_trace(void);
+void capture_stop(void);
+bool capture_recording(void);
+size_t capture_file_header(uint8_t* buf);
+size_t capture_read(uint8_t* buf, size_t size);
+uint32_t capture_drops(void);
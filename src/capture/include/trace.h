@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Traffic trace recorded by the capture ring instead of HCI (CAPTURE_TRACE),
+// the commands the host clients send and the frames the adapter hands to
+// RFCOMM, so a workload seen in the field can be replayed later (see
+// host/tools/trace_replay.cpp). Platform independent so the host tools parse
+// what the adapter writes.
+//
+// The file starts with the TRACE_FILE_HEADER_SIZE byte header, "dtrace\0\0"
+// and the version as u32 LE and 4 zero bytes, then one record per event:
+//   kind (u8) | delta (varint) | length (varint) | payload
+// delta is the time in us since the previous record, or since the trace
+// started for the first. Varints are LEB128, 7 bits per byte starting with the
+// least significant.
+
+#define TRACE_FILE_HEADER_SIZE 16
+#define TRACE_VERSION 1
+
+// largest kind, delta and length ahead of a payload
+#define TRACE_RECORD_HEADER_MAX (1 + 5 + 3)
+
+// command accepted from a host client:
+//   client (u8) | type (u8) | id (u16 LE) | flags (u8) | payload
+#define TRACE_COMMAND 0x01
+// bytes handed to RFCOMM, host and adapter frames alike
+#define TRACE_RFCOMM 0x02
+// records lost because the ring was full since the previous record, varint
+#define TRACE_DROPS 0x03
+
+#define TRACE_COMMAND_HEADER_SIZE 5
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint8_t kind;
+    uint32_t delta_us;
+    uint32_t length;
+    const uint8_t* payload;
+} trace_record_t;
+
+static inline size_t trace_put_varint(uint8_t* buf, uint32_t value) {
+    size_t size = 0;
+
+    while (value >= 0x80) {
+        buf[size++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buf[size++] = value;
+
+    return size;
+}
+
+// Returns the bytes the varint takes, 0 if it is incomplete or too long
+static inline size_t trace_get_varint(const uint8_t* buf, size_t size, uint32_t* value) {
+    *value = 0;
+
+    for (size_t i = 0; i < size && i < 5; ++i) {
+        *value |= (uint32_t)(buf[i] & 0x7F) << (7 * i);
+        if (!(buf[i] & 0x80)) return i + 1;
+    }
+
+    return 0;
+}
+
+static inline size_t trace_file_header(uint8_t* buf) {
+    static const uint8_t header[TRACE_FILE_HEADER_SIZE] = {'d', 't', 'r', 'a', 'c', 'e', 0, 0, TRACE_VERSION, 0, 0, 0, 0, 0, 0, 0};
+
+    for (size_t i = 0; i < TRACE_FILE_HEADER_SIZE; ++i)
+        buf[i] = header[i];
+
+    return TRACE_FILE_HEADER_SIZE;
+}
+
+// Writes the header of a record, returns its size
+static inline size_t trace_record_header(uint8_t* buf, uint8_t kind, uint32_t delta_us, uint32_t length) {
+    buf[0] = kind;
+    size_t size = 1 + trace_put_varint(&buf[1], delta_us);
+
+    return size + trace_put_varint(&buf[size], length);
+}
+
+// Parses the record at buf, returns its size or 0 if it is incomplete
+static inline size_t trace_parse_record(const uint8_t* buf, size_t size, trace_record_t* record) {
+    if (size < 1) return 0;
+    record->kind = buf[0];
+
+    size_t used = 1;
+    size_t step = trace_get_varint(&buf[used], size - used, &record->delta_us);
+    if (!step) return 0;
+    used += step;
+
+    step = trace_get_varint(&buf[used], size - used, &record->length);
+    if (!step || record->length > size - used - step) return 0;
+    used += step;
+
+    record->payload = &buf[used];
+
+    return used + record->length;
+}
+
+#ifdef __cplusplus
+}
+#endif
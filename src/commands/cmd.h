@@ -1,85 +1,237 @@
-// FreeRTOS
-#include "FreeRTOS.h"
-#include "queue.h"
+#pragma once
 
 // mpack
 #include "mpack/mpack.h"
 
-extern xQueueHandle bt_command_queue;
-extern xQueueHandle usb_command_queue;
+#define CMD_DATA_SIZE 256
+
+// Every command of the protocol, the position is its ext type, so new ones
+// go at the end.
+//
+// The lengths bound the payload, a command outside them is rejected before it
+// is copied. The priority says who handles it:
+//   IMMEDIATE  the cdc task, right away and ahead of everything queued, it
+//              takes no credit
+//   QUEUED     the bt task, in order through bt_command_ring, it takes a
+//              credit
+//   NONE       nobody, it is only sent by the adapter
+// The handler is a function of that task, which builds its table of them with
+// CMD_HANDLER_ENTRY. Handlers of the other task are never referenced.
+//
+// X(name, min length, max length, priority, handler)
+#define COMMANDS(X)                                                                \
+    /* scan configuration map or empty */                                          \
+    X(LIST_DEVICE, 0, CMD_DATA_SIZE, QUEUED, handle_list_device)                   \
+    /* bd_addr, all zeros disconnects */                                           \
+    X(SELECT_DEVICE, 6, 6, QUEUED, handle_select_device)                           \
+    X(DITOO, 1, CMD_DATA_SIZE, QUEUED, handle_ditoo)                               \
+    X(SINK, 0, CMD_DATA_SIZE, IMMEDIATE, handle_sink)                              \
+    X(CREDIT, 0, 0, IMMEDIATE, handle_credit)                                      \
+    X(BUSY, 0, 0, NONE, NULL)                                                      \
+    X(STATS, 0, 0, IMMEDIATE, handle_stats)                                        \
+    X(LINK_POLICY, 0, 1, QUEUED, handle_link_policy)                               \
+    X(CAPTURE, 1, 1, IMMEDIATE, handle_capture)                                    \
+    X(MACRO, 0, CMD_DATA_SIZE, QUEUED, handle_macro)                               \
+    X(CONFIG, 0, CMD_DATA_SIZE, IMMEDIATE, handle_config)                          \
+    X(TEXT, 0, CMD_DATA_SIZE, QUEUED, handle_text)                                 \
+    X(BOOT, 0, 0, IMMEDIATE, handle_boot)                                          \
+    X(POWER, 0, 0, IMMEDIATE, handle_power)                                        \
+    X(CLIENTS, 0, 0, IMMEDIATE, handle_clients)                                    \
+    X(BENCH, 0, CMD_DATA_SIZE, QUEUED, handle_bench)                               \
+    X(DEDUPE, 0, CMD_DATA_SIZE, QUEUED, handle_dedupe)
 
 typedef enum : uint8_t {
-    CMD_LIST_DEVICE = 0,
-    CMD_SELECT_DEVICE,
-    CMD_DITOO,
+#define CMD_ENUM(name, min, max, prio, handler) CMD_##name,
+    COMMANDS(CMD_ENUM)
+#undef CMD_ENUM
+    CMD_COUNT,
     MPACK = ((uint8_t)(-1)),
 } command_type;
 
+typedef enum : uint8_t {
+    CMD_PRIO_NONE = 0,
+    CMD_PRIO_IMMEDIATE,
+    CMD_PRIO_QUEUED,
+} command_prio_t;
+
+typedef struct {
+    uint16_t min_length;
+    uint16_t max_length;
+    command_prio_t prio;
+} command_desc_t;
+
+#define CMD_BOUNDS(name, min, max, prio, handler) \
+    _Static_assert((min) <= (max) && (max) <= CMD_DATA_SIZE, "bounds of CMD_" #name);
+COMMANDS(CMD_BOUNDS)
+#undef CMD_BOUNDS
+
+// Descriptor of a command type, NULL if there is no such command
+static inline const command_desc_t* command_desc(uint8_t type) {
+    static const command_desc_t descs[CMD_COUNT] = {
+#define CMD_DESC(name, min, max, prio, handler) [CMD_##name] = {(min), (max), CMD_PRIO_##prio},
+        COMMANDS(CMD_DESC)
+#undef CMD_DESC
+    };
+
+    return type < CMD_COUNT ? &descs[type] : NULL;
+}
+
+// Table entry of a task that handles the commands of priority task, e.g.
+//   #define BT_HANDLER(name, min, max, prio, handler) CMD_HANDLER_ENTRY(QUEUED, name, prio, handler)
+//   static const bt_handler_t handlers[CMD_COUNT] = {COMMANDS(BT_HANDLER)};
+#define CMD_HANDLER_ENTRY(task, name, prio, handler) [CMD_##name] = CMD_HANDLER_##task##_##prio(handler),
+#define CMD_HANDLER_IMMEDIATE_IMMEDIATE(handler) &handler
+#define CMD_HANDLER_IMMEDIATE_QUEUED(handler) NULL
+#define CMD_HANDLER_IMMEDIATE_NONE(handler) NULL
+#define CMD_HANDLER_QUEUED_IMMEDIATE(handler) NULL
+#define CMD_HANDLER_QUEUED_QUEUED(handler) &handler
+#define CMD_HANDLER_QUEUED_NONE(handler) NULL
+
+// CMD_DITOO: send the frame even if the Ditoo already has it, see dedupe.h
+#define CMD_FLAG_FORCE 0x01
+
 typedef struct {
     command_type type;
-    uint8_t data[256];
+    uint16_t id;    // request id from the host, 0 if none
+    uint8_t flags;  // CMD_FLAG_*, from the host only
+    uint8_t data[CMD_DATA_SIZE];
     size_t length;
 } command_t;
 
-static inline uint8_t mpack_to_command(const mpack_node_t* node, command_t* cmd) {
-    command_type exttype = mpack_node_exttype(*node);
-
-    uint32_t len = mpack_node_data_len(*node);
-    const char* data = mpack_node_data(*node);
-
-    switch (exttype) {
-        case CMD_LIST_DEVICE:
-        case CMD_SELECT_DEVICE:
-        case CMD_DITOO:
-            cmd->type = exttype;
-            memcpy(cmd->data, data, len);
-            cmd->length = len;
-            break;
-
-        default:
-            return 1;
-    }
+// Request ids cross the bt task tagged with the USB client that sent them, the
+// host's ids are 15 bit and the top bit names the client. The cdc task rejects
+// larger ids, masking them would answer with an id the host never sent. Id 0
+// stays untagged, whatever carries it goes to every client.
+#define CMD_ID_MASK 0x7FFF
+#define CMD_ID_CLIENT_SHIFT 15
 
-    return 0;
+static inline uint16_t cmd_id_tag(uint16_t id, uint8_t client) {
+    return id ? id | (client << CMD_ID_CLIENT_SHIFT) : 0;
 }
 
-static inline size_t command_to_mpack(command_t cmd, char** buf) {
-    *buf = malloc(cmd.length + 6);
-    mpack_writer_t writer;
-    mpack_writer_init(&writer, *buf, cmd.length + 6);
+static inline uint8_t cmd_id_client(uint16_t id) {
+    return id >> CMD_ID_CLIENT_SHIFT;
+}
 
-    mpack_write_ext(&writer, cmd.type, cmd.data, cmd.length);
-    size_t count = mpack_writer_buffer_used(&writer);
+#include "ring.h"
 
-    if (mpack_writer_destroy(&writer) != mpack_ok) {
-        return -1;
-    }
+// USB -> BT, produced by the cdc task and consumed by the bt task
+extern cmd_ring_t bt_command_ring;
+// BT -> USB, produced by the bt task and consumed by the cdc task
+extern cmd_ring_t usb_command_ring;
 
-    return count;
+#include "flow.h"
+
+// Reads an unsigned envelope field up to max. Nothing is flagged in the tree
+// if it does not fit, that would reset the client's stream and lose the
+// commands buffered with it.
+static inline bool mpack_envelope_uint(mpack_node_t node, uint64_t max, uint64_t* value) {
+    if (mpack_node_type(node) != mpack_type_uint) return false;
+
+    *value = mpack_node_u64(node);
+    return *value <= max;
 }
 
-static inline void mpack_in_command(const char* buf, size_t size, command_t* cmd) {
+// Accepts either a bare ext or the [id, ext] envelope, the id is handed back
+// with every reply the command produces. The envelope may carry CMD_FLAG_*
+// as a third element, [id, ext, flags], with id 0 if there is none. Unknown
+// types, payloads outside the bounds of their type and ids or flags out of
+// range are rejected, cmd keeps their type and id for command_reject(). An id
+// above 16 bits cannot be handed back, it is left at 0.
+static inline uint8_t mpack_to_command(const mpack_node_t* node, command_t* cmd) {
+    mpack_node_t ext = *node;
     cmd->type = MPACK;
-    memcpy(cmd->data, buf, size);
-    cmd->length = size;
+    cmd->id = 0;
+    cmd->flags = 0;
+
+    bool envelope = true;
+
+    if (mpack_node_type(*node) == mpack_type_array) {
+        size_t count = mpack_node_array_length(*node);
+        if (count != 2 && count != 3) return 1;
+
+        uint64_t id = 0, flags = 0;
+        envelope = mpack_envelope_uint(mpack_node_array_at(*node, 0), UINT16_MAX, &id);
+        if (count == 3) envelope &= mpack_envelope_uint(mpack_node_array_at(*node, 2), UINT8_MAX, &flags);
+
+        cmd->id = id <= UINT16_MAX ? id : 0;
+        cmd->flags = flags <= UINT8_MAX ? flags : 0;
+        ext = mpack_node_array_at(*node, 1);
+    }
+
+    if (mpack_node_type(ext) != mpack_type_ext || mpack_node_error(ext) != mpack_ok) return 1;
+
+    uint8_t exttype = mpack_node_exttype(ext);
+    uint32_t len = mpack_node_data_len(ext);
+
+    // the type stays for the CMD_BUSY of a rejected command
+    cmd->type = exttype;
+    if (!envelope) return 1;
+
+    const command_desc_t* desc = command_desc(exttype);
+    if (!desc || desc->prio == CMD_PRIO_NONE || len < desc->min_length || len > desc->max_length) return 1;
+
+    memcpy(cmd->data, mpack_node_data(ext), len);
+    cmd->length = len;
+
+    return 0;
 }
 
-static inline size_t rfcomm_packet_to_mpack(uint8_t* packet, uint16_t size, command_type type, command_t* cmd) {
-    char* buf = malloc(size + 6);
+// Whether the host spent a credit on a command of this type: everything but
+// IMMEDIATE, unknown types included
+static inline bool command_takes_credit(uint8_t type) {
+    const command_desc_t* desc = command_desc(type);
+    return !desc || desc->prio != CMD_PRIO_IMMEDIATE;
+}
+
+// The CMD_BUSY answering a rejected command, with its type and id. The caller
+// sends it and returns the credit if the command took one.
+static inline void command_reject(const command_t* cmd, command_t* reply) {
+    reply->type = CMD_BUSY;
+    reply->id = cmd->id;
+    reply->flags = 0;
+    reply->data[0] = cmd->type;
+    reply->data[1] = FLOW_BUSY_INVALID;
+    reply->length = 2;
+}
+
+// Writes cmd as an ext, or as [id, ext] if id is not 0. Returns the number of
+// bytes written, 0 if buf is too small.
+static inline size_t command_to_mpack_id(const command_t* cmd, uint16_t id, char* buf, size_t size) {
     mpack_writer_t writer;
-    mpack_writer_init(&writer, buf, size + 6);
+    mpack_writer_init(&writer, buf, size);
+
+    if (id) {
+        mpack_start_array(&writer, 2);
+        mpack_write_u16(&writer, id);
+    }
+
+    mpack_write_ext(&writer, cmd->type, (const char*)cmd->data, cmd->length);
+
+    if (id) mpack_finish_array(&writer);
 
-    mpack_write_ext(&writer, type, packet, size);
     size_t count = mpack_writer_buffer_used(&writer);
 
     if (mpack_writer_destroy(&writer) != mpack_ok)
-        return 1;
+        return 0;
 
-    cmd->type = MPACK;
-    memcpy(cmd->data, buf, count);
-    cmd->length = count;
+    return count;
+}
 
-    free(buf);
+// Same with the request id cmd carries
+static inline size_t command_to_mpack(const command_t* cmd, char* buf, size_t size) {
+    return command_to_mpack_id(cmd, cmd->id, buf, size);
+}
 
-    return 0;
-}
\ No newline at end of file
+// Wraps a plain msgpack object, false if it does not fit
+static inline bool mpack_in_command(const char* buf, size_t size, command_t* cmd) {
+    if (size > sizeof(cmd->data)) return false;
+
+    cmd->type = MPACK;
+    cmd->id = 0;
+    cmd->flags = 0;
+    memcpy(cmd->data, buf, size);
+    cmd->length = size;
+
+    return true;
+}
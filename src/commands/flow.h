@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+// Credit based flow control towards the USB host.
+//
+// The host may only have as many commands in flight as it holds credits. It
+// gets the whole free space of bt_command_ring when it opens the port or sends
+// an empty CMD_CREDIT, and one credit back for every command the bt task has
+// finished with, for CMD_DITOO that is once the frame left over RFCOMM.
+// Commands that arrive without a free slot are answered with CMD_BUSY instead
+// of being dropped silently.
+//
+// CMD_CREDIT carries the number of credits as u16 LE. Returned credits add to
+// the host's count, a grant carries FLOW_GRANT as third byte and replaces it.
+//
+// CMD_BUSY carries the type of the command it answers and why it was not
+// taken. Only FLOW_BUSY_FULL means the host's count is off, for the others the
+// credit of the command comes back like for any finished one.
+
+#define FLOW_GRANT 1
+
+// no free slot in bt_command_ring
+#define FLOW_BUSY_FULL 0
+// unknown type or payload outside its bounds, see mpack_to_command
+#define FLOW_BUSY_INVALID 1
+// the channel closed before the frame went out
+#define FLOW_BUSY_NO_LINK 2
+
+// Number of commands the bt task has finished, only written by the bt task.
+extern volatile uint32_t credits_returned;
+
+// bt task: hands one credit back to the host
+static inline void flow_return_credit(void) {
+    __atomic_store_n(&credits_returned, credits_returned + 1, __ATOMIC_RELEASE);
+    cmd_ring_wake(&usb_command_ring);
+}
+
+// cdc task: credits returned since the last call
+static inline uint16_t flow_take_credits(uint32_t* reported) {
+    uint32_t returned = __atomic_load_n(&credits_returned, __ATOMIC_ACQUIRE);
+    uint16_t credits = (uint16_t)(returned - *reported);
+    *reported = returned;
+
+    return credits;
+}
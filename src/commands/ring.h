@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Lock-free single-producer/single-consumer ring for command_t.
+// The producer only ever writes head, the consumer only ever writes tail, so
+// the two cores never have to take the kernel lock to hand a message over.
+// CMD_RING_SIZE must be a power of two.
+
+#define CMD_RING_SIZE 16
+
+typedef void (*ring_wake_fn)(void);
+
+typedef struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile ring_wake_fn wake;
+    command_t slots[CMD_RING_SIZE];
+} cmd_ring_t;
+
+static inline uint32_t ring_load_acquire(volatile const uint32_t* index) {
+    return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+static inline void ring_store_release(volatile uint32_t* index, uint32_t value) {
+    __atomic_store_n(index, value, __ATOMIC_RELEASE);
+}
+
+// Consumer side: registers the function that wakes the consumer up once the
+// ring goes from empty to non-empty. Must be safe to call from the other core.
+static inline void cmd_ring_set_wake(cmd_ring_t* ring, ring_wake_fn wake) {
+    __atomic_store_n(&ring->wake, wake, __ATOMIC_RELEASE);
+}
+
+static inline void cmd_ring_wake(cmd_ring_t* ring) {
+    ring_wake_fn wake = __atomic_load_n(&ring->wake, __ATOMIC_ACQUIRE);
+    if (wake) wake();
+}
+
+static inline uint32_t cmd_ring_count(cmd_ring_t* ring) {
+    return ring_load_acquire(&ring->head) - ring_load_acquire(&ring->tail);
+}
+
+static inline bool cmd_ring_empty(cmd_ring_t* ring) {
+    return cmd_ring_count(ring) == 0;
+}
+
+// Producer side. Returns false if the ring is full.
+static inline bool cmd_ring_push(cmd_ring_t* ring, const command_t* cmd) {
+    uint32_t head = ring->head;
+    uint32_t tail = ring_load_acquire(&ring->tail);
+
+    if (head - tail >= CMD_RING_SIZE) return false;
+
+    ring->slots[head & (CMD_RING_SIZE - 1)] = *cmd;
+    ring_store_release(&ring->head, head + 1);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // only wake the consumer if it already drained everything in front of
+    // this message, otherwise it is still running and will pick it up
+    if (ring_load_acquire(&ring->tail) == head) cmd_ring_wake(ring);
+
+    return true;
+}
+
+// Consumer side: returns the oldest message without removing it, or NULL.
+static inline command_t* cmd_ring_peek(cmd_ring_t* ring) {
+    uint32_t tail = ring->tail;
+    if (ring_load_acquire(&ring->head) == tail) return NULL;
+
+    return &ring->slots[tail & (CMD_RING_SIZE - 1)];
+}
+
+// Consumer side: releases the slot returned by cmd_ring_peek.
+static inline void cmd_ring_drop(cmd_ring_t* ring) {
+    ring_store_release(&ring->tail, ring->tail + 1);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// Consumer side. Returns false if the ring is empty.
+static inline bool cmd_ring_pop(cmd_ring_t* ring, command_t* cmd) {
+    command_t* slot = cmd_ring_peek(ring);
+    if (slot == NULL) return false;
+
+    *cmd = *slot;
+    cmd_ring_drop(ring);
+
+    return true;
+}
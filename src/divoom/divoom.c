@@ -0,0 +1,172 @@
+#include "divoom.h"
+
+#include <string.h>
+
+void divoom_parser_init(divoom_parser_t* parser, bool escaped) {
+    memset(parser, 0, sizeof(*parser));
+    parser->escaped = escaped;
+}
+
+void divoom_parser_reset(divoom_parser_t* parser) {
+    parser->in_frame = false;
+    parser->escape = false;
+    parser->length = 0;
+}
+
+static void finish_frame(divoom_parser_t* parser, divoom_frame_cb cb, void* context) {
+    const uint8_t* buf = parser->buf;
+    uint16_t length = parser->length;
+
+    // length field, command and checksum at least
+    if (length < 5) {
+        ++parser->checksum_errors;
+        return;
+    }
+
+    uint16_t declared = buf[0] | (buf[1] << 8);
+    if (declared != length - 2) {
+        ++parser->checksum_errors;
+        return;
+    }
+
+    uint16_t sum = 0;
+    for (uint16_t i = 0; i < length - 2; ++i)
+        sum += buf[i];
+
+    uint16_t checksum = buf[length - 2] | (buf[length - 1] << 8);
+    if (sum != checksum) {
+        ++parser->checksum_errors;
+        return;
+    }
+
+    ++parser->frames;
+    cb(buf + 2, length - 4, context);
+}
+
+void divoom_parser_feed(divoom_parser_t* parser, const uint8_t* data, size_t size, divoom_frame_cb cb, void* context) {
+    for (size_t i = 0; i < size; ++i) {
+        uint8_t byte = data[i];
+
+        if (byte == DIVOOM_START) {
+            // a start inside a frame means we lost the end of the previous one
+            divoom_parser_reset(parser);
+            parser->in_frame = true;
+            continue;
+        }
+
+        if (!parser->in_frame) continue;
+
+        if (byte == DIVOOM_END) {
+            finish_frame(parser, cb, context);
+            divoom_parser_reset(parser);
+            continue;
+        }
+
+        if (parser->escaped) {
+            if (parser->escape) {
+                byte -= DIVOOM_ESCAPE;
+                parser->escape = false;
+            } else if (byte == DIVOOM_ESCAPE) {
+                parser->escape = true;
+                continue;
+            }
+        }
+
+        if (parser->length == sizeof(parser->buf)) {
+            ++parser->overflows;
+            divoom_parser_reset(parser);
+            continue;
+        }
+
+        parser->buf[parser->length++] = byte;
+    }
+}
+
+int divoom_frame_command(const uint8_t* data, size_t size, bool escaped) {
+    if (size == 0 || data[0] != DIVOOM_START) return -1;
+
+    // skip the two length bytes, which may be escaped themselves
+    uint8_t seen = 0;
+    for (size_t i = 1; i < size; ++i) {
+        uint8_t byte = data[i];
+
+        if (escaped && byte == DIVOOM_ESCAPE) {
+            if (++i == size) return -1;
+            byte = data[i] - DIVOOM_ESCAPE;
+        }
+
+        if (seen++ == 2) return byte;
+    }
+
+    return -1;
+}
+
+typedef struct {
+    uint8_t* out;
+    size_t size;
+    size_t pos;
+    bool escaped;
+} frame_writer_t;
+
+static void put_byte(frame_writer_t* writer, uint8_t byte) {
+    bool escape = writer->escaped && byte >= DIVOOM_START && byte <= DIVOOM_ESCAPE;
+
+    if (writer->pos + (escape ? 2 : 1) > writer->size) {
+        writer->pos = writer->size + 1;
+        return;
+    }
+
+    if (escape) {
+        writer->out[writer->pos++] = DIVOOM_ESCAPE;
+        byte += DIVOOM_ESCAPE;
+    }
+
+    writer->out[writer->pos++] = byte;
+}
+
+size_t divoom_encode_frame(uint8_t command, const uint8_t* payload, size_t length, uint8_t* out, size_t size, bool escaped) {
+    if (length + 1 > DIVOOM_MAX_FRAME || size < 2) return 0;
+
+    frame_writer_t writer = {.out = out, .size = size - 1, .pos = 1, .escaped = escaped};
+    out[0] = DIVOOM_START;
+
+    uint16_t declared = length + 3;
+    uint16_t sum = (declared & 0xFF) + (declared >> 8) + command;
+
+    put_byte(&writer, declared & 0xFF);
+    put_byte(&writer, declared >> 8);
+    put_byte(&writer, command);
+
+    for (size_t i = 0; i < length; ++i) {
+        sum += payload[i];
+        put_byte(&writer, payload[i]);
+    }
+
+    put_byte(&writer, sum & 0xFF);
+    put_byte(&writer, sum >> 8);
+
+    if (writer.pos > writer.size) return 0;
+
+    out[writer.pos++] = DIVOOM_END;
+
+    return writer.pos;
+}
+size_t divoom_encode_image(const uint8_t bitmap[32], const uint8_t foreground[3], const uint8_t background[3], uint8_t* out, size_t size, bool escaped) {
+    // display header, image header, two colour palette and one bit per pixel
+    uint8_t payload[4 + 7 + 6 + 32] = {0x00, 0x0A, 0x0A, 0x04};
+    uint16_t image_size = sizeof(payload) - 4;
+    uint8_t* image = payload + 4;
+
+    image[0] = 0xAA;
+    image[1] = image_size & 0xFF;
+    image[2] = image_size >> 8;
+    image[3] = 0;
+    image[4] = 0;
+    image[5] = 0;
+    image[6] = 2;
+    memcpy(image + 7, background, 3);
+    memcpy(image + 10, foreground, 3);
+    memcpy(image + 13, bitmap, 32);
+
+    return divoom_encode_frame(DIVOOM_SET_IMAGE, payload, sizeof(payload), out, size, escaped);
+}
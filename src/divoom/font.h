@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "text.h"
+
+// printable ASCII from ' ' to '~', then the glyphs below
+#define FONT_FIRST ' '
+#define FONT_DEGREE 95
+#define FONT_UNKNOWN ('?' - FONT_FIRST)
+#define FONT_GLYPHS 96
+
+extern const uint8_t font_glyphs[FONT_GLYPHS][TEXT_GLYPH_WIDTH];
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Divoom SPP framing:
+//   0x01 | length (u16 LE) | command | payload ... | checksum (u16 LE) | 0x02
+// length counts command, payload and checksum, the checksum is the sum of the
+// length, command and payload bytes. Between start and end the bytes 0x01,
+// 0x02 and 0x03 are escaped as 0x03 followed by the byte + 3.
+// Platform independent so it also builds for the host tools.
+
+#define DIVOOM_START 0x01
+#define DIVOOM_END 0x02
+#define DIVOOM_ESCAPE 0x03
+
+// commands answered by the device come back as DIVOOM_RESPONSE followed by the
+// original command and DIVOOM_ACK
+#define DIVOOM_RESPONSE 0x04
+#define DIVOOM_ACK 0x55
+
+// largest unescaped command + payload a frame may carry
+#define DIVOOM_MAX_FRAME 256
+
+// Static image on the 16x16 display:
+//   DIVOOM_SET_IMAGE | 00 0A 0A 04 | image
+// image: 0xAA | size (u16 LE, whole image) | time (u16 LE) | 0x00 (new palette)
+//        | colours | RGB palette | pixels
+// pixels are palette indices of ceil(log2(colours)) bits, row by row and
+// packed from the least significant bit
+#define DIVOOM_SET_IMAGE 0x44
+
+// Other commands that set state on the device and are only acknowledged
+#define DIVOOM_SET_VOLUME 0x08
+#define DIVOOM_SET_CHANNEL 0x45
+#define DIVOOM_SET_ANIMATION 0x49
+#define DIVOOM_SET_BRIGHTNESS 0x74
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Called with the unescaped, verified command + payload of every frame
+typedef void (*divoom_frame_cb)(const uint8_t* frame, uint16_t length, void* context);
+
+typedef struct {
+    bool escaped;
+    bool in_frame;
+    bool escape;
+    uint16_t length;
+    // length, command, payload and checksum
+    uint8_t buf[DIVOOM_MAX_FRAME + 4];
+
+    uint32_t frames;
+    uint32_t checksum_errors;
+    uint32_t overflows;
+} divoom_parser_t;
+
+void divoom_parser_init(divoom_parser_t* parser, bool escaped);
+void divoom_parser_reset(divoom_parser_t* parser);
+
+// Streams bytes in any split, emits one callback per complete frame
+void divoom_parser_feed(divoom_parser_t* parser, const uint8_t* data, size_t size, divoom_frame_cb cb, void* context);
+
+// Command byte of an encoded frame, -1 if data does not start with a frame
+int divoom_frame_command(const uint8_t* data, size_t size, bool escaped);
+
+// Encodes command + payload as a frame, returns its size or 0 if out is too small
+size_t divoom_encode_frame(uint8_t command, const uint8_t* payload, size_t length, uint8_t* out, size_t size, bool escaped);
+
+// Encodes a two colour 16x16 bitmap (see text.h) as a DIVOOM_SET_IMAGE frame,
+// set bits take foreground. Returns the frame size or 0 if out is too small.
+size_t divoom_encode_image(const uint8_t bitmap[32], const uint8_t foreground[3], const uint8_t background[3], uint8_t* out, size_t size, bool escaped);
+
+#ifdef __cplusplus
+}
+#endif
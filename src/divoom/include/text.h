@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Text rasteriser for the 16x16 display, platform independent so the host
+// benchmark renders exactly what the adapter sends.
+//
+// Text is laid out once as a row of glyphs of the built-in 5x7 font, printable
+// ASCII plus a degree sign, anything else shows as '?'. Glyphs are 6 columns
+// apart at scale 1 and doubled at scale 2, rows are centred. text_render()
+// draws the 16 columns starting at a column of the laid out text into a 1 bit
+// bitmap, pixel y * 16 + x is bit (n & 7) of byte n >> 3.
+
+#define TEXT_SIZE 16
+#define TEXT_BITMAP_SIZE (TEXT_SIZE * TEXT_SIZE / 8)
+#define TEXT_MAX_GLYPHS 128
+
+#define TEXT_GLYPH_WIDTH 5
+#define TEXT_GLYPH_HEIGHT 7
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint8_t glyphs[TEXT_MAX_GLYPHS];
+    uint16_t count;
+    uint8_t scale;
+} text_t;
+
+// Lays out UTF-8 text at scale 1 or 2, longer text is cut after
+// TEXT_MAX_GLYPHS glyphs. Returns the number of glyphs.
+uint16_t text_layout(text_t* text, const char* utf8, size_t length, uint8_t scale);
+
+// Width of the laid out text in columns
+int32_t text_width(const text_t* text);
+
+// Draws the columns offset to offset + 15, columns outside the text stay blank
+void text_render(const text_t* text, int32_t offset, uint8_t bitmap[TEXT_BITMAP_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,90 @@
+#include "text.h"
+
+#include <string.h>
+
+#include "font.h"
+
+// Decodes one code point, invalid sequences count as one unknown byte
+static uint32_t next_code_point(const uint8_t** pos, const uint8_t* end) {
+    const uint8_t* p = *pos;
+    uint32_t c = *p++;
+    int more = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+
+    if (c >= 0x80 && !more) {
+        *pos = p;
+        return 0xFFFD;
+    }
+
+    if (more) c &= 0x7F >> (more + 1);
+    for (; more; --more) {
+        if (p == end || (*p & 0xC0) != 0x80) {
+            *pos = p;
+            return 0xFFFD;
+        }
+        c = (c << 6) | (*p++ & 0x3F);
+    }
+
+    *pos = p;
+    return c;
+}
+
+static uint8_t glyph_of(uint32_t c) {
+    if (c >= FONT_FIRST && c <= '~') return c - FONT_FIRST;
+    if (c == 0xB0) return FONT_DEGREE;
+
+    return FONT_UNKNOWN;
+}
+
+uint16_t text_layout(text_t* text, const char* utf8, size_t length, uint8_t scale) {
+    const uint8_t* pos = (const uint8_t*)utf8;
+    const uint8_t* end = pos + length;
+
+    text->count = 0;
+    text->scale = scale == 2 ? 2 : 1;
+
+    while (pos < end && text->count < TEXT_MAX_GLYPHS)
+        text->glyphs[text->count++] = glyph_of(next_code_point(&pos, end));
+
+    return text->count;
+}
+
+int32_t text_width(const text_t* text) {
+    if (!text->count) return 0;
+
+    // no gap after the last glyph
+    return (text->count * (TEXT_GLYPH_WIDTH + 1) - 1) * text->scale;
+}
+
+// One font column as a column of the display, bit n is row n
+static uint16_t display_column(uint8_t bits, uint8_t scale) {
+    if (scale == 1) return bits << ((TEXT_SIZE - TEXT_GLYPH_HEIGHT) / 2);
+
+    uint16_t column = 0;
+    for (int row = 0; row < TEXT_GLYPH_HEIGHT; ++row)
+        if (bits & (1 << row)) column |= 3 << (row * 2);
+
+    return column << ((TEXT_SIZE - 2 * TEXT_GLYPH_HEIGHT) / 2);
+}
+
+void text_render(const text_t* text, int32_t offset, uint8_t bitmap[TEXT_BITMAP_SIZE]) {
+    uint16_t rows[TEXT_SIZE] = {0};
+    int32_t width = text_width(text);
+    int32_t advance = (TEXT_GLYPH_WIDTH + 1) * text->scale;
+
+    for (int x = 0; x < TEXT_SIZE; ++x) {
+        int32_t c = offset + x;
+        if (c < 0 || c >= width) continue;
+
+        int32_t column = (c % advance) / text->scale;
+        if (column >= TEXT_GLYPH_WIDTH) continue;
+
+        uint16_t bits = display_column(font_glyphs[text->glyphs[c / advance]][column], text->scale);
+        for (int y = 0; bits; ++y, bits >>= 1)
+            if (bits & 1) rows[y] |= 1 << x;
+    }
+
+    for (int y = 0; y < TEXT_SIZE; ++y) {
+        bitmap[y * 2] = rows[y] & 0xFF;
+        bitmap[y * 2 + 1] = rows[y] >> 8;
+    }
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Synthetic Divoom traffic of a given size, rate and duration, to qualify
+// adapters and firmware builds without host scripts. Platform independent:
+// the bt task drives it on the adapter (see src/bt-client/generator.h) and
+// host/tools/loadgen_bench.cpp on the host, the owner supplies the clock.
+//
+// Frames become due at the configured rate and wait in a queue of
+// LOADGEN_QUEUE frames until the link takes them, frames due while it is full
+// are dropped. The latency of a frame runs from the time it became due to the
+// time it was sent. At rate 0 the next frame is due as soon as the previous
+// one went out, that measures the link alone.
+//
+// CMD_BENCH carries a msgpack map:
+//   "size"         payload bytes per frame, 16 by default
+//   "rate"         frames per second, 0 (default) as fast as the link goes
+//   "duration_ms"  1000 by default
+//   "loopback"     true skips the radio, every frame is decoded again instead
+//   "command"      Divoom command byte of the frames, LOADGEN_COMMAND by default
+//   "stop"         true ends the running benchmark
+// A new benchmark replaces the running one. It is answered with CMD_BENCH
+// once it ends, carrying
+//   "status"       "ok", "stopped", "no link" if the channel closed, "failed"
+//                  if a frame did not make it through the loopback or
+//                  "invalid" if one did not fit into an RFCOMM frame
+//   "mode"         "rfcomm" or "loopback"
+//   "frames"       frames sent and their bytes on the wire
+//   "bytes"
+//   "duration_ms"
+//   "frames_per_s"
+//   "bytes_per_s"
+//   "drops"        frames dropped because the queue was full
+//   "latency_us"   map of "p50", "p90", "p99" and "max"
+// A map that does not start a run is answered right away with just "status",
+// "ok" for a stop, "invalid" or "no link" for an rfcomm run without channel.
+// An rfcomm run whose frames may not fit into an RFCOMM frame once escaped is
+// "invalid" too. Only frames RFCOMM took count as sent.
+
+// frames that may wait for the link
+#define LOADGEN_QUEUE 8
+// unknown to the Ditoo, it drops the frames without answering
+#define LOADGEN_COMMAND 0xFE
+#define LOADGEN_SIZE 16
+#define LOADGEN_DURATION_MS 1000
+
+// latencies below 16 us exactly, above that 8 buckets per power of two up to
+// 2^26 us
+#define LOADGEN_BUCKETS (16 + 22 * 8)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    LOADGEN_RFCOMM = 0,
+    LOADGEN_LOOPBACK,
+} loadgen_mode_t;
+
+typedef struct {
+    loadgen_mode_t mode;
+    uint8_t command;
+    uint16_t size;
+    uint32_t rate;
+    uint32_t duration_ms;
+} loadgen_config_t;
+
+typedef struct {
+    uint32_t frames;
+    uint64_t bytes;
+    uint32_t duration_us;
+    uint32_t drops;
+    uint32_t p50_us;
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} loadgen_result_t;
+
+// times in us from a clock of the owner's choice, they may wrap
+typedef struct {
+    loadgen_config_t config;
+    bool running;
+    uint32_t started;
+    uint32_t ended;
+
+    // frames that became due, whether they were queued or dropped
+    uint32_t due;
+    uint32_t queue[LOADGEN_QUEUE];
+    uint32_t head;
+    uint32_t tail;
+
+    uint32_t frames;
+    uint64_t bytes;
+    uint32_t drops;
+    uint32_t latency[LOADGEN_BUCKETS];
+    uint32_t latency_max;
+} loadgen_t;
+
+// Reads a CMD_BENCH map, returns false if it is invalid. stop is set if it
+// asks to end the running benchmark.
+bool loadgen_parse(const uint8_t* data, size_t length, loadgen_config_t* config, bool* stop);
+
+void loadgen_start(loadgen_t* gen, const loadgen_config_t* config, uint32_t now);
+// Ends the run, the queued frames count as dropped
+void loadgen_stop(loadgen_t* gen, uint32_t now);
+
+// Queues the frames that became due by now and ends the run once its time is
+// up. Returns true while it runs.
+bool loadgen_poll(loadgen_t* gen, uint32_t now);
+
+// us from now until the next frame is due or the run ends
+uint32_t loadgen_next_us(const loadgen_t* gen, uint32_t now);
+
+bool loadgen_frame_ready(const loadgen_t* gen);
+
+// Encodes the oldest queued frame, returns its size or 0 if out is too small
+size_t loadgen_frame(const loadgen_t* gen, uint8_t* out, size_t size, bool escaped);
+
+// Takes the oldest queued frame off the queue once the link took its bytes
+void loadgen_sent(loadgen_t* gen, size_t bytes, uint32_t now);
+
+void loadgen_result(const loadgen_t* gen, uint32_t now, loadgen_result_t* result);
+
+// Encodes the CMD_BENCH answer, returns its size or 0 if out is too small
+size_t loadgen_summary(const loadgen_t* gen, const char* status, uint32_t now, uint8_t* out, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,274 @@
+#include "loadgen.h"
+
+#include <string.h>
+
+#include "divoom.h"
+
+// mpack
+#include "mpack/mpack.h"
+
+#define CONFIG_NODES 16
+
+static const char* const mode_names[] = {
+    [LOADGEN_RFCOMM] = "rfcomm",
+    [LOADGEN_LOOPBACK] = "loopback",
+};
+
+//--------------------------------------------------------------------+
+// Latency histogram
+//--------------------------------------------------------------------+
+
+static int floor_log2(uint32_t value) {
+    return 31 - __builtin_clz(value);
+}
+
+static int bucket_of(uint32_t us) {
+    if (us < 16) return us;
+
+    int exponent = floor_log2(us);
+    if (exponent > 25) return LOADGEN_BUCKETS - 1;
+
+    return 16 + (exponent - 4) * 8 + ((us >> (exponent - 3)) & 7);
+}
+
+// Largest latency that falls into the bucket
+static uint32_t bucket_top(int bucket) {
+    if (bucket < 16) return bucket;
+
+    int exponent = 4 + (bucket - 16) / 8;
+    uint32_t step = 1u << (exponent - 3);
+
+    return (1u << exponent) + ((bucket - 16) % 8 + 1) * step - 1;
+}
+
+static uint32_t percentile(const loadgen_t* gen, uint32_t percent) {
+    if (!gen->frames) return 0;
+
+    // rank of the frame that has percent of the others at or below it
+    uint32_t rank = ((uint64_t)gen->frames * percent + 99) / 100;
+    uint32_t seen = 0;
+
+    for (int i = 0; i < LOADGEN_BUCKETS; ++i) {
+        seen += gen->latency[i];
+        if (seen >= rank) return bucket_top(i) < gen->latency_max ? bucket_top(i) : gen->latency_max;
+    }
+
+    return gen->latency_max;
+}
+
+//--------------------------------------------------------------------+
+// Configuration
+//--------------------------------------------------------------------+
+
+bool loadgen_parse(const uint8_t* data, size_t length, loadgen_config_t* config, bool* stop) {
+    mpack_node_data_t pool[CONFIG_NODES];
+    mpack_tree_t tree;
+    mpack_tree_init_pool(&tree, (const char*)data, length, pool, CONFIG_NODES);
+    mpack_tree_parse(&tree);
+
+    *config = (loadgen_config_t){
+        .mode = LOADGEN_RFCOMM,
+        .command = LOADGEN_COMMAND,
+        .size = LOADGEN_SIZE,
+        .rate = 0,
+        .duration_ms = LOADGEN_DURATION_MS,
+    };
+    *stop = false;
+
+    mpack_node_t root = mpack_tree_root(&tree);
+    if (mpack_node_type(root) != mpack_type_map) {
+        mpack_tree_destroy(&tree);
+        return false;
+    }
+
+    mpack_node_t node = mpack_node_map_cstr_optional(root, "stop");
+    if (!mpack_node_is_missing(node)) *stop = mpack_node_bool(node);
+
+    node = mpack_node_map_cstr_optional(root, "size");
+    if (!mpack_node_is_missing(node)) config->size = mpack_node_u16(node);
+
+    node = mpack_node_map_cstr_optional(root, "rate");
+    if (!mpack_node_is_missing(node)) config->rate = mpack_node_u32(node);
+
+    node = mpack_node_map_cstr_optional(root, "duration_ms");
+    if (!mpack_node_is_missing(node)) config->duration_ms = mpack_node_u32(node);
+
+    node = mpack_node_map_cstr_optional(root, "loopback");
+    if (!mpack_node_is_missing(node) && mpack_node_bool(node)) config->mode = LOADGEN_LOOPBACK;
+
+    node = mpack_node_map_cstr_optional(root, "command");
+    if (!mpack_node_is_missing(node)) config->command = mpack_node_u8(node);
+
+    if (mpack_tree_destroy(&tree) != mpack_ok) return false;
+
+    // the command shares the frame with the payload, a run has to end before
+    // the us clock wraps
+    return config->size && config->size < DIVOOM_MAX_FRAME && config->rate <= 1000000 && config->duration_ms &&
+           config->duration_ms <= 3600 * 1000;
+}
+
+//--------------------------------------------------------------------+
+// Run
+//--------------------------------------------------------------------+
+
+static uint32_t queued(const loadgen_t* gen) {
+    return gen->head - gen->tail;
+}
+
+static void enqueue(loadgen_t* gen, uint32_t due) {
+    gen->due++;
+    gen->queue[gen->head++ % LOADGEN_QUEUE] = due;
+}
+
+// Time the frame with the given number becomes due, relative to the start
+static uint32_t due_at(const loadgen_t* gen, uint32_t frame) {
+    return (uint64_t)frame * 1000000 / gen->config.rate;
+}
+
+void loadgen_start(loadgen_t* gen, const loadgen_config_t* config, uint32_t now) {
+    memset(gen, 0, sizeof(*gen));
+
+    gen->config = *config;
+    gen->running = true;
+    gen->started = now;
+    gen->ended = now;
+
+    loadgen_poll(gen, now);
+}
+
+void loadgen_stop(loadgen_t* gen, uint32_t now) {
+    if (!gen->running) return;
+
+    gen->drops += queued(gen);
+    gen->tail = gen->head;
+    gen->running = false;
+    gen->ended = now;
+}
+
+bool loadgen_poll(loadgen_t* gen, uint32_t now) {
+    if (!gen->running) return false;
+
+    uint32_t elapsed = now - gen->started;
+
+    if (elapsed >= gen->config.duration_ms * 1000) {
+        loadgen_stop(gen, gen->started + gen->config.duration_ms * 1000);
+        return false;
+    }
+
+    if (!gen->config.rate) {
+        // the next frame is due once the previous one is out
+        if (!queued(gen)) enqueue(gen, now);
+        return true;
+    }
+
+    uint32_t target = (uint64_t)elapsed * gen->config.rate / 1000000 + 1;
+
+    while (gen->due != target && queued(gen) < LOADGEN_QUEUE)
+        enqueue(gen, gen->started + due_at(gen, gen->due));
+
+    // the queue is full, whatever else is due by now is lost
+    gen->drops += target - gen->due;
+    gen->due = target;
+
+    return true;
+}
+
+uint32_t loadgen_next_us(const loadgen_t* gen, uint32_t now) {
+    if (!gen->running) return 0;
+
+    uint32_t elapsed = now - gen->started;
+    uint32_t end = gen->config.duration_ms * 1000;
+    uint32_t next = end;
+
+    if (gen->config.rate && due_at(gen, gen->due) < end) next = due_at(gen, gen->due);
+
+    return next > elapsed ? next - elapsed : 0;
+}
+
+bool loadgen_frame_ready(const loadgen_t* gen) {
+    return gen->running && queued(gen);
+}
+
+size_t loadgen_frame(const loadgen_t* gen, uint8_t* out, size_t size, bool escaped) {
+    uint8_t payload[DIVOOM_MAX_FRAME];
+
+    // a pattern that moves with every frame, now and then it needs escaping
+    // like real images do
+    uint32_t sequence = gen->frames;
+    for (uint16_t i = 0; i < gen->config.size; ++i)
+        payload[i] = sequence + i;
+
+    return divoom_encode_frame(gen->config.command, payload, gen->config.size, out, size, escaped);
+}
+
+void loadgen_sent(loadgen_t* gen, size_t bytes, uint32_t now) {
+    if (!queued(gen)) return;
+
+    uint32_t latency = now - gen->queue[gen->tail++ % LOADGEN_QUEUE];
+
+    gen->frames++;
+    gen->bytes += bytes;
+    gen->latency[bucket_of(latency)]++;
+    if (latency > gen->latency_max) gen->latency_max = latency;
+}
+
+//--------------------------------------------------------------------+
+// Report
+//--------------------------------------------------------------------+
+
+void loadgen_result(const loadgen_t* gen, uint32_t now, loadgen_result_t* result) {
+    result->frames = gen->frames;
+    result->bytes = gen->bytes;
+    result->duration_us = (gen->running ? now : gen->ended) - gen->started;
+    result->drops = gen->drops;
+    result->p50_us = percentile(gen, 50);
+    result->p90_us = percentile(gen, 90);
+    result->p99_us = percentile(gen, 99);
+    result->max_us = gen->latency_max;
+}
+
+size_t loadgen_summary(const loadgen_t* gen, const char* status, uint32_t now, uint8_t* out, size_t size) {
+    loadgen_result_t result;
+    loadgen_result(gen, now, &result);
+
+    uint32_t duration_ms = result.duration_us / 1000;
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char*)out, size);
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "status");
+    mpack_write_cstr(&writer, status);
+    mpack_write_cstr(&writer, "mode");
+    mpack_write_cstr(&writer, mode_names[gen->config.mode]);
+    mpack_write_cstr(&writer, "frames");
+    mpack_write_u32(&writer, result.frames);
+    mpack_write_cstr(&writer, "bytes");
+    mpack_write_u64(&writer, result.bytes);
+    mpack_write_cstr(&writer, "duration_ms");
+    mpack_write_u32(&writer, duration_ms);
+    mpack_write_cstr(&writer, "frames_per_s");
+    mpack_write_u32(&writer, result.duration_us ? (uint64_t)result.frames * 1000000 / result.duration_us : 0);
+    mpack_write_cstr(&writer, "bytes_per_s");
+    mpack_write_u32(&writer, result.duration_us ? result.bytes * 1000000 / result.duration_us : 0);
+    mpack_write_cstr(&writer, "drops");
+    mpack_write_u32(&writer, result.drops);
+    mpack_write_cstr(&writer, "latency_us");
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "p50");
+    mpack_write_u32(&writer, result.p50_us);
+    mpack_write_cstr(&writer, "p90");
+    mpack_write_u32(&writer, result.p90_us);
+    mpack_write_cstr(&writer, "p99");
+    mpack_write_u32(&writer, result.p99_us);
+    mpack_write_cstr(&writer, "max");
+    mpack_write_u32(&writer, result.max_us);
+    mpack_complete_map(&writer);
+    mpack_complete_map(&writer);
+
+    size_t used = mpack_writer_buffer_used(&writer);
+
+    if (mpack_writer_destroy(&writer) != mpack_ok) return 0;
+
+    return used;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// LZSS with a 512 byte window, small enough to decode on the adapter while a
+// stored animation plays. Platform independent so the host tools compress
+// exactly what the adapter decodes.
+//
+// A stream is a sequence of groups, a flag byte followed by up to 8 items,
+// the least significant flag bit describes the first item:
+//   1  literal byte
+//   0  match (u16 BE): distance - 1 in the upper 9 bits, length - 3 in the
+//      lower 7, copies length bytes starting distance bytes back
+// A match may overlap the bytes it produces. The stream ends with its input,
+// the last group may be short.
+
+#define LZSS_WINDOW_BITS 9
+#define LZSS_LENGTH_BITS 7
+#define LZSS_WINDOW (1 << LZSS_WINDOW_BITS)
+#define LZSS_MIN_MATCH 3
+#define LZSS_MAX_MATCH (LZSS_MIN_MATCH + (1 << LZSS_LENGTH_BITS) - 1)
+
+// largest stream size bytes of input can take
+#define LZSS_BOUND(size) ((size) + ((size) + 7) / 8)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint8_t window[LZSS_WINDOW];
+    uint16_t head;
+    // bytes in the window, matches may not reach further back
+    uint16_t filled;
+
+    // position in the input
+    size_t in_pos;
+    uint8_t flags;
+    uint8_t items;
+
+    // match in progress
+    uint16_t distance;
+    uint8_t copy;
+
+    bool error;
+} lzss_decoder_t;
+
+void lzss_decoder_init(lzss_decoder_t* decoder);
+
+// Continues decoding the stream in, which may have grown since the last call,
+// and writes up to size bytes to out. Returns the bytes written, fewer only
+// once the input is used up or the stream is corrupt (see error).
+size_t lzss_decode(lzss_decoder_t* decoder, const uint8_t* in, size_t in_size, uint8_t* out, size_t size);
+
+// True once everything up to in_size is decoded and handed out
+bool lzss_done(const lzss_decoder_t* decoder, size_t in_size);
+
+// Compresses size bytes of in, returns the stream size or 0 if out is too
+// small. Greedy and slow, meant for the host.
+size_t lzss_encode(const uint8_t* in, size_t size, uint8_t* out, size_t out_size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,127 @@
+#include "lzss.h"
+
+#include <string.h>
+
+#define WINDOW_MASK (LZSS_WINDOW - 1)
+#define LENGTH_MASK ((1 << LZSS_LENGTH_BITS) - 1)
+
+//--------------------------------------------------------------------+
+// Decoder
+//--------------------------------------------------------------------+
+
+void lzss_decoder_init(lzss_decoder_t* decoder) {
+    memset(decoder, 0, sizeof(*decoder));
+}
+
+static inline void emit(lzss_decoder_t* decoder, uint8_t byte) {
+    decoder->window[decoder->head] = byte;
+    decoder->head = (decoder->head + 1) & WINDOW_MASK;
+    if (decoder->filled < LZSS_WINDOW) decoder->filled++;
+}
+
+size_t lzss_decode(lzss_decoder_t* decoder, const uint8_t* in, size_t in_size, uint8_t* out, size_t size) {
+    size_t written = 0;
+
+    while (written < size && !decoder->error) {
+        if (decoder->copy) {
+            uint8_t byte = decoder->window[(decoder->head - decoder->distance) & WINDOW_MASK];
+            emit(decoder, byte);
+            out[written++] = byte;
+            decoder->copy--;
+            continue;
+        }
+
+        if (!decoder->items) {
+            if (decoder->in_pos == in_size) break;
+            decoder->flags = in[decoder->in_pos++];
+            decoder->items = 8;
+        }
+
+        // an item is only taken once all of it is there
+        if (decoder->flags & 1) {
+            if (decoder->in_pos == in_size) break;
+
+            uint8_t byte = in[decoder->in_pos++];
+            emit(decoder, byte);
+            out[written++] = byte;
+        } else {
+            if (in_size - decoder->in_pos < 2) break;
+
+            uint16_t token = (in[decoder->in_pos] << 8) | in[decoder->in_pos + 1];
+            decoder->distance = (token >> LZSS_LENGTH_BITS) + 1;
+            if (decoder->distance > decoder->filled) {
+                decoder->error = true;
+                break;
+            }
+
+            decoder->in_pos += 2;
+            decoder->copy = (token & LENGTH_MASK) + LZSS_MIN_MATCH;
+        }
+
+        decoder->flags >>= 1;
+        decoder->items--;
+    }
+
+    return written;
+}
+
+bool lzss_done(const lzss_decoder_t* decoder, size_t in_size) {
+    return !decoder->error && !decoder->copy && decoder->in_pos == in_size;
+}
+
+//--------------------------------------------------------------------+
+// Encoder
+//--------------------------------------------------------------------+
+
+size_t lzss_encode(const uint8_t* in, size_t size, uint8_t* out, size_t out_size) {
+    size_t pos = 0;
+    size_t used = 0;
+    size_t flags_at = 0;
+    uint8_t item = 8;
+
+    while (pos < size) {
+        if (item == 8) {
+            if (used == out_size) return 0;
+            flags_at = used;
+            out[used++] = 0;
+            item = 0;
+        }
+
+        size_t best_length = 0;
+        size_t best_distance = 0;
+        size_t limit = size - pos < LZSS_MAX_MATCH ? size - pos : LZSS_MAX_MATCH;
+        size_t reach = pos < LZSS_WINDOW ? pos : LZSS_WINDOW;
+
+        // nearest first, a longer match has to be strictly longer
+        for (size_t distance = 1; distance <= reach && best_length < limit; ++distance) {
+            const uint8_t* from = in + pos - distance;
+            size_t length = 0;
+
+            while (length < limit && from[length] == in[pos + length])
+                length++;
+
+            if (length > best_length) {
+                best_length = length;
+                best_distance = distance;
+            }
+        }
+
+        if (best_length >= LZSS_MIN_MATCH) {
+            if (out_size - used < 2) return 0;
+
+            uint16_t token = ((best_distance - 1) << LZSS_LENGTH_BITS) | (best_length - LZSS_MIN_MATCH);
+            out[used++] = token >> 8;
+            out[used++] = token & 0xFF;
+            pos += best_length;
+        } else {
+            if (used == out_size) return 0;
+
+            out[flags_at] |= 1 << item;
+            out[used++] = in[pos++];
+        }
+
+        item++;
+    }
+
+    return used;
+}
@@ -2,38 +2,59 @@
 
 // FreeRTOS
 #include "FreeRTOS.h"
-#include "queue.h"
 #include "task.h"
 
 // Pico
 #include "pico/stdlib.h"
 
 // Ditoo stack
+#include "boot.h"
 #include "bt.h"
 #include "cmd.h"
 #include "dev.h"
+#include "params.h"
 
-xQueueHandle bt_command_queue;
-xQueueHandle usb_command_queue;
+cmd_ring_t bt_command_ring;
+cmd_ring_t usb_command_ring;
+volatile uint32_t credits_returned;
 
 int main(void) {
+    boot_mark(BOOT_main);
     stdio_init_all();
-
-    TaskHandle_t bt_handle, usb_handle;
-    bt_command_queue = xQueueCreate(10, sizeof(command_t));
-    usb_command_queue = xQueueCreate(10, sizeof(command_t));
-
-    if (bt_command_queue == NULL)
-        printf("bt queue coudnt be created\n");
-    if (usb_command_queue == NULL)
-        printf("usb queue coudnt be created\n");
-
-    xTaskCreate(bt_client_task, "bt", BT_STACK_SIZE, NULL, configMAX_PRIORITIES - 1, &bt_handle);
-    xTaskCreate(usb_device_task, "usbd", USBD_STACK_SIZE, NULL, configMAX_PRIORITIES - 2, &usb_handle);
-    xTaskCreate(cdc_task, "cdc", CDC_STACK_SIZE, NULL, configMAX_PRIORITIES - 3, NULL);
+    telemetry_init();
+
+    params_load();
+    boot_mark(BOOT_params);
+
+    TaskHandle_t bt_handle, usb_handle, cdc_handle, telemetry_handle;
+
+#if DITOO_STATIC_ALLOC
+    // the stacks are part of the image, their size parameters do not apply
+    static StackType_t bt_stack[BT_STACK_SIZE];
+    static StackType_t usbd_stack[USBD_STACK_SIZE];
+    static StackType_t cdc_stack[CDC_STACK_SIZE];
+    static StackType_t telemetry_stack[TELEMETRY_STACK_SIZE];
+    static StaticTask_t bt_tcb, usbd_tcb, cdc_tcb, telemetry_tcb;
+
+    bt_handle = xTaskCreateStatic(bt_client_task, "bt", BT_STACK_SIZE, NULL, params.bt_priority, bt_stack, &bt_tcb);
+    usb_handle = xTaskCreateStatic(usb_device_task, "usbd", USBD_STACK_SIZE, NULL, params.usbd_priority, usbd_stack, &usbd_tcb);
+    cdc_handle = xTaskCreateStatic(cdc_task, "cdc", CDC_STACK_SIZE, NULL, params.cdc_priority, cdc_stack, &cdc_tcb);
+    telemetry_handle = xTaskCreateStatic(telemetry_task, "tlm", TELEMETRY_STACK_SIZE, NULL, params.telemetry_priority, telemetry_stack, &telemetry_tcb);
+#else
+    // a stack of 0 keeps the compiled in size
+    xTaskCreate(bt_client_task, "bt", params.bt_stack ? params.bt_stack : BT_STACK_SIZE, NULL, params.bt_priority, &bt_handle);
+    xTaskCreate(usb_device_task, "usbd", params.usbd_stack ? params.usbd_stack : USBD_STACK_SIZE, NULL, params.usbd_priority, &usb_handle);
+    xTaskCreate(cdc_task, "cdc", params.cdc_stack ? params.cdc_stack : CDC_STACK_SIZE, NULL, params.cdc_priority, &cdc_handle);
+    xTaskCreate(telemetry_task, "tlm", params.telemetry_stack ? params.telemetry_stack : TELEMETRY_STACK_SIZE, NULL, params.telemetry_priority, &telemetry_handle);
+#endif
 
     vTaskCoreAffinitySet(bt_handle, 1);
     vTaskCoreAffinitySet(usb_handle, 2);
+#if configUSE_TICKLESS_IDLE
+    // their timeouts have to end a tickless sleep, see FreeRTOSConfig.h
+    vTaskCoreAffinitySet(cdc_handle, 1 << configTICK_CORE);
+    vTaskCoreAffinitySet(telemetry_handle, 1 << configTICK_CORE);
+#endif
 
     vTaskStartScheduler();
 
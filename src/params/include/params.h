@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Runtime tunables.
+//
+// Every parameter is declared once below and becomes a typed field of
+// `params`, readable from any task. Writes go through params_set(), which
+// enforces the bounds. params_save() persists all values in a flash sector of
+// their own, params_load() restores them at boot, skipping values that are
+// unknown or out of bounds by now.
+//
+// CMD_CONFIG carries a msgpack map of parameter names to new values, plus
+//   "defaults"  true to reset everything to the defaults first
+//   "save"      true to persist the result
+// Nothing is changed if a value is unknown or out of bounds. The answer lists
+// every parameter as a map of names to values, split over several CMD_CONFIG
+// if needed, the last one also carries "status".
+//
+// Parameters marked (boot) only take effect after a restart, 0 selects the
+// compiled in value.
+
+// X(name, type, default, min, max)
+#define PARAMS(X)                                                                  \
+    X(heartbeat_ms, uint16_t, 1000, 10, 60000)                                     \
+    /* commands the host may have in flight, at most CMD_RING_SIZE */              \
+    X(credit_window, uint8_t, CMD_RING_SIZE, 1, CMD_RING_SIZE)                     \
+    /* LE scan, in 0.625 ms units, the window is capped by the interval */         \
+    X(scan_interval, uint16_t, 0x0030, 0x0004, 0x4000)                             \
+    X(scan_window, uint16_t, 0x0030, 0x0004, 0x4000)                               \
+    X(scan_active, uint8_t, 1, 0, 1)                                               \
+    /* classic inquiry round, in 1.28 s units */                                   \
+    X(inquiry_len, uint8_t, 4, 1, 0x30)                                            \
+    /* mpack stream trees of the USB clients, applied when a stream is reset */    \
+    X(cdc_max_nodes, uint16_t, 32, 8, 1024)                                        \
+    X(cdc_max_size, uint32_t, 32 * 1024, 1024, 64 * 1024)                          \
+    X(cdc_tx_delay_ms, uint8_t, 1, 0, 50)                                          \
+    /* commands per round-robin turn and share of the credit window */             \
+    X(cdc_weight, uint8_t, 1, 1, 16)                                               \
+    X(webusb_weight, uint8_t, 1, 1, 16)                                            \
+    /* quiet ACL link enters sniff under the balanced profile, 0 never */          \
+    X(sniff_idle_ms, uint16_t, 0, 0, 60000)                                        \
+    /* counters on the telemetry CDC, 0 sends the log only */                      \
+    X(telemetry_ms, uint16_t, 1000, 0, 60000)                                      \
+    /* s a repeated Divoom frame is not sent again, 0 sends every frame */         \
+    X(dedupe_s, uint16_t, 0, 0, 3600)                                              \
+    /* (boot) */                                                                   \
+    X(bt_priority, uint8_t, configMAX_PRIORITIES - 1, 1, configMAX_PRIORITIES - 1) \
+    X(usbd_priority, uint8_t, configMAX_PRIORITIES - 2, 1, configMAX_PRIORITIES - 1) \
+    X(cdc_priority, uint8_t, configMAX_PRIORITIES - 3, 1, configMAX_PRIORITIES - 1) \
+    X(telemetry_priority, uint8_t, 1, 1, configMAX_PRIORITIES - 1)                 \
+    /* in words, 0 keeps the compiled size, ignored with DITOO_STATIC_ALLOC */      \
+    X(bt_stack, uint16_t, 0, 0, 4096)                                              \
+    X(usbd_stack, uint16_t, 0, 0, 4096)                                            \
+    X(cdc_stack, uint16_t, 0, 0, 4096)                                             \
+    X(telemetry_stack, uint16_t, 0, 0, 4096)
+
+typedef struct {
+#define PARAM_FIELD(name, type, def, min, max) type name;
+    PARAMS(PARAM_FIELD)
+#undef PARAM_FIELD
+} params_t;
+
+typedef enum {
+#define PARAM_ID(name, type, def, min, max) PARAM_##name,
+    PARAMS(PARAM_ID)
+#undef PARAM_ID
+    PARAM_COUNT,
+} param_id_t;
+
+typedef struct {
+    const char* name;
+    uint8_t offset;
+    uint8_t size;
+    uint32_t def;
+    uint32_t min;
+    uint32_t max;
+} param_info_t;
+
+extern params_t params;
+
+// Defaults overlaid with what is stored in flash, call before the tasks start
+void params_load(void);
+bool params_save(void);
+void params_defaults(void);
+
+// -1 if there is no parameter with this name
+int params_find(const char* name, size_t length);
+const param_info_t* params_info(param_id_t id);
+
+uint32_t params_get(param_id_t id);
+// Returns false and leaves the value alone if it is out of bounds
+bool params_set(param_id_t id, uint32_t value);
@@ -0,0 +1,177 @@
+#include "params.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cmd.h"
+
+// FreeRTOS
+#include "FreeRTOS.h"
+
+// Pico
+#include "hardware/flash.h"
+#include "pico/flash.h"
+#include "pico/stdlib.h"
+
+// The sector right below the two sectors btstack keeps its TLV bank in
+#ifndef PARAMS_FLASH_OFFSET
+#define PARAMS_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - 3 * FLASH_SECTOR_SIZE)
+#endif
+
+#define PARAMS_MAGIC 0x4D525044  // "DPRM"
+#define PARAMS_VERSION 1
+#define PARAMS_SAVE_TIMEOUT_MS 100
+
+typedef struct {
+    // FNV-1a of the name, so stored values survive parameters being added
+    uint32_t key;
+    uint32_t value;
+} stored_param_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t checksum;
+    stored_param_t entries[PARAM_COUNT];
+} stored_params_t;
+
+_Static_assert(sizeof(stored_params_t) <= FLASH_PAGE_SIZE, "stored parameters must fit one flash page");
+
+params_t params;
+
+static const param_info_t info[PARAM_COUNT] = {
+#define PARAM_INFO(name, type, def, min, max) \
+    {#name, offsetof(params_t, name), sizeof(type), (def), (min), (max)},
+    PARAMS(PARAM_INFO)
+#undef PARAM_INFO
+};
+
+static uint32_t fnv1a(uint32_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    return hash;
+}
+
+static uint32_t key(const param_info_t* param) {
+    return fnv1a(2166136261u, param->name, strlen(param->name));
+}
+
+//--------------------------------------------------------------------+
+// Access
+//--------------------------------------------------------------------+
+
+int params_find(const char* name, size_t length) {
+    for (int i = 0; i < PARAM_COUNT; ++i)
+        if (strlen(info[i].name) == length && memcmp(info[i].name, name, length) == 0) return i;
+
+    return -1;
+}
+
+const param_info_t* params_info(param_id_t id) {
+    return &info[id];
+}
+
+uint32_t params_get(param_id_t id) {
+    const uint8_t* field = (const uint8_t*)&params + info[id].offset;
+
+    switch (info[id].size) {
+        case 1:
+            return *field;
+        case 2:
+            return *(const uint16_t*)field;
+        default:
+            return *(const uint32_t*)field;
+    }
+}
+
+bool params_set(param_id_t id, uint32_t value) {
+    if (value < info[id].min || value > info[id].max) return false;
+
+    // fields are naturally aligned, readers on the other core never see a
+    // torn value
+    uint8_t* field = (uint8_t*)&params + info[id].offset;
+
+    switch (info[id].size) {
+        case 1:
+            *field = value;
+            break;
+        case 2:
+            *(volatile uint16_t*)field = value;
+            break;
+        default:
+            *(volatile uint32_t*)field = value;
+            break;
+    }
+
+    return true;
+}
+
+void params_defaults(void) {
+    for (int i = 0; i < PARAM_COUNT; ++i)
+        params_set(i, info[i].def);
+}
+
+//--------------------------------------------------------------------+
+// Flash
+//--------------------------------------------------------------------+
+
+static uint32_t checksum(const stored_params_t* stored) {
+    return fnv1a(2166136261u, stored->entries, sizeof(stored_param_t) * stored->count);
+}
+
+void params_load(void) {
+    params_defaults();
+
+    const stored_params_t* stored = (const stored_params_t*)(XIP_BASE + PARAMS_FLASH_OFFSET);
+
+    if (stored->magic != PARAMS_MAGIC || stored->version != PARAMS_VERSION || stored->count > PARAM_COUNT ||
+        stored->checksum != checksum(stored)) {
+        printf("PARAMS: no stored parameters, using defaults\n");
+        return;
+    }
+
+    for (uint16_t i = 0; i < stored->count; ++i) {
+        for (int id = 0; id < PARAM_COUNT; ++id) {
+            if (key(&info[id]) != stored->entries[i].key) continue;
+
+            if (!params_set(id, stored->entries[i].value))
+                printf("PARAMS: stored %s out of bounds, using default\n", info[id].name);
+            break;
+        }
+    }
+
+    printf("PARAMS: %u parameters loaded from flash\n", stored->count);
+}
+
+static void program(void* data) {
+    flash_range_erase(PARAMS_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(PARAMS_FLASH_OFFSET, data, FLASH_PAGE_SIZE);
+}
+
+bool params_save(void) {
+    static uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xFF, sizeof(page));
+
+    stored_params_t* stored = (stored_params_t*)page;
+    stored->magic = PARAMS_MAGIC;
+    stored->version = PARAMS_VERSION;
+    stored->count = PARAM_COUNT;
+
+    for (int i = 0; i < PARAM_COUNT; ++i) {
+        stored->entries[i].key = key(&info[i]);
+        stored->entries[i].value = params_get(i);
+    }
+    stored->checksum = checksum(stored);
+
+    // parks the other core and keeps interrupts away from XIP while we write
+    int result = flash_safe_execute(&program, page, PARAMS_SAVE_TIMEOUT_MS);
+    if (result != PICO_OK) {
+        printf("PARAMS: saving failed (%d)\n", result);
+        return false;
+    }
+
+    return true;
+}
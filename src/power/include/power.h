@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Low power states and their accounting.
+//
+// The adapter cannot measure its own current draw, instead it keeps the time
+// spent in every state. Multiplied with the draw of each state, measured once
+// on the bench, that gives the energy of a session.
+//
+//   active     host commands or Ditoo frames within the last POWER_QUIET_MS
+//   idle       nothing moved for longer, the tasks are blocked
+//   suspended  the host suspended the USB bus
+//
+// Both cores halt in their idle hooks, with DITOO_TICKLESS_IDLE (a build
+// option, off by default) the tick core also stops the tick while every task
+// waits. While suspended the cdc task
+// drops its timeouts and the bt task pauses discovery and its heartbeat. The
+// ACL link is tracked on its own, see link.h for sniffing while it is quiet.
+//
+// CMD_POWER, answered by the cdc task with a msgpack map:
+//   "state"              current state
+//   "uptime_ms"          time since reset
+//   "active_ms"          time spent in each state
+//   "idle_ms"
+//   "suspended_ms"
+//   "suspends"           bus suspends so far
+//   "sleep_ms"           array of the time each core spent halted
+//   "link_active_ms"     time an ACL link spent in active and in sniff mode
+//   "link_sniff_ms"
+//   "sniff_exits"        quiet sniffs left for traffic
+//   "sniff_exit_max_us"  longest time from that traffic to the link being active
+
+#define POWER_QUIET_MS 100
+
+typedef enum {
+    POWER_ACTIVE = 0,
+    POWER_IDLE,
+    POWER_SUSPENDED,
+    POWER_STATES,
+} power_state_t;
+
+typedef struct {
+    power_state_t state;
+    uint32_t uptime_ms;
+    uint32_t residency_ms[POWER_STATES];
+    uint32_t suspends;
+    uint32_t sleep_ms[2];
+    uint32_t link_active_ms;
+    uint32_t link_sniff_ms;
+    uint32_t sniff_exits;
+    uint32_t sniff_exit_max_us;
+} power_stats_t;
+
+// Binds the idle tasks to their cores, call once the scheduler runs
+void power_init(void);
+
+// Called by the usbd task on bus suspend and resume, wake is called after
+// every change
+void power_set_suspended(bool suspended);
+bool power_suspended(void);
+void power_set_wake(void (*wake)(void));
+
+// Marks traffic, callable from any task
+void power_activity(void);
+
+// ACL link mode, fed by the bt task
+void power_link_open(void);
+void power_link_mode(bool sniff);
+void power_link_close(void);
+void power_sniff_exit(uint32_t us);
+
+const char* power_state_name(power_state_t state);
+void power_stats(power_stats_t* stats);
+
+// configPRE_SLEEP_PROCESSING and configPOST_SLEEP_PROCESSING
+void power_sleep_begin(void);
+void power_sleep_end(void);
@@ -0,0 +1,221 @@
+#include "power.h"
+
+// FreeRTOS
+#include "FreeRTOS.h"
+#include "task.h"
+
+// Pico
+#include "hardware/sync.h"
+#include "pico/stdlib.h"
+
+#define US_TO_MS(us) ((uint32_t)((us) / 1000))
+
+static const char* const state_names[POWER_STATES] = {
+    [POWER_ACTIVE] = "active",
+    [POWER_IDLE] = "idle",
+    [POWER_SUSPENDED] = "suspended",
+};
+
+// guarded by the kernel's critical section, times in us since reset
+static struct {
+    power_state_t state;
+    uint64_t since;
+    uint64_t residency[POWER_STATES];
+    uint64_t last_activity;
+    uint32_t suspends;
+
+    bool connected;
+    bool sniff;
+    uint64_t link_since;
+    uint64_t link_active;
+    uint64_t link_sniff;
+    uint32_t sniff_exits;
+    uint32_t sniff_exit_max_us;
+} power;
+
+static volatile bool suspended;
+static void (*wake_fn)(void);
+
+// each written by the idle task of its own core only
+static volatile uint64_t sleep_us[NUM_CORES];
+static uint64_t sleep_start;
+
+//--------------------------------------------------------------------+
+// States
+//--------------------------------------------------------------------+
+
+static void enter(power_state_t state, uint64_t at) {
+    power.residency[power.state] += at - power.since;
+    power.state = state;
+    power.since = at;
+}
+
+// The switch to idle happens without anybody noticing, it is put in place
+// the next time the state is looked at
+static void settle(uint64_t now) {
+    uint64_t quiet_at = power.last_activity + POWER_QUIET_MS * 1000;
+
+    if (power.state == POWER_ACTIVE && now >= quiet_at) enter(POWER_IDLE, quiet_at);
+}
+
+static void link_settle(uint64_t now) {
+    if (!power.connected) return;
+
+    if (power.sniff)
+        power.link_sniff += now - power.link_since;
+    else
+        power.link_active += now - power.link_since;
+
+    power.link_since = now;
+}
+
+void power_init(void) {
+#if configNUMBER_OF_CORES > 1
+    // only the tick core may stop the tick, and the sleep of each core is
+    // accounted to the core its idle task runs on
+    for (BaseType_t core = 0; core < configNUMBER_OF_CORES; ++core)
+        vTaskCoreAffinitySet(xTaskGetIdleTaskHandleForCore(core), 1 << core);
+#endif
+}
+
+void power_set_suspended(bool value) {
+    uint64_t now = time_us_64();
+
+    taskENTER_CRITICAL();
+    bool changed = suspended != value;
+    if (changed) {
+        settle(now);
+        suspended = value;
+        if (value) {
+            power.suspends++;
+            enter(POWER_SUSPENDED, now);
+        } else {
+            // resuming is traffic, whatever woke the host comes next
+            enter(POWER_ACTIVE, now);
+            power.last_activity = now;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    if (changed && wake_fn) wake_fn();
+}
+
+bool power_suspended(void) {
+    return suspended;
+}
+
+void power_set_wake(void (*wake)(void)) {
+    wake_fn = wake;
+}
+
+void power_activity(void) {
+    uint64_t now = time_us_64();
+
+    taskENTER_CRITICAL();
+    settle(now);
+    if (power.state == POWER_IDLE) enter(POWER_ACTIVE, now);
+    power.last_activity = now;
+    taskEXIT_CRITICAL();
+}
+
+//--------------------------------------------------------------------+
+// ACL link
+//--------------------------------------------------------------------+
+
+void power_link_open(void) {
+    taskENTER_CRITICAL();
+    power.connected = true;
+    power.sniff = false;
+    power.link_since = time_us_64();
+    taskEXIT_CRITICAL();
+}
+
+void power_link_mode(bool sniff) {
+    taskENTER_CRITICAL();
+    link_settle(time_us_64());
+    power.sniff = sniff;
+    taskEXIT_CRITICAL();
+}
+
+void power_link_close(void) {
+    taskENTER_CRITICAL();
+    link_settle(time_us_64());
+    power.connected = false;
+    taskEXIT_CRITICAL();
+}
+
+void power_sniff_exit(uint32_t us) {
+    taskENTER_CRITICAL();
+    power.sniff_exits++;
+    if (us > power.sniff_exit_max_us) power.sniff_exit_max_us = us;
+    taskEXIT_CRITICAL();
+}
+
+//--------------------------------------------------------------------+
+// Report
+//--------------------------------------------------------------------+
+
+const char* power_state_name(power_state_t state) {
+    return state_names[state];
+}
+
+void power_stats(power_stats_t* stats) {
+    uint64_t now = time_us_64();
+
+    taskENTER_CRITICAL();
+    settle(now);
+    link_settle(now);
+
+    stats->state = power.state;
+    stats->uptime_ms = US_TO_MS(now);
+    for (int i = 0; i < POWER_STATES; ++i) {
+        uint64_t us = power.residency[i];
+        if (i == power.state) us += now - power.since;
+        stats->residency_ms[i] = US_TO_MS(us);
+    }
+    stats->suspends = power.suspends;
+    stats->link_active_ms = US_TO_MS(power.link_active);
+    stats->link_sniff_ms = US_TO_MS(power.link_sniff);
+    stats->sniff_exits = power.sniff_exits;
+    stats->sniff_exit_max_us = power.sniff_exit_max_us;
+    taskEXIT_CRITICAL();
+
+    for (int core = 0; core < NUM_CORES; ++core)
+        stats->sleep_ms[core] = US_TO_MS(sleep_us[core]);
+}
+
+//--------------------------------------------------------------------+
+// Idle
+//--------------------------------------------------------------------+
+
+// Halts the core until the next interrupt, which is taken once the time is
+// accounted
+static void halt(void) {
+    uint32_t save = save_and_disable_interrupts();
+    uint64_t start = time_us_64();
+
+    __wfi();
+
+    sleep_us[get_core_num()] += time_us_64() - start;
+    restore_interrupts(save);
+}
+
+void vApplicationIdleHook(void) {
+    // the tick core sleeps in portSUPPRESS_TICKS_AND_SLEEP instead
+#if !configUSE_TICKLESS_IDLE
+    halt();
+#endif
+}
+
+void vApplicationPassiveIdleHook(void) {
+    halt();
+}
+
+// interrupts are disabled in between
+void power_sleep_begin(void) {
+    sleep_start = time_us_64();
+}
+
+void power_sleep_end(void) {
+    sleep_us[get_core_num()] += time_us_64() - sleep_start;
+}
@@ -2,9 +2,22 @@
 
 #include <stdio.h>
 
+#include "boot.h"
+#include "capture.h"
 #include "cmd.h"
+#if DITOO_STATIC_ALLOC
+#include "arena.h"
+#endif
+#include "params.h"
+#include "power.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "usb_descriptors.h"
 
+// FreeRTOS
+#include "FreeRTOS.h"
+#include "task.h"
+
 // mpack
 #include "mpack/mpack.h"
 
@@ -25,133 +38,1055 @@ const tusb_desc_webusb_url_t desc_url = {
     .url = URL,
 };
 
-static bool web_serial_connected = false;
+static volatile bool web_serial_connected = false;
+static TaskHandle_t cdc_handle;
 
 //--------------------------------------------------------------------+
 // Main
 //--------------------------------------------------------------------+
 
 void usb_device_task(__unused void* param) {
-    board_init();
+    boot_mark(BOOT_scheduler);
+    power_init();
 
     tusb_rhport_init_t dev_init = {
         .role = TUSB_ROLE_DEVICE,
         .speed = TUSB_SPEED_AUTO,
     };
 
+    // attach first, the host debounces the connection and resets the bus
+    // while the board and, on the other core, the radio come up
     tusb_init(BOARD_TUD_RHPORT, &dev_init);
+    boot_mark(BOOT_usb_init);
+
+    board_init();
 
     if (board_init_after_tusb)
         board_init_after_tusb();
 
-    while (true) {
+    boot_mark(BOOT_usb_board);
+
+    // writers flush themselves, the cdc task batches its replies on purpose.
+    // Blocks on the event queue, this core halts until the next interrupt.
+    while (true)
         tud_task();
+}
+
+//--------------------------------------------------------------------+
+// Device callbacks
+//--------------------------------------------------------------------+
+
+void tud_mount_cb(void) {
+    boot_mark(BOOT_usb_mounted);
+    // the bus may idle into a suspend before the host enumerates us
+    power_set_suspended(false);
+}
+
+void tud_umount_cb() {}
+
+// The adapter never wakes the host, replies wait in the FIFOs until it resumes
+void tud_suspend_cb(bool remote_wakeup_en) {
+    printf("USB: bus suspended\n");
+    power_set_suspended(true);
+}
+
+void tud_resume_cb(void) {
+    printf("USB: bus resumed\n");
+    power_set_suspended(false);
+
+    // pending replies are due again
+    if (cdc_handle) xTaskNotifyGive(cdc_handle);
+    telemetry_wake();
+}
+
+//--------------------------------------------------------------------+
+// USB CDC
+//--------------------------------------------------------------------+
+
+// Hex dump every received command on UART, this limits the ingest rate to the
+// UART baud rate
+#define DUMP_COMMANDS 0
+
+// Replies are collected in the TX FIFOs and flushed together, a partial packet
+// waits at most params.cdc_tx_delay_ms for more replies before it goes out.
+// Full packets are sent as soon as they are complete.
+
+// ext header and [id, ext] envelope take at most 9 bytes
+#define MAX_MESSAGE_SIZE (sizeof(((command_t*)0)->data) + 9)
+
+typedef struct {
+    bool pending;           // bytes in the FIFO that were not flushed yet
+    volatile bool blocked;  // the last message did not fit into the FIFO
+    TickType_t since;
+
+    uint32_t messages;
+    uint32_t bytes;
+    // messages for every client that did not fit into the FIFO
+    uint32_t dropped;
+
+    // snapshot of the last CMD_STATS for the rates
+    TickType_t stats_tick;
+    uint32_t stats_transfers;
+    uint32_t stats_bytes;
+} cdc_tx_t;
+
+// The data CDC and the WebUSB interface are both clients of the protocol. Each
+// has its own stream tree, TX FIFO, share of the credit window and counters.
+// Their commands enter bt_command_ring round-robin, up to params.cdc_weight
+// and params.webusb_weight per round, and the window is split by the same
+// weights among the connected clients. Replies find their client by the
+// request id, see cmd_id_tag(), anything without one goes to every client.
+typedef enum {
+    CLIENT_CDC = 0,
+    CLIENT_WEBUSB,
+    CLIENTS,
+} client_id_t;
+
+typedef struct {
+    const char* name;
+    param_id_t weight;
+
+    bool (*connected)(void);
+    uint32_t (*available)(void);
+    uint32_t (*read)(void* buf, uint32_t count);
+    uint32_t (*write_available)(void);
+    uint32_t (*write)(const void* buf, uint32_t count);
+    uint32_t (*write_flush)(void);
+
+    mpack_tree_t tree;
+    cdc_tx_t tx;
+    // IN transfers completed, counted by the usbd task. A transfer carries up
+    // to the endpoint buffer, that is one or more USB packets.
+    volatile uint32_t tx_transfers;
+
+    // the port was opened, hand over a fresh window
+    volatile bool credit_sync;
+    // credits the bt task returned that were not passed on yet
+    uint16_t credits;
+
+    uint32_t rx_commands;
+    uint32_t rx_bytes;
+    uint32_t busy;
+} client_t;
+
+static bool webusb_connected(void) {
+    return web_serial_connected;
+}
 
-        tud_vendor_write_flush();
-        tud_cdc_write_flush();
+static client_t clients[CLIENTS] = {
+    [CLIENT_CDC] =
+        {
+            .name = "cdc",
+            .weight = PARAM_cdc_weight,
+            .connected = &tud_cdc_connected,
+            .available = &tud_cdc_available,
+            .read = &tud_cdc_read,
+            .write_available = &tud_cdc_write_available,
+            .write = &tud_cdc_write,
+            .write_flush = &tud_cdc_write_flush,
+        },
+    [CLIENT_WEBUSB] =
+        {
+            .name = "webusb",
+            .weight = PARAM_webusb_weight,
+            .connected = &webusb_connected,
+            .available = &tud_vendor_available,
+            .read = &tud_vendor_read,
+            .write_available = &tud_vendor_write_available,
+            .write = &tud_vendor_write,
+            .write_flush = &tud_vendor_write_flush,
+        },
+};
+
+// Owners of the commands in bt_command_ring in ring order, the bt task returns
+// their credits in the same order
+static uint8_t owners[CMD_RING_SIZE];
+static uint32_t owners_head;
+static uint32_t owners_tail;
+// the bt task's credit count as of the last collect_credits
+static uint32_t credits_reported;
+
+// A live capture stream is polled at this interval, the bt task does not wake
+// us for every HCI packet
+#define CAPTURE_POLL_MS 10
+
+static bool capture_streaming;
+static bool capture_header_sent;
+static client_t* capture_client;
+
+static void cdc_wake(void) {
+    xTaskNotifyGive(cdc_handle);
+}
+
+static uint8_t client_weight(const client_t* client) {
+    return params_get(client->weight);
+}
+
+// Drains as much of the RX FIFO as fits straight into the tree's buffer, the
+// FIFO and the endpoint buffer keep receiving while the tree is parsed.
+static size_t read_client(mpack_tree_t* tree, char* buf, size_t count) {
+    client_t* client = mpack_tree_context(tree);
+
+    uint32_t available = client->available();
+    if (!available) return 0;
+
+    count = client->read(buf, MIN(available, count));
+    client->rx_bytes += count;
+
+    return count;
+}
+
+static void client_open_tree(client_t* client) {
+    mpack_tree_init_stream(&client->tree, read_client, client, params.cdc_max_size, params.cdc_max_nodes);
+}
+
+// Without DTR nobody reads the CDC and its FIFO overwrites the oldest bytes,
+// waiting for room would only stall the bt task. Nothing is written to a
+// closed WebUSB interface.
+static bool tx_has_room(const client_t* client, size_t count) {
+    return !client->connected() || client->write_available() >= count;
+}
+
+static bool tx_wanted(const client_t* client) {
+    return client == &clients[CLIENT_CDC] || client->connected();
+}
+
+// Queues an encoded message in the client's TX FIFO, returns false without
+// writing anything if it does not fit
+static bool write_raw(client_t* client, const void* data, size_t count) {
+    if (!tx_wanted(client)) return true;
+
+    // never split a message, the host would lose track of the stream
+    if (!tx_has_room(client, count)) {
+        client->tx.blocked = true;
+        return false;
     }
+
+    client->write(data, count);
+
+    if (!client->tx.pending) {
+        client->tx.pending = true;
+        client->tx.since = xTaskGetTickCount();
+    }
+    client->tx.messages++;
+    client->tx.bytes += count;
+
+    return true;
 }
 
-void echo_all(const uint8_t buf[], uint32_t count) {
-    // echo to web serial
-    if (web_serial_connected) {
-        tud_vendor_write(buf, count);
-        tud_vendor_write_flush();
+// Same for cmd, with the client tag stripped from its id
+static bool write_command(client_t* client, const command_t* cmd) {
+    char buf[MAX_MESSAGE_SIZE];
+    const void* data = cmd->data;
+    size_t count = cmd->length;
+
+    if (cmd->type != MPACK) {
+        count = command_to_mpack_id(cmd, cmd->id & CMD_ID_MASK, buf, sizeof(buf));
+        data = buf;
+
+        if (count == 0) {
+            printf("USB: An error occurred encoding the mpack data!\n");
+            return true;
+        }
     }
 
-    // echo to cdc
-    if (tud_cdc_connected()) {
-        for (uint32_t i = 0; i < count; i++) {
-            tud_cdc_write_char(buf[i]);
-            if (buf[i] == '\r') {
-                tud_cdc_write_char('\n');
-            }
+    return write_raw(client, data, count);
+}
+
+// Writes to every client with room for the message. One that does not read
+// its port misses it instead of holding up the others.
+static void broadcast_raw(const void* data, size_t count) {
+    for (int i = 0; i < CLIENTS; ++i) {
+        client_t* client = &clients[i];
+        if (!tx_wanted(client)) continue;
+
+        if (!tx_has_room(client, count)) {
+            client->tx.dropped++;
+            continue;
         }
-        tud_cdc_write_flush();
+
+        write_raw(client, data, count);
     }
 }
 
-//--------------------------------------------------------------------+
-// Device callbacks
-//--------------------------------------------------------------------+
+// Parses the object of a batch at offset into part, returns its size or 0 if
+// the batch is broken. routed tells whether it belongs to a single client.
+static size_t batch_part(const command_t* batch, size_t offset, command_t* part, bool* routed) {
+    mpack_node_data_t pool[8];
+    mpack_tree_t tree;
 
-void tud_mount_cb(void) {}
-void tud_umount_cb() {}
+    mpack_tree_init_pool(&tree, (const char*)batch->data + offset, batch->length - offset, pool,
+                         sizeof(pool) / sizeof(pool[0]));
+    mpack_tree_parse(&tree);
+
+    size_t size = mpack_tree_size(&tree);
+    mpack_node_t root = mpack_tree_root(&tree);
+
+    if (mpack_tree_error(&tree) != mpack_ok) size = 0;
+    if (size) *routed = mpack_to_command(&root, part) == 0 && part->id;
+
+    mpack_tree_destroy(&tree);
+    return size;
+}
+
+// A batch of the bt task holds messages for both clients, it is split into
+// its objects. Only the clients it holds replies for need room for them, so
+// that none of them is written twice once the batch is retried. Stripping the
+// tags never makes an object larger.
+static bool route_batch(const command_t* batch) {
+    size_t needed[CLIENTS] = {0};
+    command_t part;
+    bool routed;
+
+    for (size_t offset = 0, size; offset < batch->length; offset += size) {
+        size = batch_part(batch, offset, &part, &routed);
+        if (!size) break;
+        if (routed) needed[cmd_id_client(part.id)] += size;
+    }
+
+    for (int i = 0; i < CLIENTS; ++i) {
+        if (needed[i] && tx_wanted(&clients[i]) && !tx_has_room(&clients[i], needed[i])) {
+            clients[i].tx.blocked = true;
+            return false;
+        }
+    }
+
+    for (size_t offset = 0, size; offset < batch->length; offset += size) {
+        size = batch_part(batch, offset, &part, &routed);
+
+        if (!size) {
+            printf("USB: An error occurred splitting a batch!\n");
+            break;
+        }
+
+        if (routed)
+            write_command(&clients[cmd_id_client(part.id)], &part);
+        else
+            broadcast_raw((const char*)batch->data + offset, size);
+    }
+
+    return true;
+}
+
+// Hands a message of the bt task to the client it belongs to
+static bool route(const command_t* cmd) {
+    if (cmd->type == MPACK) {
+        // nothing to split while the CDC is the only client
+        if (!clients[CLIENT_WEBUSB].connected()) return write_command(&clients[CLIENT_CDC], cmd);
+
+        return route_batch(cmd);
+    }
+
+    if (!cmd->id) {
+        char buf[MAX_MESSAGE_SIZE];
+        size_t count = command_to_mpack(cmd, buf, sizeof(buf));
+
+        if (count == 0) {
+            printf("USB: An error occurred encoding the mpack data!\n");
+            return true;
+        }
+
+        broadcast_raw(buf, count);
+        return true;
+    }
+
+    return write_command(&clients[cmd_id_client(cmd->id)], cmd);
+}
+
+static void flush_tx(client_t* client) {
+    TickType_t waited = xTaskGetTickCount() - client->tx.since;
+
+    if (client->tx.pending && (client->tx.blocked || waited >= pdMS_TO_TICKS(params.cdc_tx_delay_ms))) {
+        client->write_flush();
+        client->tx.pending = false;
+    }
+}
+
+// Ticks until the pending bytes have to be flushed
+static TickType_t tx_timeout(const client_t* client) {
+    if (!client->tx.pending) return portMAX_DELAY;
+
+    TickType_t waited = xTaskGetTickCount() - client->tx.since;
+    TickType_t delay = pdMS_TO_TICKS(params.cdc_tx_delay_ms);
+
+    return waited >= delay ? 0 : delay - waited;
+}
+
+static TickType_t wait_timeout(void) {
+    // nothing leaves a suspended bus, resuming wakes us
+    if (power_suspended()) return portMAX_DELAY;
+
+    TickType_t timeout = portMAX_DELAY;
+
+    for (int i = 0; i < CLIENTS; ++i)
+        timeout = MIN(timeout, tx_timeout(&clients[i]));
+
+    if (capture_streaming) timeout = MIN(timeout, pdMS_TO_TICKS(CAPTURE_POLL_MS));
+
+    return timeout;
+}
+
+static void write_credits(client_t* client, uint16_t credits, bool grant) {
+    command_t cmd = {.type = CMD_CREDIT, .length = grant ? 3 : 2};
+    cmd.data[0] = credits & 0xFF;
+    cmd.data[1] = credits >> 8;
+    cmd.data[2] = FLOW_GRANT;
+
+    write_command(client, &cmd);
+}
+
+// Hands the credits the bt task returned to the clients whose commands it
+// finished
+static void collect_credits(void) {
+    uint16_t credits = flow_take_credits(&credits_reported);
+
+    for (; credits && owners_tail != owners_head; --credits)
+        clients[owners[owners_tail++ % CMD_RING_SIZE]].credits++;
+}
+
+// Commands of the client that are still in bt_command_ring
+static uint32_t client_queued(const client_t* client) {
+    uint32_t queued = 0;
+
+    for (uint32_t i = owners_tail; i != owners_head; ++i)
+        queued += &clients[owners[i % CMD_RING_SIZE]] == client;
+
+    return queued;
+}
+
+// The client's part of params.credit_window, split by weight among the
+// connected clients and at least one
+static uint32_t credit_share(const client_t* client) {
+    uint32_t total = 0;
+
+    for (int i = 0; i < CLIENTS; ++i) {
+        if (&clients[i] == client || clients[i].connected()) total += client_weight(&clients[i]);
+    }
+
+    uint32_t share = params.credit_window * client_weight(client) / total;
+    return share ? share : 1;
+}
+
+// Grants the client what is left of its share in bt_command_ring, credits
+// that were still on their way back are part of that. A frame the bt task
+// holds until RFCOMM takes it still has its owner entry and counts as queued.
+static void sync_credits(client_t* client) {
+    collect_credits();
+    client->credits = 0;
+
+    uint32_t share = credit_share(client);
+    uint32_t queued = client_queued(client);
+    write_credits(client, share > queued ? share - queued : 0, true);
+}
+
+// Answers CMD_STATS with a map of the client's counters, the rates cover the
+// time since its previous CMD_STATS
+static void write_stats(client_t* client, uint16_t id) {
+    command_t cmd = {.type = CMD_STATS, .id = id};
+    cdc_tx_t* tx = &client->tx;
+
+    TickType_t now = xTaskGetTickCount();
+    uint32_t transfers = client->tx_transfers;
+
+    uint32_t interval_ms = (now - tx->stats_tick) * portTICK_PERIOD_MS;
+    uint32_t interval_transfers = transfers - tx->stats_transfers;
+    uint32_t interval_bytes = tx->bytes - tx->stats_bytes;
+
+    tx->stats_tick = now;
+    tx->stats_transfers = transfers;
+    tx->stats_bytes = tx->bytes;
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char*)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "interval_ms");
+    mpack_write_u32(&writer, interval_ms);
+    mpack_write_cstr(&writer, "tx_messages");
+    mpack_write_u32(&writer, tx->messages);
+    mpack_write_cstr(&writer, "tx_bytes");
+    mpack_write_u32(&writer, tx->bytes);
+    mpack_write_cstr(&writer, "tx_transfers");
+    mpack_write_u32(&writer, transfers);
+    mpack_write_cstr(&writer, "tx_transfers_per_s");
+    mpack_write_u32(&writer, interval_ms ? (uint64_t)interval_transfers * 1000 / interval_ms : 0);
+    mpack_write_cstr(&writer, "tx_bytes_per_transfer");
+    mpack_write_u32(&writer, interval_transfers ? interval_bytes / interval_transfers : 0);
+#if DITOO_STATIC_ALLOC
+    // the stream trees are the only thing allocating at runtime
+    mpack_write_cstr(&writer, "arena_used");
+    mpack_write_u32(&writer, arena_used());
+    mpack_write_cstr(&writer, "arena_peak");
+    mpack_write_u32(&writer, arena_peak());
+#else
+    mpack_write_cstr(&writer, "heap_free");
+    mpack_write_u32(&writer, xPortGetFreeHeapSize());
+    mpack_write_cstr(&writer, "heap_min_free");
+    mpack_write_u32(&writer, xPortGetMinimumEverFreeHeapSize());
+#endif
+    mpack_complete_map(&writer);
+
+    cmd.length = mpack_writer_buffer_used(&writer);
+
+    if (mpack_writer_destroy(&writer) != mpack_ok) {
+        printf("USB: An error occurred encoding the stats!\n");
+        return;
+    }
+
+    write_command(client, &cmd);
+}
+
+static void write_boot(client_t* client, uint16_t id) {
+    command_t cmd = {.type = CMD_BOOT, .id = id};
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char*)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    for (int i = 0; i < BOOT_COUNT; ++i) {
+        uint32_t us = boot_time_us(i);
+        if (!us) continue;
+
+        mpack_write_cstr(&writer, boot_name(i));
+        mpack_write_u32(&writer, us);
+    }
+    if (boot_ready_us()) {
+        mpack_write_cstr(&writer, "ready");
+        mpack_write_u32(&writer, boot_ready_us());
+    }
+    mpack_complete_map(&writer);
 
-void tud_suspend_cb(bool remote_wakeup_en) {}
-void tud_resume_cb(void) {}
+    cmd.length = mpack_writer_buffer_used(&writer);
+
+    if (mpack_writer_destroy(&writer) != mpack_ok) {
+        printf("USB: An error occurred encoding the boot milestones!\n");
+        return;
+    }
+
+    write_command(client, &cmd);
+}
+
+static void write_power(client_t* client, uint16_t id) {
+    command_t cmd = {.type = CMD_POWER, .id = id};
+
+    power_stats_t stats;
+    power_stats(&stats);
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char*)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "state");
+    mpack_write_cstr(&writer, power_state_name(stats.state));
+    mpack_write_cstr(&writer, "uptime_ms");
+    mpack_write_u32(&writer, stats.uptime_ms);
+    mpack_write_cstr(&writer, "active_ms");
+    mpack_write_u32(&writer, stats.residency_ms[POWER_ACTIVE]);
+    mpack_write_cstr(&writer, "idle_ms");
+    mpack_write_u32(&writer, stats.residency_ms[POWER_IDLE]);
+    mpack_write_cstr(&writer, "suspended_ms");
+    mpack_write_u32(&writer, stats.residency_ms[POWER_SUSPENDED]);
+    mpack_write_cstr(&writer, "suspends");
+    mpack_write_u32(&writer, stats.suspends);
+    mpack_write_cstr(&writer, "sleep_ms");
+    mpack_build_array(&writer);
+    for (size_t core = 0; core < count_of(stats.sleep_ms); ++core)
+        mpack_write_u32(&writer, stats.sleep_ms[core]);
+    mpack_complete_array(&writer);
+    mpack_write_cstr(&writer, "link_active_ms");
+    mpack_write_u32(&writer, stats.link_active_ms);
+    mpack_write_cstr(&writer, "link_sniff_ms");
+    mpack_write_u32(&writer, stats.link_sniff_ms);
+    mpack_write_cstr(&writer, "sniff_exits");
+    mpack_write_u32(&writer, stats.sniff_exits);
+    mpack_write_cstr(&writer, "sniff_exit_max_us");
+    mpack_write_u32(&writer, stats.sniff_exit_max_us);
+    mpack_complete_map(&writer);
+
+    cmd.length = mpack_writer_buffer_used(&writer);
+
+    if (mpack_writer_destroy(&writer) != mpack_ok) {
+        printf("USB: An error occurred encoding the power stats!\n");
+        return;
+    }
+
+    write_command(client, &cmd);
+}
+
+static void write_config_status(client_t* client, uint16_t id, const char* status) {
+    command_t cmd = {.type = CMD_CONFIG, .id = id};
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char*)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "status");
+    mpack_write_cstr(&writer, status);
+    mpack_complete_map(&writer);
+
+    cmd.length = mpack_writer_buffer_used(&writer);
+    if (mpack_writer_destroy(&writer) == mpack_ok) write_command(client, &cmd);
+}
+
+// Lists every parameter in as few messages as possible, the last one carries
+// the status
+static void write_config(client_t* client, uint16_t id, const char* status) {
+    int next = 0;
+
+    while (next < PARAM_COUNT) {
+        // map header, the status and per parameter its name and a u32 at most
+        size_t size = 3 + 8 + strlen(status) + 1;
+        int end = next;
+
+        for (; end < PARAM_COUNT; ++end) {
+            size_t entry = strlen(params_info(end)->name) + 1 + 5;
+            if (size + entry > sizeof(((command_t*)0)->data)) break;
+            size += entry;
+        }
+
+        bool last = end == PARAM_COUNT;
+        command_t cmd = {.type = CMD_CONFIG, .id = id};
+
+        mpack_writer_t writer;
+        mpack_writer_init(&writer, (char*)cmd.data, sizeof(cmd.data));
+
+        mpack_start_map(&writer, end - next + (last ? 1 : 0));
+        for (int i = next; i < end; ++i) {
+            mpack_write_cstr(&writer, params_info(i)->name);
+            mpack_write_u32(&writer, params_get(i));
+        }
+        if (last) {
+            mpack_write_cstr(&writer, "status");
+            mpack_write_cstr(&writer, status);
+        }
+        mpack_finish_map(&writer);
+
+        cmd.length = mpack_writer_buffer_used(&writer);
+
+        if (mpack_writer_destroy(&writer) != mpack_ok) {
+            printf("USB: An error occurred encoding the parameters!\n");
+            return;
+        }
+
+        write_command(client, &cmd);
+        next = end;
+    }
+}
+
+// Applies a CMD_CONFIG, all values are checked before the first one is set
+static void handle_config(client_t* client, const command_t* cmd) {
+    mpack_node_data_t pool[2 * PARAM_COUNT + 8];
+    mpack_tree_t tree;
+
+    if (cmd->length == 0) {
+        write_config(client, cmd->id, "ok");
+        return;
+    }
+
+    mpack_tree_init_pool(&tree, (const char*)cmd->data, cmd->length, pool, sizeof(pool) / sizeof(pool[0]));
+    mpack_tree_parse(&tree);
+
+    mpack_node_t root = mpack_tree_root(&tree);
+    if (mpack_node_type(root) != mpack_type_map) {
+        mpack_tree_destroy(&tree);
+        write_config_status(client, cmd->id, "invalid");
+        return;
+    }
+
+    const char* error = NULL;
+    bool defaults = false;
+    bool save = false;
+
+    size_t count = mpack_node_map_count(root);
+    for (size_t i = 0; i < count && !error; ++i) {
+        mpack_node_t key = mpack_node_map_key_at(root, i);
+        mpack_node_t value = mpack_node_map_value_at(root, i);
+        const char* name = mpack_node_str(key);
+        size_t length = mpack_node_strlen(key);
+
+        if (length == 8 && memcmp(name, "defaults", 8) == 0) {
+            defaults = mpack_node_bool(value);
+        } else if (length == 4 && memcmp(name, "save", 4) == 0) {
+            save = mpack_node_bool(value);
+        } else {
+            int id = params_find(name, length);
+            uint32_t v = mpack_node_u32(value);
+
+            if (id < 0)
+                error = "unknown parameter";
+            else if (v < params_info(id)->min || v > params_info(id)->max)
+                error = "out of bounds";
+        }
+    }
+
+    if (!error && mpack_tree_error(&tree) != mpack_ok) error = "invalid";
+
+    if (!error) {
+        if (defaults) params_defaults();
+
+        for (size_t i = 0; i < count; ++i) {
+            mpack_node_t key = mpack_node_map_key_at(root, i);
+            int id = params_find(mpack_node_str(key), mpack_node_strlen(key));
+            if (id >= 0) params_set(id, mpack_node_u32(mpack_node_map_value_at(root, i)));
+        }
+
+        if (save && !params_save()) error = "save failed";
+    }
+
+    mpack_tree_destroy(&tree);
+
+    if (error)
+        write_config_status(client, cmd->id, error);
+    else
+        write_config(client, cmd->id, "ok");
+}
+
+static void handle_capture(client_t* client, const command_t* cmd) {
+    if (cmd->length != 1) return;
+
+    switch (cmd->data[0]) {
+        case CAPTURE_STOP:
+            capture_stop();
+            break;
+        case CAPTURE_START:
+            capture_start();
+            break;
+        case CAPTURE_TRACE:
+            capture_start_trace();
+            break;
+        case CAPTURE_READ:
+            capture_streaming = true;
+            capture_client = client;
+            capture_header_sent = false;
+            break;
+        default:
+            break;
+    }
+}
+
+// Moves the capture ring into CMD_CAPTURE messages while the FIFO of the client
+// that asked for it has room, an empty one ends the stream once the recording
+// stopped and everything is out
+static void stream_capture(void) {
+    while (capture_streaming && tx_has_room(capture_client, MAX_MESSAGE_SIZE)) {
+        command_t cmd = {.type = CMD_CAPTURE};
+
+        if (!capture_header_sent) {
+            cmd.length = capture_file_header(cmd.data);
+            capture_header_sent = true;
+        }
+
+        // read the state first, records written after it are still streamed
+        bool recording = capture_recording();
+        cmd.length += capture_read(cmd.data + cmd.length, sizeof(cmd.data) - cmd.length);
+
+        if (cmd.length == 0) {
+            if (recording) return;
+            capture_streaming = false;
+        }
+
+        write_command(capture_client, &cmd);
+    }
+}
+
+// Answers CMD_CLIENTS with a map of client names ("cdc", "webusb") to maps of
+//   "connected"    the port is open
+//   "weight"       params.cdc_weight or params.webusb_weight
+//   "queued"       its commands in bt_command_ring
+//   "rx_commands"  commands and bytes received
+//   "rx_bytes"
+//   "tx_messages"  messages and bytes queued for it
+//   "tx_bytes"
+//   "tx_dropped"   messages for every client that did not fit
+//   "busy"         commands answered with CMD_BUSY
+static void write_clients(client_t* client, uint16_t id) {
+    command_t cmd = {.type = CMD_CLIENTS, .id = id};
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char*)cmd.data, sizeof(cmd.data));
+
+    mpack_build_map(&writer);
+    for (int i = 0; i < CLIENTS; ++i) {
+        const client_t* c = &clients[i];
+
+        mpack_write_cstr(&writer, c->name);
+        mpack_build_map(&writer);
+        mpack_write_cstr(&writer, "connected");
+        mpack_write_bool(&writer, c->connected());
+        mpack_write_cstr(&writer, "weight");
+        mpack_write_u8(&writer, client_weight(c));
+        mpack_write_cstr(&writer, "queued");
+        mpack_write_u32(&writer, client_queued(c));
+        mpack_write_cstr(&writer, "rx_commands");
+        mpack_write_u32(&writer, c->rx_commands);
+        mpack_write_cstr(&writer, "rx_bytes");
+        mpack_write_u32(&writer, c->rx_bytes);
+        mpack_write_cstr(&writer, "tx_messages");
+        mpack_write_u32(&writer, c->tx.messages);
+        mpack_write_cstr(&writer, "tx_bytes");
+        mpack_write_u32(&writer, c->tx.bytes);
+        mpack_write_cstr(&writer, "tx_dropped");
+        mpack_write_u32(&writer, c->tx.dropped);
+        mpack_write_cstr(&writer, "busy");
+        mpack_write_u32(&writer, c->busy);
+        mpack_complete_map(&writer);
+    }
+    mpack_complete_map(&writer);
+
+    cmd.length = mpack_writer_buffer_used(&writer);
+
+    if (mpack_writer_destroy(&writer) != mpack_ok) {
+        printf("USB: An error occurred encoding the client counters!\n");
+        return;
+    }
+
+    write_command(client, &cmd);
+}
 
 //--------------------------------------------------------------------+
-// USB CDC
+// Commands
 //--------------------------------------------------------------------+
 
-static size_t read_cdc(mpack_tree_t* tree, char* buf, size_t count) {
-    if (!tud_cdc_available()) return 0;
+typedef void (*cdc_handler_t)(client_t* client, const command_t* cmd);
+
+// ingest throughput traffic from host/tools/cdc_throughput.c
+static void handle_sink(__unused client_t* client, __unused const command_t* cmd) {
+}
+
+static void handle_credit(client_t* client, __unused const command_t* cmd) {
+    sync_credits(client);
+}
+
+static void handle_stats(client_t* client, const command_t* cmd) {
+    write_stats(client, cmd->id);
+}
 
-    uint32_t step = tud_cdc_read(buf, count);
+static void handle_boot(client_t* client, const command_t* cmd) {
+    write_boot(client, cmd->id);
+}
+
+static void handle_power(client_t* client, const command_t* cmd) {
+    write_power(client, cmd->id);
+}
+
+static void handle_clients(client_t* client, const command_t* cmd) {
+    write_clients(client, cmd->id);
+}
 
-    // tud_cdc_write(buf, step);
-    //  printf("%.*s\n", step, buf);
+// Answers a command that was rejected, so that a request does not wait for a
+// reply forever, and hands back the credit the host spent on it. Only
+// IMMEDIATE commands come without one. The id goes back as the host sent it.
+static void reject(client_t* client, const command_t* cmd) {
+    command_t busy;
+    command_reject(cmd, &busy);
 
-    // tud_cdc_write_flush();
+    char buf[MAX_MESSAGE_SIZE];
+    size_t count = command_to_mpack(&busy, buf, sizeof(buf));
+    if (count) write_raw(client, buf, count);
+    client->busy++;
 
-    return step;
+    if (command_takes_credit(cmd->type)) write_credits(client, 1, false);
 }
 
-#define MAX_NODES 32
-#define MAX_SIZE (MAX_NODES * 1024)
+// Records an accepted command if a trace is running
+static void trace_command(const client_t* client, const command_t* cmd) {
+    uint8_t header[TRACE_COMMAND_HEADER_SIZE] = {client - clients, cmd->type, cmd->id & 0xFF, cmd->id >> 8, cmd->flags};
+
+    capture_trace(TRACE_COMMAND, header, sizeof(header), cmd->data, cmd->length);
+}
+
+// the IMMEDIATE commands, see COMMANDS in cmd.h
+#define CDC_HANDLER(name, min, max, prio, handler) CMD_HANDLER_ENTRY(IMMEDIATE, name, prio, handler)
+static const cdc_handler_t cdc_handlers[CMD_COUNT] = {COMMANDS(CDC_HANDLER)};
+#undef CDC_HANDLER
+
+// Parses and handles the next complete command of the client, false if there
+// is none or its FIFO has no room for a reply. The stream tree keeps the bytes
+// of the following one buffered for the next call.
+static bool client_poll(client_t* client) {
+    if (!tx_has_room(client, MAX_MESSAGE_SIZE)) {
+        client->tx.blocked = true;
+        return false;
+    }
+
+    if (!mpack_tree_try_parse(&client->tree)) return false;
+
+    command_t bt_cmd;
+    mpack_node_t node = mpack_tree_root(&client->tree);
+
+    if (mpack_to_command(&node, &bt_cmd)) {
+        printf("USB: command not supported or of invalid length\n");
+        reject(client, &bt_cmd);
+        return true;
+    }
+
+    // the top bit names the client on the way through the bt task
+    if (bt_cmd.id > CMD_ID_MASK) {
+        printf("USB: request id 0x%04x out of range\n", bt_cmd.id);
+        reject(client, &bt_cmd);
+        return true;
+    }
+
+    client->rx_commands++;
+    power_activity();
+    trace_command(client, &bt_cmd);
+
+    cdc_handler_t handler = cdc_handlers[bt_cmd.type];
+    if (handler) {
+        handler(client, &bt_cmd);
+        return true;
+    }
+
+    uint16_t id = bt_cmd.id;
+    bt_cmd.id = cmd_id_tag(id, client - clients);
+
+    if (!cmd_ring_push(&bt_command_ring, &bt_cmd)) {
+        // the host ran out of credits, tell it instead of dropping
+        command_t busy = {.type = CMD_BUSY, .id = id, .length = 2};
+        busy.data[0] = bt_cmd.type;
+        busy.data[1] = FLOW_BUSY_FULL;
+        write_command(client, &busy);
+        client->busy++;
+        return true;
+    }
+
+    owners[owners_head++ % CMD_RING_SIZE] = client - clients;
+
+#if DUMP_COMMANDS
+    printf("USB: Data recived from %s (size: %d): '", client->name, bt_cmd.length);
+    for (int i = 0; i < bt_cmd.length; ++i)
+        printf("%02x ", bt_cmd.data[i]);
+    printf("'\n");
+#endif
+
+    return true;
+}
+
+// Nothing to do until the bt task hands over a message, a client sends data,
+// a FIFO has room again or pending replies are due. A client without room
+// for replies waits for its FIFO, not for its commands.
+static bool idle(bool routing_blocked) {
+    for (int i = 0; i < CLIENTS; ++i) {
+        if (!clients[i].tx.blocked && clients[i].available()) return false;
+    }
+
+    return routing_blocked || cmd_ring_empty(&usb_command_ring);
+}
 
 void cdc_task(__unused void* param) {
-    mpack_tree_t tree;
-    mpack_tree_init_stream(&tree, read_cdc, NULL, MAX_SIZE, MAX_NODES);
+    for (int i = 0; i < CLIENTS; ++i)
+        client_open_tree(&clients[i]);
+
+    cdc_handle = xTaskGetCurrentTaskHandle();
+    cmd_ring_set_wake(&usb_command_ring, &cdc_wake);
 
-    static command_t usb_cmd;
+    bool blocked = false;
 
     while (true) {
-        if (xQueueReceive(usb_command_queue, &usb_cmd, 0) != errQUEUE_EMPTY) {
-            if (usb_cmd.type != MPACK) {
-                char* buf;
-                size_t count = command_to_mpack(usb_cmd, &buf);
+        if (idle(blocked)) {
+            TickType_t timeout = wait_timeout();
+            if (timeout) ulTaskNotifyTake(pdTRUE, timeout);
+        }
 
-                if (count != -1)
-                    mpack_in_command(buf, count, &usb_cmd);
+        blocked = false;
 
-                free(buf);
-            }
+        for (int i = 0; i < CLIENTS; ++i)
+            clients[i].tx.blocked = false;
 
-            tud_cdc_write(usb_cmd.data, usb_cmd.length);
-            tud_cdc_write_flush();
-        }
+        // everything the bt task queued goes into the FIFOs before they are
+        // flushed, so a burst of replies shares its USB packets
+        command_t* next;
+        while ((next = cmd_ring_peek(&usb_command_ring)) && route(next))
+            cmd_ring_drop(&usb_command_ring);
+
+        for (int i = 0; i < CLIENTS; ++i)
+            blocked |= clients[i].tx.blocked;
 
-        if (!mpack_tree_try_parse(&tree)) {
-            if (mpack_tree_error(&tree) != mpack_ok) break;
+        // the next message waits for room in a FIFO, leave the clients' own
+        // commands in theirs until it went out
+        if (blocked) {
+            for (int i = 0; i < CLIENTS; ++i)
+                flush_tx(&clients[i]);
             continue;
         }
 
-        if (mpack_tree_error(&tree) != mpack_ok)
-            break;
+        collect_credits();
 
-        command_t bt_cmd;
-        mpack_node_t node = mpack_tree_root(&tree);
+        for (int i = 0; i < CLIENTS; ++i) {
+            client_t* client = &clients[i];
+            if (!tx_has_room(client, MAX_MESSAGE_SIZE)) continue;
 
-        if (mpack_to_command(&node, &bt_cmd)) {
-            printf("USB: command not supportet\n");
+            if (client->credit_sync) {
+                client->credit_sync = false;
+                sync_credits(client);
+            } else if (client->credits) {
+                write_credits(client, client->credits, false);
+                client->credits = 0;
+            }
         }
 
-        xQueueSend(bt_command_queue, &bt_cmd, 0);
+        stream_capture();
 
-        mpack_tree_destroy(&tree);
-        mpack_tree_init_stream(&tree, read_cdc, NULL, MAX_SIZE, MAX_NODES);
+        // weighted round-robin over the clients until none has a complete
+        // command left, a client that floods its port only gets its share
+        bool more = true;
+        while (more) {
+            more = false;
+
+            for (int i = 0; i < CLIENTS; ++i) {
+                for (int n = client_weight(&clients[i]); n && client_poll(&clients[i]); --n)
+                    more = true;
+            }
+        }
+
+        for (int i = 0; i < CLIENTS; ++i) {
+            client_t* client = &clients[i];
 
-        printf("USB: Data recived (size: %d): '", bt_cmd.length);
-        for (int i = 0; i < bt_cmd.length; ++i)
-            printf("%02x ", bt_cmd.data[i]);
-        printf("'\n");
+            if (mpack_tree_error(&client->tree) != mpack_ok) {
+                printf("USB: invalid mpack stream on %s, resetting\n", client->name);
+                mpack_tree_destroy(&client->tree);
+                client_open_tree(client);
+            }
+
+            flush_tx(client);
+        }
+    }
+}
+
+void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts) {
+    if (itf == CDC_TELEMETRY) {
+        if (dtr) telemetry_wake();
+        return;
+    }
+
+    if (dtr) boot_mark(BOOT_cdc_open);
+
+    // the host opened the port, hand it the initial credit window
+    if (dtr && cdc_handle) {
+        clients[CLIENT_CDC].credit_sync = true;
+        xTaskNotifyGive(cdc_handle);
     }
 }
 
-void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts) {}
-void tud_cdc_rx_cb(uint8_t itf) {}
+void tud_cdc_rx_cb(uint8_t itf) {
+    // the telemetry CDC only talks
+    if (itf == CDC_TELEMETRY) {
+        tud_cdc_n_read_flush(CDC_TELEMETRY);
+        return;
+    }
+
+    if (cdc_handle) xTaskNotifyGive(cdc_handle);
+}
+
+void tud_cdc_tx_complete_cb(uint8_t itf) {
+    if (itf != CDC_DATA) return;
+
+    client_t* client = &clients[CLIENT_CDC];
+    client->tx_transfers = client->tx_transfers + 1;
+
+    // the FIFO has room again
+    if (cdc_handle && client->tx.blocked) xTaskNotifyGive(cdc_handle);
+}
 
 //--------------------------------------------------------------------+
 // USB Vendor
@@ -194,14 +1129,18 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
                 web_serial_connected = (request->wValue != 0);
 
                 if (web_serial_connected) {
-                    printf("Web serial connected\n");
+                    printf("USB: WebUSB client connected\n");
 
-                    tud_vendor_write_str("\r\nWebUSB interface connected\r\n");
-                    tud_vendor_write_flush();
+                    // the page speaks the protocol, hand it its credit window
+                    clients[CLIENT_WEBUSB].credit_sync = true;
                 } else {
-                    printf("Web serial disconnected\n");
+                    printf("USB: WebUSB client disconnected\n");
                 }
 
+                // the credit window is split anew among the connected clients
+                if (tud_cdc_connected()) clients[CLIENT_CDC].credit_sync = true;
+                if (cdc_handle) xTaskNotifyGive(cdc_handle);
+
                 // response with status OK
                 return tud_control_status(rhport, request);
             }
@@ -216,10 +1155,13 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
 }
 
 void tud_vendor_rx_cb(uint8_t itf, uint8_t const* buffer, uint16_t bufsize) {
-    (void)itf;
+    // the data waits in the FIFO for the cdc task
+    if (cdc_handle) xTaskNotifyGive(cdc_handle);
+}
 
-    echo_all(buffer, bufsize);
+void tud_vendor_tx_cb(uint8_t itf, uint32_t sent_bytes) {
+    client_t* client = &clients[CLIENT_WEBUSB];
+    client->tx_transfers = client->tx_transfers + 1;
 
-    // if using RX buffered is enabled, we need to flush the buffer to make room for new data
-    tud_vendor_read_flush();
-}
\ No newline at end of file
+    if (cdc_handle && client->tx.blocked) xTaskNotifyGive(cdc_handle);
+}
@@ -1,7 +1,16 @@
 #pragma once
 
 #define USBD_STACK_SIZE (3 * configMINIMAL_STACK_SIZE / 2) * (CFG_TUSB_DEBUG ? 2 : 1)
-#define CDC_STACK_SIZE configMINIMAL_STACK_SIZE
+// splitting a batch of the bt task nests a command_t and an encoded copy
+#define CDC_STACK_SIZE (2 * configMINIMAL_STACK_SIZE)
+#define TELEMETRY_STACK_SIZE configMINIMAL_STACK_SIZE
 
 void usb_device_task(void* param);
-void cdc_task(void* param);
\ No newline at end of file
+void cdc_task(void* param);
+
+// Telemetry CDC: every printf and, each params.telemetry_ms, a map of
+// counters, sent as msgpack maps with the uptime in "t" and either "log" or
+// the counters. telemetry_init() hooks into stdio, call it right after
+// stdio_init_all() to keep the boot log.
+void telemetry_init(void);
+void telemetry_task(void* param);
\ No newline at end of file
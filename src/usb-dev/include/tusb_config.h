@@ -3,6 +3,9 @@
 
 #define CFG_TUD_ENABLED (1)
 
+// tud_task() blocks on the event queue, so the usbd task leaves its core idle
+#define CFG_TUSB_OS OPT_OS_FREERTOS
+
 //--------------------------------------------------------------------
 // DEVICE CONFIGURATION
 //--------------------------------------------------------------------
@@ -13,22 +16,28 @@
 #define CFG_TUD_ENDPOINT0_SIZE 64
 
 //------------- CLASS -------------//
-#define CFG_TUD_CDC 1
+// data and telemetry, see usb_descriptors.h
+#define CFG_TUD_CDC 2
 #define CFG_TUD_MSC 0
 #define CFG_TUD_HID 0
 #define CFG_TUD_MIDI 0
 #define CFG_TUD_VENDOR 1
 
 // CDC FIFO size of TX and RX
-#define CFG_TUD_CDC_RX_BUFSIZE (TUD_OPT_HIGH_SPEED ? 512 : 64)
-#define CFG_TUD_CDC_TX_BUFSIZE (TUD_OPT_HIGH_SPEED ? 512 : 64)
+// RX holds 64 full speed packets so the host can keep streaming while the cdc
+// task is busy parsing the previous message
+#define CFG_TUD_CDC_RX_BUFSIZE (TUD_OPT_HIGH_SPEED ? 8192 : 4096)
+#define CFG_TUD_CDC_TX_BUFSIZE (TUD_OPT_HIGH_SPEED ? 2048 : 1024)
 
-// CDC Endpoint transfer buffer size, more is faster
+// CDC Endpoint transfer buffer size, one packet
+// A larger OUT transfer only completes on a short packet or once it is full,
+// a host write of a multiple of 64 bytes without a ZLP would sit in the
+// endpoint until more data arrives. The FIFOs carry the throughput instead.
 #define CFG_TUD_CDC_EP_BUFSIZE (TUD_OPT_HIGH_SPEED ? 512 : 64)
 
 // Vendor FIFO size of TX and RX
-// If zero: vendor endpoints will not be buffered
-#define CFG_TUD_VENDOR_RX_BUFSIZE (TUD_OPT_HIGH_SPEED ? 512 : 64)
-#define CFG_TUD_VENDOR_TX_BUFSIZE (TUD_OPT_HIGH_SPEED ? 512 : 64)
+// WebUSB is a client like the data CDC, a reply has to fit into the TX FIFO
+#define CFG_TUD_VENDOR_RX_BUFSIZE (TUD_OPT_HIGH_SPEED ? 4096 : 2048)
+#define CFG_TUD_VENDOR_TX_BUFSIZE (TUD_OPT_HIGH_SPEED ? 2048 : 512)
 
 #endif
\ No newline at end of file
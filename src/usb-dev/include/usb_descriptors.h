@@ -8,6 +8,12 @@ enum {
     VENDOR_REQUEST_MICROSOFT = 2
 };
 
+// CDC instances, the host sees them in this order
+enum {
+    CDC_DATA = 0,
+    CDC_TELEMETRY,
+};
+
 extern uint8_t const desc_ms_os_20[];
 
 #endif /* USB_DESCRIPTORS_H_ */
\ No newline at end of file
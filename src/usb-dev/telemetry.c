@@ -0,0 +1,215 @@
+#include "telemetry.h"
+
+#include <stdio.h>
+
+#include "cmd.h"
+#if DITOO_STATIC_ALLOC
+#include "arena.h"
+#endif
+#include "dev.h"
+#include "params.h"
+#include "power.h"
+#include "usb_descriptors.h"
+
+// FreeRTOS
+#include "FreeRTOS.h"
+#include "task.h"
+
+// mpack
+#include "mpack/mpack.h"
+
+// tinyusb
+#include "tusb.h"
+
+// Pico
+#include "pico/stdio/driver.h"
+#include "pico/stdlib.h"
+
+// printf output waiting for the telemetry CDC, the oldest bytes stay and new
+// ones are dropped once it is full, so the boot log survives until a host
+// opens the port. Must be a power of two.
+#define LOG_RING_SIZE 2048
+// longer lines are sent in pieces
+#define LOG_LINE_MAX 120
+// how often pending log lines are picked up while the port is open
+#define TELEMETRY_POLL_MS 50
+
+// map header, "t" and its value, "log" and the string header
+#define LOG_MESSAGE_MAX (LOG_LINE_MAX + 24)
+#define COUNTERS_MESSAGE_MAX 160
+
+static char log_ring[LOG_RING_SIZE];
+// stdio serialises its drivers, so there is a single producer
+static volatile uint32_t log_head;
+static volatile uint32_t log_tail;
+static volatile uint32_t log_dropped;
+
+static TaskHandle_t telemetry_handle;
+
+static void log_out_chars(const char* buf, int length);
+
+static stdio_driver_t log_driver = {
+    .out_chars = &log_out_chars,
+};
+
+//--------------------------------------------------------------------+
+// Log
+//--------------------------------------------------------------------+
+
+// Called by printf from any task, never blocks
+static void log_out_chars(const char* buf, int length) {
+    uint32_t head = log_head;
+    uint32_t room = LOG_RING_SIZE - (head - ring_load_acquire(&log_tail));
+
+    if ((uint32_t)length > room) {
+        log_dropped = log_dropped + (length - room);
+        length = room;
+    }
+
+    for (int i = 0; i < length; ++i)
+        log_ring[(head + i) & (LOG_RING_SIZE - 1)] = buf[i];
+
+    ring_store_release(&log_head, head + length);
+}
+
+// Copies the next line without its newline and sets consumed to the bytes it
+// takes in the ring, consumed is left alone if there is no complete line. A
+// line that does not fit is cut.
+static size_t log_peek_line(char* line, size_t* consumed) {
+    uint32_t tail = log_tail;
+    uint32_t count = ring_load_acquire(&log_head) - tail;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        char c = log_ring[(tail + i) & (LOG_RING_SIZE - 1)];
+
+        if (c == '\n') {
+            *consumed = i + 1;
+            return i;
+        }
+
+        if (i == LOG_LINE_MAX) {
+            *consumed = i;
+            return i;
+        }
+
+        line[i] = c;
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------+
+// Messages
+//--------------------------------------------------------------------+
+
+static bool write_message(const char* buf, size_t length) {
+    if (tud_cdc_n_write_available(CDC_TELEMETRY) < length) return false;
+
+    tud_cdc_n_write(CDC_TELEMETRY, buf, length);
+    return true;
+}
+
+// Sends complete log lines for as long as the FIFO takes them
+static void send_logs(void) {
+    char line[LOG_LINE_MAX];
+    char buf[LOG_MESSAGE_MAX];
+    size_t length, consumed = 0;
+
+    while ((length = log_peek_line(line, &consumed)) || consumed) {
+        // strip the CR of CRLF translation
+        if (length && line[length - 1] == '\r') length--;
+
+        mpack_writer_t writer;
+        mpack_writer_init(&writer, buf, sizeof(buf));
+
+        mpack_build_map(&writer);
+        mpack_write_cstr(&writer, "t");
+        mpack_write_u32(&writer, to_ms_since_boot(get_absolute_time()));
+        mpack_write_cstr(&writer, "log");
+        mpack_write_str(&writer, line, length);
+        mpack_complete_map(&writer);
+
+        size_t used = mpack_writer_buffer_used(&writer);
+        if (mpack_writer_destroy(&writer) != mpack_ok) used = 0;
+
+        // empty lines are skipped
+        if (used && length && !write_message(buf, used)) return;
+
+        ring_store_release(&log_tail, log_tail + consumed);
+        consumed = 0;
+    }
+}
+
+static bool send_counters(void) {
+    char buf[COUNTERS_MESSAGE_MAX];
+    power_stats_t power;
+    power_stats(&power);
+
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buf, sizeof(buf));
+
+    mpack_build_map(&writer);
+    mpack_write_cstr(&writer, "t");
+    mpack_write_u32(&writer, power.uptime_ms);
+    mpack_write_cstr(&writer, "power");
+    mpack_write_cstr(&writer, power_state_name(power.state));
+    mpack_write_cstr(&writer, "bt_queue");
+    mpack_write_u32(&writer, cmd_ring_count(&bt_command_ring));
+    mpack_write_cstr(&writer, "usb_queue");
+    mpack_write_u32(&writer, cmd_ring_count(&usb_command_ring));
+#if DITOO_STATIC_ALLOC
+    mpack_write_cstr(&writer, "arena_used");
+    mpack_write_u32(&writer, arena_used());
+#else
+    mpack_write_cstr(&writer, "heap_free");
+    mpack_write_u32(&writer, xPortGetFreeHeapSize());
+#endif
+    mpack_write_cstr(&writer, "log_dropped");
+    mpack_write_u32(&writer, log_dropped);
+    mpack_complete_map(&writer);
+
+    size_t used = mpack_writer_buffer_used(&writer);
+
+    if (mpack_writer_destroy(&writer) != mpack_ok) {
+        printf("USB: An error occurred encoding the telemetry!\n");
+        return true;
+    }
+
+    return write_message(buf, used);
+}
+
+//--------------------------------------------------------------------+
+// Main
+//--------------------------------------------------------------------+
+
+void telemetry_init(void) {
+    stdio_set_driver_enabled(&log_driver, true);
+}
+
+void telemetry_wake(void) {
+    if (telemetry_handle) xTaskNotifyGive(telemetry_handle);
+}
+
+// Runs below every other task, it only gets the time the data path leaves.
+// Everything goes through the telemetry CDC's own FIFO.
+void telemetry_task(__unused void* param) {
+    telemetry_handle = xTaskGetCurrentTaskHandle();
+    TickType_t reported = xTaskGetTickCount();
+
+    while (true) {
+        bool open = tud_cdc_n_connected(CDC_TELEMETRY) && !power_suspended();
+
+        // nobody listens, the log collects in the ring until the port opens
+        ulTaskNotifyTake(pdTRUE, open ? pdMS_TO_TICKS(TELEMETRY_POLL_MS) : portMAX_DELAY);
+
+        if (!tud_cdc_n_connected(CDC_TELEMETRY)) continue;
+
+        send_logs();
+
+        TickType_t now = xTaskGetTickCount();
+        if (params.telemetry_ms && now - reported >= pdMS_TO_TICKS(params.telemetry_ms) && send_counters())
+            reported = now;
+
+        tud_cdc_n_write_flush(CDC_TELEMETRY);
+    }
+}
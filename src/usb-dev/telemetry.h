@@ -0,0 +1,4 @@
+#pragma once
+
+// Wakes the telemetry task after the host opened or resumed the port
+void telemetry_wake(void);
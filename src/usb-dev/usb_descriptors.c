@@ -40,6 +40,9 @@ enum {
     ITF_NUM_CDC_0 = 0,
     ITF_NUM_CDC_0_DATA,
     ITF_NUM_VENDOR,
+    // after the vendor interface, so WebUSB keeps its interface number
+    ITF_NUM_CDC_1,
+    ITF_NUM_CDC_1_DATA,
     ITF_NUM_TOTAL
 };
 
@@ -54,6 +57,10 @@ enum {
 #define EPNUM_VENDOR_OUT 0x03
 #define EPNUM_VENDOR_IN 0x83
 
+#define EPNUM_CDC_1_NOTIF 0x84  // notification endpoint for CDC 1
+#define EPNUM_CDC_1_OUT 0x05    // out endpoint for CDC 1
+#define EPNUM_CDC_1_IN 0x85     // in endpoint for CDC 1
+
 // configure descriptor (for 2 CDC interfaces)
 uint8_t const desc_configuration[] = {
     // config descriptor | how much power in mA, count of interfaces, ...
@@ -64,6 +71,10 @@ uint8_t const desc_configuration[] = {
 
     // Interface number, string index, EP Out & IN address, EP size
     TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 5, EPNUM_VENDOR_OUT, 0x80 | EPNUM_VENDOR_IN, TUD_OPT_HIGH_SPEED ? 512 : 64),
+
+    // CDC 1: telemetry and logs, endpoints of its own so it never waits
+    // behind the data CDC
+    TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_1, 6, EPNUM_CDC_1_NOTIF, 8, EPNUM_CDC_1_OUT, 0x80 | EPNUM_CDC_1_IN, TUD_OPT_HIGH_SPEED ? 512 : 64),
 };
 
 #define MS_OS_20_DESC_LEN 0xB2
@@ -144,6 +155,7 @@ enum {
     STRID_SERIAL,        // 3: Serials
     STRID_CDC_0,         // 4: CDC Interface 0
     STRID_VENDOR,
+    STRID_CDC_1,
 };
 
 // array of pointer to string descriptors
@@ -154,7 +166,8 @@ char const *string_desc_arr[] = {
     "Ditoo USB Adapter",         // 2: Product
     NULL,                        // 3: Serials (null so it uses unique ID if available)
     "Ditoo USB CDC Adapter",     // 4: CDC Interface 0
-    "Ditoo WebUSB"               // 5: Vendor Interface
+    "Ditoo WebUSB",              // 5: Vendor Interface
+    "Ditoo Telemetry",           // 6: CDC Interface 1
 };
 
 // buffer to hold the string descriptor during the request | plus 1 for the null terminator